@@ -0,0 +1,730 @@
+/*
+ * bench.c
+ *
+ * Benchmarks of the decryption kernel, decrypt and decrypt_file on fixed
+ * corpora, and a differential check that every optimized path produces
+ * exactly the output of a plain reference decryption. The corpora come from
+ * a seeded generator, so every run decrypts the same bytes.
+ *
+ * James Shephard
+ * CMPT 300 - D100 Burnaby
+ * Instructor Brian Booth
+ * TA Scott Kristjanson
+ */
+
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include "child.h"
+#include "common.h"
+#include "decrypt.h"
+#include "memwatch.h"
+
+//Seed of every corpus
+#define BENCH_SEED 0x6C797265U
+//Blocks exponentiated by each kernel benchmark
+#define BENCH_BLOCKS (1 << 20)
+//Tweets decrypted by each string benchmark
+#define BENCH_TWEETS 100000
+//Tweets in the file decrypted by each file benchmark
+#define BENCH_FILE_TWEETS 200000
+//Times each benchmark is run, the fastest is reported
+#define BENCH_RUNS 5
+//Tweets checked against the reference
+#define CHECK_TWEETS 20000
+//Longest line in the check corpus, so fgets sized pieces of a line are checked
+#define CHECK_LINE_LENGTH 400
+//Size of each part when checking a file split between several calls
+#define CHECK_SPLIT_SIZE 50000
+//Block cache entries used when checking the cached paths
+#define CHECK_CACHE_ENTRIES 4096
+//Prime factors of DECRYPT_KEY_N, for checking the CRT path
+#define KEY_P 8191U
+#define KEY_Q 524287U
+
+//Needed by child.c, left at zero as nothing here goes through perform_task
+client_options options;
+
+//The 41 characters of the encrypted alphabet, in value order
+static const char alphabet[] = " abcdefghijklmnopqrstuvwxyz#.,'!?()-:$/&\\";
+
+//Place value of each character within a 6 character block
+static const unsigned long long place[6] = {
+	115856201, 2825761, 68921, 1681, 41, 1
+};
+
+//Tweets of a corpus, one after another
+typedef struct {
+	char* data;
+	int* offsets;
+	int* lengths;
+	int count;
+	size_t size;
+} corpus;
+
+static unsigned long long random_state;
+
+/*
+ * next_random
+ *
+ * returns: Next number of the seeded generator (xorshift64*)
+*/
+static unsigned int next_random()
+{
+	random_state ^= random_state >> 12;
+	random_state ^= random_state << 25;
+	random_state ^= random_state >> 27;
+	return (unsigned int)((random_state * 0x2545F4914F6CDD1DULL) >> 32);
+}
+
+/*
+ * make_tweet
+ *
+ * Writes an encrypted tweet of random characters. Every 8th character is
+ * skipped when decrypting, so those are drawn from a wider set.
+ *
+ * output: Location to store the tweet, not null-terminated
+ * length: Length of the tweet
+*/
+static void make_tweet(char* output, int length)
+{
+	for (int j = 0; j < length; j++)
+	{
+		if ((j + 1) % 8 == 0)
+			output[j] = 'A' + next_random() % 26;
+		else
+			output[j] = alphabet[next_random() % 41];
+	}
+}
+
+/*
+ * make_corpus
+ *
+ * Generates a corpus of tweets from a seed, the same one every time.
+ *
+ * count:   Number of tweets
+ * longest: Longest tweet
+ * edges:   Start with a tweet of every length from 0 to longest, and mix in
+ *          some with a character outside the alphabet
+ * seed:    Seed of the generator
+ *
+ * returns: False if malloc fails
+*/
+static bool make_corpus(corpus* c, int count, int longest, bool edges, unsigned int seed)
+{
+	random_state = seed;
+	c->count = count;
+	c->size = 0;
+	c->data = (char*)malloc((size_t)count * longest);
+	c->offsets = (int*)malloc(count * sizeof(int));
+	c->lengths = (int*)malloc(count * sizeof(int));
+	if (c->data == NULL || c->offsets == NULL || c->lengths == NULL)
+		return false;
+
+	for (int t = 0; t < count; t++)
+	{
+		int length = (edges && t <= longest) ? t : 1 + next_random() % longest;
+		c->offsets[t] = c->size;
+		c->lengths[t] = length;
+		//Lines longer than a tweet are decrypted in fgets sized pieces, 
+		//each skipping its own 8th characters
+		for (int j = 0; j < length; j += MAX_TWEET_LENGTH - 1)
+			make_tweet(c->data + c->size + j, length - j < MAX_TWEET_LENGTH - 1 ? 
+				length - j : MAX_TWEET_LENGTH - 1);
+		if (edges && t > longest && t % 97 == 0 && length > 1)
+			c->data[c->size + next_random() % (length - 1)] = 'Q';
+		c->size += length;
+	}
+	return true;
+}
+
+/*
+ * free_corpus
+*/
+static void free_corpus(corpus* c)
+{
+	free(c->data);
+	free(c->offsets);
+	free(c->lengths);
+}
+
+/*
+ * reference_decrypt
+ *
+ * Decrypts a tweet the plain way, one block at a time with
+ * modular_exponentiation, as the assignment describes it.
+ *
+ * input:  Encrypted tweet
+ * length: Length of input
+ * output: Location to store the decrypted tweet, not null-terminated
+ *
+ * returns: Length of the decrypted tweet, -1 for an invalid character
+*/
+static int reference_decrypt(const char* input, int length, char* output)
+{
+	char values[CHECK_LINE_LENGTH];
+	int count = 0;
+	for (int j = 0; j < length; j++)
+	{
+		if ((j + 1) % 8 == 0)
+			continue;
+		const char* found = input[j] == '\0' ? NULL : strchr(alphabet, input[j]);
+		if (found == NULL)
+			return -1;
+		values[count++] = found - alphabet;
+	}
+
+	for (int i = 0; i < count; i += 6)
+	{
+		int width = count - i < 6 ? count - i : 6;
+		unsigned long long packed = 0;
+		for (int k = 0; k < width; k++)
+			packed += values[i + k] * place[k];
+
+		//Blocks over 32 bits were always truncated
+		unsigned long long block = modular_exponentiation((unsigned int)packed,
+			DECRYPT_KEY_D, DECRYPT_KEY_N);
+		for (int k = 0; k < width; k++)
+			output[i + k] = alphabet[block / place[k] % 41];
+	}
+	return count;
+}
+
+/*
+ * reference_file
+ *
+ * Decrypts a file the plain way, splitting lines as fgets does, stopping at
+ * the first invalid tweet.
+ *
+ * returns: False if a file could not be opened
+*/
+static bool reference_file(const char* file_in, const char* file_out)
+{
+	FILE* in = fopen(file_in, "r");
+	FILE* out = fopen(file_out, "w");
+	if (in == NULL || out == NULL)
+	{
+		if (in != NULL)
+			fclose(in);
+		if (out != NULL)
+			fclose(out);
+		return false;
+	}
+
+	char line[MAX_TWEET_LENGTH];
+	char decrypted[MAX_TWEET_LENGTH];
+	while (fgets(line, sizeof(line), in) != NULL)
+	{
+		int length = strlen(line);
+		bool newline = length > 0 && line[length - 1] == '\n';
+		int result = reference_decrypt(line, length - newline, decrypted);
+		if (result < 0)
+			break;
+		fwrite(decrypted, 1, result, out);
+		if (newline)
+			fputc('\n', out);
+	}
+	fclose(in);
+	fclose(out);
+	return true;
+}
+
+/*
+ * write_corpus
+ *
+ * Writes a corpus to a file, one tweet per line.
+ *
+ * returns: False if an error occurs
+*/
+static bool write_corpus(corpus* c, const char* path)
+{
+	FILE* file = fopen(path, "w");
+	if (file == NULL)
+		return false;
+	for (int t = 0; t < c->count; t++)
+	{
+		fwrite(c->data + c->offsets[t], 1, c->lengths[t], file);
+		fputc('\n', file);
+	}
+	return fclose(file) == 0;
+}
+
+/*
+ * same_files
+ *
+ * returns: True if both files exist and have the same contents
+*/
+static bool same_files(const char* a, const char* b)
+{
+	FILE* x = fopen(a, "r");
+	FILE* y = fopen(b, "r");
+	bool same = x != NULL && y != NULL;
+	while (same)
+	{
+		int i = fgetc(x);
+		int j = fgetc(y);
+		same = i == j;
+		if (i == EOF)
+			break;
+	}
+	if (x != NULL)
+		fclose(x);
+	if (y != NULL)
+		fclose(y);
+	return same;
+}
+
+/*
+ * check_strings
+ *
+ * Compares decrypt_r, decrypt and decrypt_batch_r against the reference on
+ * every tweet of the check corpus.
+ *
+ * name: Name of the configuration being checked, for messages
+ *
+ * returns: Number of mismatches
+*/
+static int check_strings(corpus* c, const char* name)
+{
+	char expected[CHECK_LINE_LENGTH];
+	char buffer[CHECK_LINE_LENGTH + 1];
+	int failures = 0;
+
+	for (int t = 0; t < c->count; t++)
+	{
+		const char* tweet = c->data + c->offsets[t];
+		int length = c->lengths[t];
+		int result = reference_decrypt(tweet, length, expected);
+
+		int got = decrypt_r(tweet, length, buffer);
+		if (got != result || (result > 0 && memcmp(buffer, expected, result) != 0))
+		{
+			if (failures++ < 5)
+				printf("MISMATCH %s decrypt_r tweet %i (length %i)\n", name, t, length);
+		}
+
+		memcpy(buffer, tweet, length);
+		buffer[length] = '\0';
+		got = decrypt(buffer);
+		if (got != result || (result > 0 && memcmp(buffer, expected, result) != 0))
+		{
+			if (failures++ < 5)
+				printf("MISMATCH %s decrypt tweet %i (length %i)\n", name, t, length);
+		}
+	}
+
+	//Whole batches, each stopping at its first invalid tweet
+	const char* inputs[DECRYPT_BATCH_TWEETS];
+	int lengths[DECRYPT_BATCH_TWEETS];
+	char* outputs[DECRYPT_BATCH_TWEETS];
+	char* space = (char*)malloc(DECRYPT_BATCH_TWEETS * CHECK_LINE_LENGTH);
+	if (space == NULL)
+		return failures + 1;
+	int t = 0;
+	while (t < c->count)
+	{
+		int count = 0;
+		while (count < DECRYPT_BATCH_TWEETS && t + count < c->count)
+		{
+			inputs[count] = c->data + c->offsets[t + count];
+			lengths[count] = c->lengths[t + count];
+			outputs[count] = space + count * CHECK_LINE_LENGTH;
+			count++;
+		}
+
+		int done = decrypt_batch_r(inputs, lengths, outputs, count);
+		for (int i = 0; i <= done && i < count; i++)
+		{
+			int result = reference_decrypt(inputs[i], lengths[i], expected);
+			bool valid = i < done;
+			if (valid != (result >= 0) || (valid && memcmp(outputs[i], expected, result) != 0))
+			{
+				if (failures++ < 5)
+					printf("MISMATCH %s decrypt_batch_r tweet %i (length %i)\n", name, t + i, lengths[i]);
+			}
+		}
+		//Carry on after the invalid tweet
+		t += done < count ? done + 1 : count;
+	}
+	free(space);
+	return failures;
+}
+
+/*
+ * check_files
+ *
+ * Compares decrypt_file, decrypt_file_pipelined and a file split between
+ * several decrypt_file_range calls against the reference.
+ *
+ * input:    Encrypted file
+ * expected: Reference decryption of it
+ * output:   Location to decrypt to
+ * name:     Name of the configuration being checked, for messages
+ *
+ * returns: Number of mismatches
+*/
+static int check_files(char* input, char* expected, char* output, const char* name)
+{
+	int failures = 0;
+
+	if (decrypt_file(input, output) != 0 || !same_files(output, expected))
+	{
+		printf("MISMATCH %s decrypt_file\n", name);
+		failures++;
+	}
+
+	if (decrypt_file_pipelined(input, output) != 0 || !same_files(output, expected))
+	{
+		printf("MISMATCH %s decrypt_file_pipelined\n", name);
+		failures++;
+	}
+
+	file_range ranges[64];
+	unlink(output);
+	int count = split_file(input, output, CHECK_SPLIT_SIZE, ranges, 64);
+	bool ranged = count > 1;
+	for (int i = 0; i < count; i++)
+		if (decrypt_file_range(input, output, ranges[i].in_offset,
+			ranges[i].in_length, ranges[i].out_offset) != 0)
+			ranged = false;
+	if (!ranged || !same_files(output, expected))
+	{
+		printf("MISMATCH %s decrypt_file_range (%i parts)\n", name, count);
+		failures++;
+	}
+
+	return failures;
+}
+
+/*
+ * run_checks
+ *
+ * Runs every check on the direct path, with each kernel this CPU can run,
+ * with the block cache, and with the Chinese Remainder Theorem.
+ *
+ * dir: Directory for the files checked
+ *
+ * returns: Number of mismatches
+*/
+static int run_checks(const char* dir)
+{
+	corpus c;
+	if (!make_corpus(&c, CHECK_TWEETS, CHECK_LINE_LENGTH - 1, true, BENCH_SEED))
+	{
+		printf("Malloc failed making the check corpus.\n");
+		return 1;
+	}
+
+	//Files only hold valid tweets, as decrypting stops at an invalid one
+	corpus valid;
+	if (!make_corpus(&valid, CHECK_TWEETS, CHECK_LINE_LENGTH - 1, false, BENCH_SEED))
+	{
+		printf("Malloc failed making the check corpus.\n");
+		free_corpus(&c);
+		return 1;
+	}
+
+	char input[MAX_LOCATION_LENGTH], expected[MAX_LOCATION_LENGTH], output[MAX_LOCATION_LENGTH];
+	snprintf(input, sizeof(input), "%s/lyrebird.check.%i.in", dir, getpid());
+	snprintf(expected, sizeof(expected), "%s/lyrebird.check.%i.ref", dir, getpid());
+	snprintf(output, sizeof(output), "%s/lyrebird.check.%i.out", dir, getpid());
+	int failures = 0;
+	if (!write_corpus(&valid, input) || !reference_file(input, expected))
+	{
+		printf("Unable to write %s.\n", input);
+		failures++;
+	}
+	else
+	{
+		failures += check_strings(&c, "direct");
+		failures += check_files(input, expected, output, "direct");
+
+		//Batches again with every other kernel this CPU can run
+		const char* selected = decrypt_kernel_name();
+		for (int i = 0; decrypt_kernel_at(i) != NULL; i++)
+		{
+			const char* name = decrypt_kernel_at(i);
+			if (strcmp(name, selected) == 0 || !decrypt_select_kernel(name))
+				continue;
+			failures += check_strings(&c, name);
+			failures += check_files(input, expected, output, name);
+		}
+		decrypt_select_kernel(selected);
+
+		decrypt_cache_init(CHECK_CACHE_ENTRIES);
+		failures += check_strings(&c, "cached");
+		failures += check_files(input, expected, output, "cached");
+		decrypt_cache_free();
+
+		if (!decrypt_set_factors(KEY_P, KEY_Q))
+		{
+			printf("Unable to set the factors of the key.\n");
+			failures++;
+		}
+		failures += check_strings(&c, "crt");
+		failures += check_files(input, expected, output, "crt");
+		decrypt_set_factors(0, 0);
+	}
+
+	unlink(input);
+	unlink(expected);
+	unlink(output);
+	free_corpus(&c);
+	free_corpus(&valid);
+
+	printf("check: %s, %i tweets on each of the direct, cached and crt paths and every kernel%s\n",
+		failures == 0 ? "ok" : "FAILED", CHECK_TWEETS, failures == 0 ? "" : ", see above");
+	return failures;
+}
+
+/*
+ * report
+ *
+ * Prints the fastest of a benchmark's runs.
+ *
+ * name:    Name of the benchmark
+ * seconds: Fastest run
+ * count:   Operations in each run
+ * unit:    What an operation is
+ * bytes:   Bytes handled in each run, 0 if not meaningful
+*/
+static void report(const char* name, double seconds, double count, const char* unit, double bytes)
+{
+	printf("%-28s %10.1f ns/%s %14.0f %s/s", name, seconds * 1e9 / count, unit, count / seconds, unit);
+	if (bytes > 0)
+		printf(" %9.1f MB/s", bytes / seconds / 1e6);
+	printf("\n");
+}
+
+/*
+ * run_benchmarks
+ *
+ * Times the exponentiation kernels, string decryption and file decryption.
+ *
+ * dir: Directory for the files decrypted
+ *
+ * returns: False if something could not be set up
+*/
+static bool run_benchmarks(const char* dir)
+{
+	unsigned int* blocks = (unsigned int*)malloc(BENCH_BLOCKS * sizeof(unsigned int));
+	if (blocks == NULL)
+		return false;
+	random_state = BENCH_SEED;
+	for (int i = 0; i < BENCH_BLOCKS; i++)
+		blocks[i] = next_random() % DECRYPT_KEY_N;
+
+	//Summed so the work cannot be optimized away
+	volatile unsigned long long sink = 0;
+	double best = 0;
+	for (int run = 0; run < BENCH_RUNS; run++)
+	{
+		unsigned long long sum = 0;
+		double start = getseconds();
+		for (int i = 0; i < BENCH_BLOCKS; i++)
+			sum += modular_exponentiation(blocks[i], DECRYPT_KEY_D, DECRYPT_KEY_N);
+		double elapsed = getseconds() - start;
+		sink += sum;
+		if (run == 0 || elapsed < best)
+			best = elapsed;
+	}
+	report("modular_exponentiation", best, BENCH_BLOCKS, "block", 0);
+
+	for (int run = 0; run < BENCH_RUNS; run++)
+	{
+		unsigned long long sum = 0;
+		double start = getseconds();
+		for (int i = 0; i < BENCH_BLOCKS; i++)
+			sum += key_exponentiation(blocks[i], DECRYPT_KEY_D, DECRYPT_KEY_N);
+		double elapsed = getseconds() - start;
+		sink += sum;
+		if (run == 0 || elapsed < best)
+			best = elapsed;
+	}
+	report("key_exponentiation", best, BENCH_BLOCKS, "block", 0);
+	free(blocks);
+
+	corpus c;
+	if (!make_corpus(&c, BENCH_TWEETS, MAX_TWEET_LENGTH - 2, false, BENCH_SEED))
+	{
+		free_corpus(&c);
+		return false;
+	}
+	char* copy = (char*)malloc(c.size + c.count);
+	char** tweets = (char**)malloc(c.count * sizeof(char*));
+	if (copy == NULL || tweets == NULL)
+	{
+		free(copy);
+		free(tweets);
+		free_corpus(&c);
+		return false;
+	}
+
+	for (int run = 0; run < BENCH_RUNS; run++)
+	{
+		//decrypt works in place, so each run starts from a fresh copy
+		for (int t = 0; t < c.count; t++)
+		{
+			tweets[t] = copy + c.offsets[t] + t;
+			memcpy(tweets[t], c.data + c.offsets[t], c.lengths[t]);
+			tweets[t][c.lengths[t]] = '\0';
+		}
+		double start = getseconds();
+		for (int t = 0; t < c.count; t++)
+			decrypt(tweets[t]);
+		double elapsed = getseconds() - start;
+		if (run == 0 || elapsed < best)
+			best = elapsed;
+	}
+	report("decrypt", best, c.count, "tweet", c.size);
+
+	//Once with each kernel this CPU can run, then back to the selected one
+	const char* selected = decrypt_kernel_name();
+	for (int i = 0; decrypt_kernel_at(i) != NULL; i++)
+	{
+		char name[64];
+		if (!decrypt_select_kernel(decrypt_kernel_at(i)))
+			continue;
+		for (int run = 0; run < BENCH_RUNS; run++)
+		{
+			for (int t = 0; t < c.count; t++)
+			{
+				memcpy(tweets[t], c.data + c.offsets[t], c.lengths[t]);
+				tweets[t][c.lengths[t]] = '\0';
+			}
+			double start = getseconds();
+			decrypt_batch(tweets, c.count);
+			double elapsed = getseconds() - start;
+			if (run == 0 || elapsed < best)
+				best = elapsed;
+		}
+		snprintf(name, sizeof(name), "decrypt_batch (%s)", decrypt_kernel_at(i));
+		report(name, best, c.count, "tweet", c.size);
+	}
+	decrypt_select_kernel(selected);
+	free(copy);
+	free(tweets);
+	free_corpus(&c);
+
+	if (!make_corpus(&c, BENCH_FILE_TWEETS, MAX_TWEET_LENGTH - 2, false, BENCH_SEED))
+	{
+		free_corpus(&c);
+		return false;
+	}
+	char input[MAX_LOCATION_LENGTH], output[MAX_LOCATION_LENGTH];
+	snprintf(input, sizeof(input), "%s/lyrebird.bench.%i.in", dir, getpid());
+	snprintf(output, sizeof(output), "%s/lyrebird.bench.%i.out", dir, getpid());
+	bool written = write_corpus(&c, input);
+	size_t size = c.size + c.count;
+	int count = c.count;
+	free_corpus(&c);
+	if (!written)
+	{
+		unlink(input);
+		return false;
+	}
+
+	//The first run also brings the input into the page cache
+	for (int run = 0; run < BENCH_RUNS; run++)
+	{
+		double start = getseconds();
+		decrypt_file(input, output);
+		double elapsed = getseconds() - start;
+		if (run == 0 || elapsed < best)
+			best = elapsed;
+	}
+	report("decrypt_file", best, count, "tweet", size);
+
+	for (int run = 0; run < BENCH_RUNS; run++)
+	{
+		double start = getseconds();
+		decrypt_file_pipelined(input, output);
+		double elapsed = getseconds() - start;
+		if (run == 0 || elapsed < best)
+			best = elapsed;
+	}
+	report("decrypt_file_pipelined", best, count, "tweet", size);
+
+	unlink(input);
+	unlink(output);
+	return true;
+}
+
+/*
+ * generate
+ *
+ * Writes corpus files for end-to-end runs, each from its own seed.
+ *
+ * dir:    Directory to write to
+ * files:  Number of files
+ * tweets: Tweets in each file
+ *
+ * returns: False if an error occurs
+*/
+static bool generate(const char* dir, int files, int tweets)
+{
+	for (int i = 0; i < files; i++)
+	{
+		corpus c;
+		char path[MAX_LOCATION_LENGTH];
+		snprintf(path, sizeof(path), "%s/bench.%i.txt", dir, i);
+		//Every file is different, but the same on every run
+		bool written = make_corpus(&c, tweets, MAX_TWEET_LENGTH - 2, false, BENCH_SEED + i + 1) && 
+			write_corpus(&c, path);
+		free_corpus(&c);
+		if (!written)
+			return false;
+	}
+	return true;
+}
+
+int main(int argc, char* argv[])
+{
+	bool check = true;
+	bool bench = true;
+	char* dir = getenv("TMPDIR");
+	if (dir == NULL)
+		dir = "/tmp";
+
+	int opt;
+	while ((opt = getopt(argc, argv, "bcg")) != -1)
+	{
+		switch (opt)
+		{
+			case 'b': //Benchmarks only
+				check = false;
+				break;
+			case 'c': //Differential check only
+				bench = false;
+				break;
+			case 'g': //Corpus files for an end-to-end run
+				if (argc - optind != 3)
+				{
+					printf("Usage: %s -g [Directory] [Files] [Tweets per file]\n", argv[0]);
+					return EXIT_FAILURE;
+				}
+				return generate(argv[optind], atoi(argv[optind + 1]), atoi(argv[optind + 2])) ?
+					EXIT_SUCCESS : EXIT_FAILURE;
+			default:
+				return EXIT_FAILURE;
+		}
+	}
+
+	if (!decrypt_select_kernel(NULL))
+	{
+		printf("%s names a kernel this CPU cannot run.\n", DECRYPT_KERNEL_ENV);
+		return EXIT_FAILURE;
+	}
+	printf("kernel: %s\n", decrypt_kernel_name());
+
+	int failures = check ? run_checks(dir) : 0;
+	if (bench && !run_benchmarks(dir))
+	{
+		printf("Unable to set up the benchmarks in %s.\n", dir);
+		return EXIT_FAILURE;
+	}
+	return failures == 0 ? EXIT_SUCCESS : EXIT_FAILURE;
+}
@@ -0,0 +1,78 @@
+#!/bin/bash
+###################################################################
+#
+# bench.sh
+# End-to-end benchmark. Starts a lyrebird server and clients on this
+# machine, decrypts a generated corpus and reports tweets/s, tasks/s
+# and task latency.
+#
+# Usage: ./bench.sh [Clients] [Files] [Tweets per file] [-- Server flags]
+#
+# James Shephard
+# CMPT 300 - D100 Burnaby
+# Instructor Brian Booth
+# TA Scott Kristjanson
+#
+###################################################################
+
+CLIENTS=${1:-1}
+FILES=${2:-64}
+TWEETS=${3:-20000}
+shift $(( $# < 3 ? $# : 3 ))
+[ "$1" == "--" ] && shift
+SERVER_FLAGS=("$@")
+
+HERE=$(cd "$(dirname "$0")" && pwd)
+WORK=$(mktemp -d "${TMPDIR:-/tmp}/lyrebird.bench.XXXXXX") || exit 1
+trap 'kill $(jobs -p) 2> /dev/null; rm -rf "$WORK"' EXIT
+
+"$HERE/lyrebird.bench" -g "$WORK" "$FILES" "$TWEETS" || { echo "Unable to generate the corpus"; exit 1; }
+for ((i = 0; i < FILES; i++))
+do
+	echo "$WORK/bench.$i.txt $WORK/bench.$i.out" >> "$WORK/config.txt"
+done
+
+"$HERE/lyrebird.server" "${SERVER_FLAGS[@]}" "$WORK/config.txt" "$WORK/server.log" > "$WORK/server.out" 2>&1 &
+SERVER=$!
+
+# The server picks its own port and logs it
+for ((t = 0; t < 100; t++))
+do
+	grep -q "port" "$WORK/server.out" 2> /dev/null && break
+	sleep 0.1
+done
+HOST=$(grep -o 'host [0-9.]*' "$WORK/server.out" | awk '{print $2}')
+PORT=$(grep -o 'port [0-9]*' "$WORK/server.out" | head -n 1 | awk '{print $2}')
+if [ -z "$PORT" ]
+then
+	echo "The server did not start:"
+	cat "$WORK/server.out"
+	exit 1
+fi
+
+for ((c = 0; c < CLIENTS; c++))
+do
+	"$HERE/lyrebird.client" "$HOST" "$PORT" > "$WORK/client.$c.out" 2>&1 &
+done
+wait $SERVER
+
+# e.g. 64 files in 1.234 seconds (51.9 files/s), latency p50 0.100 seconds, p99 0.200 seconds.
+SUMMARY=$(grep -o '[0-9]* files in .*' "$WORK/server.log" | tail -n 1)
+DECRYPTED=$(grep -c 'successfully decrypted' "$WORK/server.log")
+if [ -z "$SUMMARY" ] || [ "$DECRYPTED" -ne "$FILES" ]
+then
+	echo "Only $DECRYPTED of $FILES files were decrypted, see the log:"
+	tail -n 20 "$WORK/server.log"
+	exit 1
+fi
+
+read -r COUNT _ _ ELAPSED _ <<< "$SUMMARY"
+P50=$(sed 's/.*p50 \([0-9.]*\).*/\1/' <<< "$SUMMARY")
+P99=$(sed 's/.*p99 \([0-9.]*\).*/\1/' <<< "$SUMMARY")
+awk -v clients="$CLIENTS" -v files="$COUNT" -v tweets="$((FILES * TWEETS))" -v seconds="$ELAPSED" \
+	-v p50="$P50" -v p99="$P99" 'BEGIN {
+	printf "end-to-end: %i client(s), %i files, %i tweets in %.3f s\n", clients, files, tweets, seconds
+	printf "%-28s %14.0f tweets/s\n", "throughput", tweets / seconds
+	printf "%-28s %14.1f tasks/s\n", "", files / seconds
+	printf "%-28s %14.3f s p50, %.3f s p99\n", "task latency", p50, p99
+}'
@@ -10,19 +10,258 @@
  * TA Scott Kristjanson
  */
 
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdbool.h>
 #include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
 #include <sys/types.h>
 #include <unistd.h>
 #include "child.h"
 #include "common.h"
 #include "decrypt.h"
+#include "manifest.h"
+#include "stats.h"
 #include "memwatch.h"
 
+//Size of the buffer decrypted tweets are collected in before being written
+#define OUTPUT_BUFFER_SIZE (1 << 20)
+//Most output one batch of tweets can produce, each line plus its newline
+#define MAX_BATCH_OUTPUT (DECRYPT_BATCH_TWEETS * MAX_TWEET_LENGTH)
+
+//Chunks in flight between each pair of pipeline stages
+#define PIPELINE_DEPTH 4
+
+//A block of input or output passed between pipeline stages
+typedef struct {
+	char* data;
+	size_t length;
+	bool last;  //No chunks follow this one
+	int status; //Result of producing the chunk, see decrypt_file
+} chunk;
+
+//Bounded queue of chunks between two pipeline stages. Holds every chunk of
+//its pool at once, so pushing never blocks.
+typedef struct {
+	chunk* slots[PIPELINE_DEPTH];
+	int head;
+	int count;
+	pthread_mutex_t lock;
+	pthread_cond_t changed;
+} chunk_ring;
+
+//Reader, decrypt and writer stages working on one file
+typedef struct {
+	int encrypted;
+	int decrypted;
+	chunk inputs[PIPELINE_DEPTH];
+	chunk outputs[PIPELINE_DEPTH];
+	chunk_ring free_inputs;    //Decrypt stage to reader
+	chunk_ring full_inputs;    //Reader to decrypt stage
+	chunk_ring free_outputs;   //Writer to decrypt stage
+	chunk_ring full_outputs;   //Decrypt stage to writer
+	bool stop;                 //Tells the reader to give up early, atomic
+} pipeline;
+
+//Decrypted output waiting to be written
+typedef struct {
+	int fd;
+	char* data;
+	size_t length;
+	pipeline* stages; //When set, full buffers go to the writer stage
+	chunk* current;   //Chunk data belongs to when pipelined
+	off_t offset;     //Where to write in the file, -1 to write sequentially
+} output_buffer;
+
+/*
+ * ring_init
+ *
+ * Initializes an empty chunk ring.
+*/
+static void ring_init(chunk_ring* ring)
+{
+	ring->head = 0;
+	ring->count = 0;
+	pthread_mutex_init(&ring->lock, NULL);
+	pthread_cond_init(&ring->changed, NULL);
+}
+
+/*
+ * ring_destroy
+ *
+ * Releases the ring's lock and condition variable.
+*/
+static void ring_destroy(chunk_ring* ring)
+{
+	pthread_mutex_destroy(&ring->lock);
+	pthread_cond_destroy(&ring->changed);
+}
+
+/*
+ * ring_push
+ *
+ * Adds a chunk to the back of the ring and wakes the consumer.
+*/
+static void ring_push(chunk_ring* ring, chunk* c)
+{
+	pthread_mutex_lock(&ring->lock);
+	ring->slots[(ring->head + ring->count++) % PIPELINE_DEPTH] = c;
+	pthread_cond_signal(&ring->changed);
+	pthread_mutex_unlock(&ring->lock);
+}
+
+/*
+ * ring_pop
+ *
+ * Removes the chunk at the front of the ring, waiting for one if empty.
+*/
+static chunk* ring_pop(chunk_ring* ring)
+{
+	pthread_mutex_lock(&ring->lock);
+	while (ring->count == 0)
+		pthread_cond_wait(&ring->changed, &ring->lock);
+	chunk* c = ring->slots[ring->head];
+	ring->head = (ring->head + 1) % PIPELINE_DEPTH;
+	ring->count--;
+	pthread_mutex_unlock(&ring->lock);
+	return c;
+}
+
+/*
+ * flush_output
+ *
+ * Writes everything in the output buffer to its file, leaving it empty. When
+ * pipelined the buffer is handed to the writer stage instead, and a free one
+ * takes its place.
+ *
+ * out: Buffer to flush
+ *
+ * returns: False if the write fails
+*/
+static bool flush_output(output_buffer* out)
+{
+	if (out->stages != NULL)
+	{
+		out->current->length = out->length;
+		out->current->last = false;
+		ring_push(&out->stages->full_outputs, out->current);
+
+		out->current = ring_pop(&out->stages->free_outputs);
+		out->data = out->current->data;
+		out->length = 0;
+		//Writer reports a failed write on the chunk it hands back
+		return out->current->status == 0;
+	}
+
+	if (out->offset < 0)
+	{
+		bool result = writeall(out->fd, out->data, out->length);
+		out->length = 0;
+		return result;
+	}
+
+	//Positioned write, so several children can fill one file at once
+	size_t written = 0;
+	while (written < out->length)
+	{
+		ssize_t nbytes = pwrite(out->fd, out->data + written, 
+			out->length - written, out->offset + written);
+		if (nbytes < 0 && errno == EINTR)
+			continue;
+		if (nbytes < 0)
+			return false;
+		written += nbytes;
+	}
+	out->offset += out->length;
+	out->length = 0;
+	return true;
+}
+
+/*
+ * decrypt_region
+ *
+ * Decrypts the tweets in a region of memory into the output buffer, flushing
+ * it as it fills. Lines are split exactly as fgets with a MAX_TWEET_LENGTH
+ * buffer would split them.
+ *
+ * data:   Encrypted tweets, one per line
+ * length: Length of data
+ * out:    Buffer to store decrypted tweets
+ *
+ * returns:
+ *         0 - Successfully decrypted region
+ *         2 - Unable to write output file
+ *         3 - Invalid characters in region. Tweets before the invalid one 
+ *             are still in the buffer.
+*/
+static int decrypt_region(const char* data, size_t length, output_buffer* out)
+{
+	const char* tweets[DECRYPT_BATCH_TWEETS];
+	int lengths[DECRYPT_BATCH_TWEETS];
+	char* decrypted[DECRYPT_BATCH_TWEETS];
+	bool hasnewline[DECRYPT_BATCH_TWEETS];
+	size_t position = 0;
+
+	while (position < length)
+	{
+		if (OUTPUT_BUFFER_SIZE - out->length <= MAX_BATCH_OUTPUT && !flush_output(out))
+			return 2;
+
+		//Gather a batch of lines straight out of the input
+		int count = 0;
+		size_t start = out->length;
+		while (count < DECRYPT_BATCH_TWEETS && position < length)
+		{
+			size_t remaining = length - position;
+			size_t max = remaining < MAX_TWEET_LENGTH - 1 ? remaining : MAX_TWEET_LENGTH - 1;
+			const char* newline = memchr(data + position, '\n', max);
+			size_t chunk = newline == NULL ? max : newline - (data + position) + 1;
+
+			hasnewline[count] = newline != NULL;
+			tweets[count] = data + position;
+			lengths[count] = chunk - hasnewline[count];
+			decrypted[count] = out->data + out->length;
+			out->length += DECRYPTED_LENGTH(lengths[count]) + hasnewline[count];
+
+			position += chunk;
+			count++;
+		}
+
+		int result = decrypt_batch_r(tweets, lengths, decrypted, count);
+
+		//Put back the newlines, which replace each tweet's null terminator
+		out->length = start;
+		unsigned long long bytes = 0, blocks = 0;
+		for (int i = 0; i < result; i++)
+		{
+			out->length += DECRYPTED_LENGTH(lengths[i]);
+			if (hasnewline[i])
+				out->data[out->length++] = '\n';
+			bytes += lengths[i] + hasnewline[i];
+			blocks += (DECRYPTED_LENGTH(lengths[i]) + 5) / 6;
+		}
+		//Counted once a batch, so the cost is spread over many tweets
+		STATS_ADD(tweets, result);
+		STATS_ADD(bytes, bytes);
+		STATS_ADD(blocks, blocks);
+
+		if (result < count)
+			return 3;
+	}
+
+	return 0;
+}
+
 /*
  * decrypt_file
  *
  * Decrypt the given file and save the decrypted contents to the specified
- * output file.
+ * output file. The input is memory mapped and decrypted in place, and the
+ * output is written in large blocks.
  *
  * file_in:  Encrypted input file
  * file_out: Decrypted output file
@@ -30,57 +269,549 @@
  * returns:
  *         0 - Successfully decrypted file
  *         1 - Unable to open input file
- *         2 - Unable to open output file
+ *         2 - Unable to open or write output file
  *         3 - Invalid characters in input file
  *         4 - Malloc failure
 */
 int decrypt_file(char* file_in, char* file_out)
 {
-	FILE* encrypted;
-	FILE* decrypted;
+	int encrypted = open(file_in, O_RDONLY);
+	if (encrypted == -1)
+		return 1;
 
-	encrypted = fopen(file_in, "r");
-	if (encrypted == NULL)
+	struct stat info;
+	if (fstat(encrypted, &info) == -1)
+	{
+		close(encrypted);
 		return 1;
+	}
 
-	decrypted = fopen(file_out, "w");
-	if (decrypted == NULL)
+	//An empty file cannot be mapped, but still produces an empty output
+	char* data = NULL;
+	if (info.st_size > 0)
 	{
-		fclose(encrypted);
+		data = mmap(NULL, info.st_size, PROT_READ, MAP_PRIVATE, encrypted, 0);
+		if (data == MAP_FAILED)
+		{
+			close(encrypted);
+			return 1;
+		}
+		madvise(data, info.st_size, MADV_SEQUENTIAL);
+	}
+
+	output_buffer out;
+	out.length = 0;
+	out.stages = NULL;
+	out.offset = -1;
+	out.fd = open(file_out, O_WRONLY | O_CREAT | O_TRUNC, 0666);
+	if (out.fd == -1)
+	{
+		if (data != NULL)
+			munmap(data, info.st_size);
+		close(encrypted);
 		return 2;
 	}
 
-	char tweet[MAX_TWEET_LENGTH];
-	while (fgets(tweet, MAX_TWEET_LENGTH, encrypted) != NULL)
+	int result = 4;
+	out.data = (char*)malloc(OUTPUT_BUFFER_SIZE);
+	if (out.data != NULL)
+	{
+		result = decrypt_region(data, info.st_size, &out);
+
+		//Anything decrypted before an invalid tweet is still written
+		if (!flush_output(&out) && result == 0)
+			result = 2;
+		free(out.data);
+	}
+
+	if (data != NULL)
+		munmap(data, info.st_size);
+	close(encrypted);
+	close(out.fd);
+
+	return result;
+}
+
+/*
+ * decrypt_file_range
+ *
+ * Decrypt part of the given file into its place in the output file, which
+ * must already exist. Used when a file is split between several children.
+ *
+ * file_in:    Encrypted input file
+ * file_out:   Decrypted output file
+ * in_offset:  Start of the part, at the beginning of a line
+ * in_length:  Length of the part, ending at the end of a line
+ * out_offset: Where the decrypted part goes in file_out
+ *
+ * returns: See decrypt_file
+*/
+int decrypt_file_range(char* file_in, char* file_out, long long in_offset, 
+	long long in_length, long long out_offset)
+{
+	int encrypted = open(file_in, O_RDONLY);
+	if (encrypted == -1)
+		return 1;
+
+	output_buffer out;
+	out.length = 0;
+	out.stages = NULL;
+	out.offset = out_offset;
+	out.fd = open(file_out, O_WRONLY);
+	if (out.fd == -1)
 	{
-		//Remove the newline if there is one
-		int hasnewline = tweet[strlen(tweet) - 1] == '\n';
-		if (hasnewline)
-			tweet[strlen(tweet) - 1] = 0;
+		close(encrypted);
+		return 2;
+	}
 
-		int result = decrypt(tweet);
-		if (result == -1)
+	//Mappings have to start on a page boundary
+	long long start = in_offset & ~((long long)sysconf(_SC_PAGESIZE) - 1);
+	size_t mapped = in_length + (in_offset - start);
+	char* data = NULL;
+	if (in_length > 0)
+	{
+		data = mmap(NULL, mapped, PROT_READ, MAP_PRIVATE, encrypted, start);
+		if (data == MAP_FAILED)
 		{
-			fclose(encrypted);
-			fclose(decrypted);
-			return 3;
+			close(encrypted);
+			close(out.fd);
+			return 1;
+		}
+		madvise(data, mapped, MADV_SEQUENTIAL);
+	}
+
+	int result = 4;
+	out.data = (char*)malloc(OUTPUT_BUFFER_SIZE);
+	if (out.data != NULL)
+	{
+		result = decrypt_region(data + (in_offset - start), in_length, &out);
+		if (!flush_output(&out) && result == 0)
+			result = 2;
+		free(out.data);
+	}
+
+	if (data != NULL)
+		munmap(data, mapped);
+	close(encrypted);
+	close(out.fd);
+
+	return result;
+}
+
+/*
+ * split_file
+ *
+ * Plans how to decrypt a large file in several parts at once. The file is 
+ * cut at line boundaries close to every chunk_size bytes, and the output 
+ * file is created at its final size so each part can be written in place.
+ *
+ * file_in:    Encrypted input file
+ * file_out:   Decrypted output file
+ * chunk_size: Preferred size of each part
+ * ranges:     Location to store the parts
+ * max:        Maximum number of parts. chunk_size grows to keep within it.
+ *
+ * returns: Number of parts, or 0 if the file could not be split. The file 
+ *          should then be decrypted whole.
+*/
+int split_file(char* file_in, char* file_out, long long chunk_size, file_range* ranges, int max)
+{
+	int encrypted = open(file_in, O_RDONLY);
+	if (encrypted == -1)
+		return 0;
+
+	struct stat info;
+	if (fstat(encrypted, &info) == -1 || info.st_size <= chunk_size)
+	{
+		close(encrypted);
+		return 0;
+	}
+	if (info.st_size / chunk_size >= max)
+		chunk_size = info.st_size / max + 1;
+
+	char* data = mmap(NULL, info.st_size, PROT_READ, MAP_PRIVATE, encrypted, 0);
+	close(encrypted);
+	if (data == MAP_FAILED)
+		return 0;
+	madvise(data, info.st_size, MADV_SEQUENTIAL);
+
+	//Walk the lines, adding up how much output each produces. Lines longer
+	//than an fgets buffer are decrypted in MAX_TWEET_LENGTH - 1 byte pieces.
+	const long long piece = MAX_TWEET_LENGTH - 1;
+	long long position = 0;
+	long long output = 0;
+	int count = 0;
+	ranges[0].in_offset = 0;
+	ranges[0].out_offset = 0;
+
+	while (position < info.st_size)
+	{
+		const char* newline = memchr(data + position, '\n', info.st_size - position);
+		long long end = newline == NULL ? info.st_size : newline - data + 1;
+		long long length = end - position;
+
+		//All but the last piece are full, the last one keeps the newline
+		long long last = (length - 1) % piece + 1;
+		output += (length - last) / piece * DECRYPTED_LENGTH(piece);
+		if (newline != NULL)
+			output += DECRYPTED_LENGTH(last - 1) + 1;
+		else
+			output += DECRYPTED_LENGTH(last);
+		position = end;
+
+		if (position - ranges[count].in_offset >= chunk_size && 
+			position < info.st_size && count + 1 < max)
+		{
+			ranges[count].in_length = position - ranges[count].in_offset;
+			count++;
+			ranges[count].in_offset = position;
+			ranges[count].out_offset = output;
 		}
-		else if (result == -2)
+	}
+	ranges[count].in_length = position - ranges[count].in_offset;
+	count++;
+	munmap(data, info.st_size);
+
+	//Size the output now so every part can be written where it belongs
+	int decrypted = open(file_out, O_WRONLY | O_CREAT | O_TRUNC, 0666);
+	if (decrypted == -1)
+		return 0;
+	if (ftruncate(decrypted, output) == -1)
+		count = 0;
+	close(decrypted);
+
+	return count;
+}
+
+/*
+ * read_stage
+ *
+ * Reader thread of a pipeline. Fills free input chunks from the encrypted 
+ * file, ending each one on a boundary where fgets would also have split the
+ * line, and carries the rest over to the next chunk.
+ *
+ * arg: Pipeline to read for
+ *
+ * returns: NULL
+*/
+static void* read_stage(void* arg)
+{
+	pipeline* stages = (pipeline*)arg;
+	//Bytes of the previous chunk that belong in the next one, always less
+	//than one fgets sized piece
+	char carry[MAX_TWEET_LENGTH];
+	size_t carried = 0;
+	bool eof = false;
+
+	while (!eof)
+	{
+		//The decrypt stage sets stop before handing back its last chunk, so 
+		//the chunk that wakes this thread up may be the one telling it to go
+		if (__atomic_load_n(&stages->stop, __ATOMIC_ACQUIRE))
+			break;
+		chunk* c = ring_pop(&stages->free_inputs);
+		if (__atomic_load_n(&stages->stop, __ATOMIC_ACQUIRE))
+			break;
+		memcpy(c->data, carry, carried);
+		c->length = carried;
+		c->status = 0;
+
+		while (c->length < OUTPUT_BUFFER_SIZE)
+		{
+			ssize_t nbytes = read(stages->encrypted, c->data + c->length, 
+				OUTPUT_BUFFER_SIZE - c->length);
+			if (nbytes < 0 && errno == EINTR)
+				continue;
+			if (nbytes < 0)
+				c->status = 1;
+			if (nbytes <= 0)
+			{
+				eof = true;
+				break;
+			}
+			c->length += nbytes;
+		}
+
+		carried = 0;
+		if (!eof)
 		{
-			fclose(encrypted);
-			fclose(decrypted);
-			return 4;
+			//Cut after the last newline, plus any whole fgets sized pieces of 
+			//the line following it
+			const char* newline = memrchr(c->data, '\n', c->length);
+			size_t cut = newline == NULL ? 0 : newline - c->data + 1;
+			cut += (c->length - cut) / (MAX_TWEET_LENGTH - 1) * (MAX_TWEET_LENGTH - 1);
+
+			carried = c->length - cut;
+			memcpy(carry, c->data + cut, carried);
+			c->length = cut;
 		}
 
-		fwrite(tweet, sizeof(char), strlen(tweet), decrypted);
-		if (hasnewline)
-			fputc('\n', decrypted); //add our removed newline
+		c->last = eof;
+		ring_push(&stages->full_inputs, c);
 	}
 
-	fclose(encrypted);
-	fclose(decrypted);
+	return NULL;
+}
 
-	return 0;
+/*
+ * write_stage
+ *
+ * Writer thread of a pipeline. Writes full output chunks to the decrypted 
+ * file until the last one arrives, then hands every chunk back.
+ *
+ * arg: Pipeline to write for
+ *
+ * returns: NULL
+*/
+static void* write_stage(void* arg)
+{
+	pipeline* stages = (pipeline*)arg;
+	int status = 0;
+	bool last = false;
+
+	while (!last)
+	{
+		chunk* c = ring_pop(&stages->full_outputs);
+		last = c->last;
+		//Once a write fails the rest of the file is dropped
+		if (status == 0 && !writeall(stages->decrypted, c->data, c->length))
+			status = 2;
+		c->status = status;
+		ring_push(&stages->free_outputs, c);
+	}
+
+	return NULL;
+}
+
+/*
+ * decrypt_file_pipelined
+ *
+ * Decrypt the given file and save the decrypted contents to the specified
+ * output file. Reading, decrypting and writing run in separate threads 
+ * connected by bounded rings of chunks, so that waiting on a slow file 
+ * system overlaps with decryption.
+ *
+ * file_in:  Encrypted input file
+ * file_out: Decrypted output file
+ *
+ * returns: See decrypt_file
+*/
+int decrypt_file_pipelined(char* file_in, char* file_out)
+{
+	pipeline stages;
+	stages.encrypted = open(file_in, O_RDONLY);
+	if (stages.encrypted == -1)
+		return 1;
+	posix_fadvise(stages.encrypted, 0, 0, POSIX_FADV_SEQUENTIAL);
+
+	stages.decrypted = open(file_out, O_WRONLY | O_CREAT | O_TRUNC, 0666);
+	if (stages.decrypted == -1)
+	{
+		close(stages.encrypted);
+		return 2;
+	}
+
+	//One allocation holds every chunk's data
+	char* memory = (char*)malloc(2 * PIPELINE_DEPTH * OUTPUT_BUFFER_SIZE);
+	if (memory == NULL)
+	{
+		close(stages.encrypted);
+		close(stages.decrypted);
+		return 4;
+	}
+
+	ring_init(&stages.free_inputs);
+	ring_init(&stages.full_inputs);
+	ring_init(&stages.free_outputs);
+	ring_init(&stages.full_outputs);
+	stages.stop = false;
+	for (int i = 0; i < PIPELINE_DEPTH; i++)
+	{
+		stages.inputs[i].data = memory + i * OUTPUT_BUFFER_SIZE;
+		stages.outputs[i].data = memory + (PIPELINE_DEPTH + i) * OUTPUT_BUFFER_SIZE;
+		stages.outputs[i].status = 0;
+		ring_push(&stages.free_inputs, stages.inputs + i);
+		ring_push(&stages.free_outputs, stages.outputs + i);
+	}
+
+	output_buffer out;
+	out.stages = &stages;
+	out.current = ring_pop(&stages.free_outputs);
+	out.data = out.current->data;
+	out.length = 0;
+
+	//The writer only waits on chunks from this thread, so it is started 
+	//first and can be stopped if the reader cannot be
+	pthread_t reader, writer;
+	bool writing = pthread_create(&writer, NULL, write_stage, &stages) == 0;
+	bool reading = writing && pthread_create(&reader, NULL, read_stage, &stages) == 0;
+
+	//Decrypt stage runs on this thread
+	int result = 0;
+	bool last = !reading;
+	while (!last && result == 0)
+	{
+		chunk* c = ring_pop(&stages.full_inputs);
+		last = c->last;
+		result = c->status;
+		if (result == 0)
+			result = decrypt_region(c->data, c->length, &out);
+
+		//Stop the reader before handing back the chunk it may be waiting on,
+		//otherwise it could take it and then wait forever for another
+		if (last || result != 0)
+			__atomic_store_n(&stages.stop, true, __ATOMIC_RELEASE);
+		ring_push(&stages.free_inputs, c);
+	}
+	if (reading)
+		pthread_join(reader, NULL);
+
+	//Whatever is left, including tweets before an invalid one, is written
+	if (writing)
+	{
+		out.current->length = out.length;
+		out.current->last = true;
+		ring_push(&stages.full_outputs, out.current);
+		pthread_join(writer, NULL);
+	}
+
+	for (int i = 0; i < PIPELINE_DEPTH; i++)
+		if (stages.outputs[i].status != 0 && result == 0)
+			result = stages.outputs[i].status;
+
+	ring_destroy(&stages.free_inputs);
+	ring_destroy(&stages.full_inputs);
+	ring_destroy(&stages.free_outputs);
+	ring_destroy(&stages.full_outputs);
+	free(memory);
+	close(stages.encrypted);
+	close(stages.decrypted);
+
+	//Without threads the file is decrypted the usual way
+	if (!reading)
+		return decrypt_file(file_in, file_out);
+	return result;
+}
+
+/*
+ * temp_output
+ *
+ * Names the file one copy of a task decrypts into before it is renamed over
+ * the output. It sits beside the output, so the rename stays on one file 
+ * system, and no other copy uses it, so a copy that loses to another never 
+ * touches the output the winner left.
+ *
+ * output: Output file
+ * path:   Location to store the path, holds MAX_LOCATION_LENGTH bytes
+ *
+ * returns: False if the path is too long
+*/
+bool temp_output(const char* output, char* path)
+{
+	//Worker threads share the process ID
+	static unsigned int copies = 0;
+	unsigned int copy = __atomic_fetch_add(&copies, 1, __ATOMIC_RELAXED);
+	return snprintf(path, MAX_LOCATION_LENGTH, "%s.%i.%u.tmp", output, getpid(), copy) < 
+		MAX_LOCATION_LENGTH;
+}
+
+/*
+ * perform_task
+ *
+ * Decrypts the file, or part of a file, described by a task and logs the 
+ * outcome.
+ *
+ * t:       Task to perform
+ * message: Location to store the message for the server, holds 
+ *          MAX_MESSAGE_LENGTH bytes
+ *
+ * returns: Result of decryption, see decrypt_file, or 5 if the output was
+ *          already up to date. The message goes to the server with the 
+ *          status given by task_status.
+*/
+int perform_task(task* t, char* message)
+{
+	int result;
+	//Messages name the file the server knows of
+	char* name = t->source[0] != '\0' ? t->source : t->input_file;
+	manifest_entry manifest;
+
+	STATS_ADD(started, 1);
+	if (t->incremental && manifest_check(t->input_file, t->output_file, &manifest, true))
+		result = 5;
+	else
+	{
+		logmessage(NULL, "Process ID #%i will decrypt %s", getpid(), name);
+		//Parts write into a file their split task renames once all are done
+		char temp[MAX_LOCATION_LENGTH];
+		if (t->ranged)
+			result = decrypt_file_range(t->input_file, t->output_file, t->range.in_offset, 
+				t->range.in_length, t->range.out_offset);
+		else if (!temp_output(t->output_file, temp))
+			result = 2;
+		else
+		{
+			if (options.pipelined)
+				result = decrypt_file_pipelined(t->input_file, temp);
+			else
+				result = decrypt_file(t->input_file, temp);
+
+			//Only a finished output replaces whatever is there
+			if (result == 0 && rename(temp, t->output_file) == -1)
+				result = 2;
+			if (result != 0)
+				unlink(temp);
+		}
+	}
+
+	if (result == 0 && t->incremental && !manifest_save(t->output_file, &manifest))
+		logmessage(NULL, "Unable to write the manifest for %s in process %i.", t->output_file, getpid());
+
+	//Parts of a split copy are deleted by the parent once all are done
+	if (t->source[0] != '\0' && !t->ranged)
+		unlink(t->input_file);
+
+	switch (result)
+	{
+		case 0: //Successful decryption
+			STATS_ADD(completed, 1);
+			snprintf(message, MAX_MESSAGE_LENGTH, "%s in process %i", name, getpid());
+			logmessage(NULL, "Process ID #%i decrypted %s successfully.", getpid(), name);
+			return result;
+		case 5: //Output already up to date
+			STATS_ADD(skipped, 1);
+			snprintf(message, MAX_MESSAGE_LENGTH, "%s in process %i", name, getpid());
+			logmessage(NULL, "Process ID #%i skipped %s, its output is up to date.", getpid(), name);
+			return result;
+		case 1: //Unable to open input file
+			snprintf(message, MAX_MESSAGE_LENGTH, "Unable to open file %s in process %i.", name, getpid());
+			break;
+		case 2: //Unable to open or write output file
+			snprintf(message, MAX_MESSAGE_LENGTH, "Unable to open file %s in process %i.", t->output_file, getpid());
+			break;
+		case 3: //Invalid file contents
+			snprintf(message, MAX_MESSAGE_LENGTH, "Invalid characters in %s. Process ID #%i.", name, getpid());
+			break;
+		case 4: //Malloc failure
+			snprintf(message, MAX_MESSAGE_LENGTH, "Malloc failed in process %i, process exiting", getpid());
+			break;
+	}
+	logmessage(NULL, "%s", message);
+	STATS_ADD(failed, 1);
+
+	return result;
+}
+
+/*
+ * task_status
+ *
+ * returns: Status code of the message reporting a result of perform_task
+*/
+char task_status(int result)
+{
+	if (result == 0)
+		return M_SUCCESS;
+	return result == 5 ? M_SKIPPED : M_ERROR;
 }
 
 /*
@@ -96,73 +827,64 @@ int decrypt_file(char* file_in, char* file_out)
 int child_process(pc_pipe connection)
 {
 	int result = 0;
-	char buffer[65536]; //Size of pipe's buffer, probably will not hit this in practice.
+	frame_buffer in; //Tasks received from the parent
+	frame f;
 	char wbuffer[MAX_MESSAGE_LENGTH]; //For writing messages
-	char input_file[MAX_LOCATION_LENGTH];
-	char output_file[MAX_LOCATION_LENGTH];
+	task t;
+
+	in.start = 0;
+	in.length = 0;
+	t.split = -1;
+
+	if (!decrypt_cache_init(options.cache_entries))
+		logmessage(NULL, "Unable to allocate block cache in process %i, continuing without it.", getpid());
 
 	//Inform the server we are ready to receive a file
 	sendmessage(connection.parent[1], M_READY, "");
 
-	while (1)
+	while (result != 4)
 	{
-		int nbytes = read(connection.child[0], buffer, sizeof(buffer));
-		if (nbytes == 0) //Terminating, pipe has been closed.
-			break;
-		//When no new line is specified, will read past bytes read. Prevent this
-		//by setting this byte to 0 (null-term string).
-		buffer[nbytes] = 0x00;
-
-		int count = 0;
-		int offset = 0;
-
-		//read() reads in the entire buffer, so we may read in multiple lines from
-		//the configuration file. We will need to offset for each line.
-		while (sscanf(buffer + offset, "%s %s%n", input_file, output_file, &count) == 2)
+		int parsed = nextframe(&in, &f);
+		if (parsed < 0)
+			break; //Malformed, the parent cannot be trusted
+		if (parsed == 0)
 		{
-			//sscanf doesn't include the newline character in its count
-			offset += count + 1;
+			//Write out the logs of the last task while waiting for the next
+			log_flush();
+			if (readframes(connection.child[0], &in) <= 0)
+				break; //Terminating, pipe has been closed.
+			continue;
+		}
 
-			logmessage(NULL, "Process ID #%i will decrypt %s", getpid(), input_file);
-			result = decrypt_file(input_file, output_file);
+		//Each task is the input and output file, the range of the file to 
+		//decrypt, with a negative length for all of it, 1 to skip the file 
+		//if its output is up to date, and the file the input is a copy of,
+		//or - if not a copy
+		int incremental;
+		int fields = sscanf(f.payload, "%s %s %lld %lld %lld %i %s", t.input_file, t.output_file, 
+			&t.range.in_offset, &t.range.in_length, &t.range.out_offset, &incremental, t.source);
+		if (f.type != M_LINE || fields < 7)
+			continue;
 
-			switch (result)
-			{
-				case 0: //Successful decryption
-					sendmessage(connection.parent[1], M_SUCCESS, "%s in process %i", input_file, getpid());
-					logmessage(NULL, "Process ID #%i decrypted %s successfully.", getpid(), input_file);
-					break;
-				case 1: //Unable to open input file
-					sprintf(wbuffer, "Unable to open file %s in process %i.", input_file, getpid());
-					sendmessage(connection.parent[1], M_ERROR, wbuffer);
-					logmessage(NULL, "%s", wbuffer);
-					break;
-				case 2: //Unable to open output file
-					sprintf(wbuffer, "Unable to open file %s in process %i.", output_file, getpid());
-					sendmessage(connection.parent[1], M_ERROR, wbuffer);
-					logmessage(NULL, "%s", wbuffer);
-					break;
-				case 3: //Invalid file contents
-					sprintf(wbuffer, "Invalid characters in %s. Process ID #%i.", input_file, getpid());
-					sendmessage(connection.parent[1], M_ERROR, wbuffer);
-					logmessage(NULL, "%s", wbuffer);
-					break;
-				case 4: //Malloc failure
-					sprintf(wbuffer, "Malloc failed in process %i, process exiting", getpid());
-					sendmessage(connection.parent[1], M_ERROR, wbuffer);
-					logmessage(NULL, "%s", wbuffer);
-					break;
-			}
-
-			if (offset >= nbytes) //Don't go over the number of bytes that've been read
-				break;
-		}
-		if (result == 4)
-			break; //Need to break out of this loop too.
+		t.ranged = t.range.in_length >= 0;
+		t.incremental = incremental != 0;
+		if (strcmp(t.source, "-") == 0)
+			t.source[0] = '\0';
+		t.id = f.id;
+		result = perform_task(&t, wbuffer);
+		sendframe(connection.parent[1], task_status(result), t.id, wbuffer, strlen(wbuffer));
 	}
 
 	close(connection.parent[1]);
 
+	if (options.cache_entries > 0)
+	{
+		unsigned long long hits, misses;
+		decrypt_cache_stats(&hits, &misses);
+		logmessage(NULL, "Process ID #%i block cache: %llu hits, %llu misses.", getpid(), hits, misses);
+		decrypt_cache_free();
+	}
+
 	//Malloc failure is the only reason we terminate early
 	return (result == 4) ? EXIT_FAILURE : EXIT_SUCCESS;
 }
\ No newline at end of file
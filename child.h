@@ -15,6 +15,151 @@
 
 #include "common.h"
 
+//Options given to lyrebird.client, shared with its children
+typedef struct {
+	int cache_entries; //Entries in each child's block cache, 0 to disable
+	bool pipelined;    //Overlap reading, decrypting and writing each file
+	long long split;   //Files larger than this are shared between children
+	bool threaded;     //Decrypt in worker threads rather than child processes
+	int window;        //Files the server may queue on the client per child
+	bool incremental;  //Skip files whose output is up to date with their input
+	int stats_port;    //Port of the stats endpoint, -1 for none
+} client_options;
+
+//Defined in client.c, set before any children are created
+extern client_options options;
+
+//Part of an input file and where its decryption goes in the output file
+typedef struct {
+	long long in_offset;
+	long long in_length;
+	long long out_offset;
+} file_range;
+
+//A file, or part of one, to decrypt
+typedef struct {
+	char input_file[MAX_LOCATION_LENGTH];
+	char output_file[MAX_LOCATION_LENGTH];
+	bool ranged;      //Only decrypt range of the file
+	file_range range;
+	int split;        //Split task this is part of, -1 if none
+	unsigned int id;  //Given by the server, echoed back with the result
+	//Skip the file if its output is up to date, and record what it was
+	//decrypted from once it is. Never set for parts of a file.
+	bool incremental;
+	//When set, input_file is a local copy of this file, sent by the server,
+	//which is deleted once decrypted
+	char source[MAX_LOCATION_LENGTH];
+	double queued;    //When the client queued it, for its wait in the queue
+} task;
+
+/*
+ * decrypt_file
+ *
+ * Decrypt the given file and save the decrypted contents to the specified
+ * output file. The input is memory mapped and decrypted in place, and the
+ * output is written in large blocks.
+ *
+ * file_in:  Encrypted input file
+ * file_out: Decrypted output file
+ *
+ * returns:
+ *         0 - Successfully decrypted file
+ *         1 - Unable to open input file
+ *         2 - Unable to open or write output file
+ *         3 - Invalid characters in input file
+ *         4 - Malloc failure
+*/
+int decrypt_file(char* file_in, char* file_out);
+
+/*
+ * decrypt_file_range
+ *
+ * Decrypt part of the given file into its place in the output file, which
+ * must already exist. Used when a file is split between several children.
+ *
+ * file_in:    Encrypted input file
+ * file_out:   Decrypted output file
+ * in_offset:  Start of the part, at the beginning of a line
+ * in_length:  Length of the part, ending at the end of a line
+ * out_offset: Where the decrypted part goes in file_out
+ *
+ * returns: See decrypt_file
+*/
+int decrypt_file_range(char* file_in, char* file_out, long long in_offset, 
+	long long in_length, long long out_offset);
+
+/*
+ * decrypt_file_pipelined
+ *
+ * Decrypt the given file and save the decrypted contents to the specified
+ * output file. Reading, decrypting and writing run in separate threads 
+ * connected by bounded rings of chunks, so that waiting on a slow file 
+ * system overlaps with decryption.
+ *
+ * file_in:  Encrypted input file
+ * file_out: Decrypted output file
+ *
+ * returns: See decrypt_file
+*/
+int decrypt_file_pipelined(char* file_in, char* file_out);
+
+/*
+ * temp_output
+ *
+ * Names the file one copy of a task decrypts into before it is renamed over
+ * the output. It sits beside the output, so the rename stays on one file 
+ * system, and no other copy uses it, so a copy that loses to another never 
+ * touches the output the winner left.
+ *
+ * output: Output file
+ * path:   Location to store the path, holds MAX_LOCATION_LENGTH bytes
+ *
+ * returns: False if the path is too long
+*/
+bool temp_output(const char* output, char* path);
+
+/*
+ * perform_task
+ *
+ * Decrypts the file, or part of a file, described by a task and logs the 
+ * outcome.
+ *
+ * t:       Task to perform
+ * message: Location to store the message for the server, holds 
+ *          MAX_MESSAGE_LENGTH bytes
+ *
+ * returns: Result of decryption, see decrypt_file, or 5 if the output was
+ *          already up to date. The message goes to the server with the 
+ *          status given by task_status.
+*/
+int perform_task(task* t, char* message);
+
+/*
+ * task_status
+ *
+ * returns: Status code of the message reporting a result of perform_task
+*/
+char task_status(int result);
+
+/*
+ * split_file
+ *
+ * Plans how to decrypt a large file in several parts at once. The file is 
+ * cut at line boundaries close to every chunk_size bytes, and the output 
+ * file is created at its final size so each part can be written in place.
+ *
+ * file_in:    Encrypted input file
+ * file_out:   Decrypted output file
+ * chunk_size: Preferred size of each part
+ * ranges:     Location to store the parts
+ * max:        Maximum number of parts. chunk_size grows to keep within it.
+ *
+ * returns: Number of parts, or 0 if the file could not be split. The file 
+ *          should then be decrypted whole.
+*/
+int split_file(char* file_in, char* file_out, long long chunk_size, file_range* ranges, int max);
+
 /*
  * child_process
  *
@@ -12,26 +12,139 @@
  */
 
 #include <arpa/inet.h>
+#include <errno.h>
 #include <netinet/in.h>
+#include <poll.h>
+#include <pthread.h>
 #include <stdbool.h>
 #include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
+#include <sys/epoll.h>
+#include <fcntl.h>
+#include <sys/sendfile.h>
 #include <sys/socket.h>
+#include <sys/stat.h>
 #include <sys/sysinfo.h>
 #include <sys/time.h>
 #include <sys/types.h>
 #include <sys/wait.h>
+#include <time.h>
 #include <unistd.h>
 #include "child.h"
 #include "common.h"
+#include "decrypt.h"
+#include "manifest.h"
+#include "stats.h"
+#include "workers.h"
 #include "memwatch.h"
 
 //Stores the pipes for each child
 pc_pipe* children;
+//Messages from each child not yet forwarded
+frame_buffer* child_buffers;
+//Messages from the server not yet acted on
+frame_buffer server_buffer;
 //Socket file descriptor of connection with server
 int sockfd;
 //Total number of children
 int number;
+//Options given on the command line
+client_options options;
+
+//Most parts a file is split into
+#define MAX_SPLIT_RANGES 256
+//Most events taken from epoll at once
+#define MAX_EVENTS 16
+//Event data for the server socket, worker results and the stats endpoint,
+//children use their index
+#define SERVER_EVENT -1
+#define WORKERS_EVENT -2
+#define STATS_EVENT -3
+//Tasks the queue holds before it has to grow
+#define QUEUE_CAPACITY 16
+//Most bytes of a shipped file moved with one splice
+#define RECEIVE_CHUNK (1 << 16)
+
+//Waits on the server socket and every child pipe at once
+int epollfd;
+//What the server socket is waited on for
+unsigned int server_events = EPOLLIN;
+//Listening socket of the stats endpoint, -1 if none
+int stats_fd = -1;
+//When the client started, for its throughput
+double client_started;
+
+//Tasks received but not yet given to a child, oldest first
+task* queue;
+int queue_head = 0;
+int queue_count = 0;
+int queue_capacity = 0;
+
+//File being received from the server, copied to a local spool file
+typedef struct {
+	int fd;              //Spool file, -1 when not receiving
+	long long remaining; //Bytes of the file still to come
+	char path[MAX_LOCATION_LENGTH];
+	char line[MAX_CONFIG_FILE_LINE];
+	unsigned int id;
+	int pipe[2];         //Moves bytes from the socket to the file in the kernel
+} spool;
+spool receiving;
+
+//A message for the server held back while an output is being sent. An 
+//M_RESULT message stands for a task's output, and carries the success 
+//message sent once the output has been.
+typedef struct {
+	char type;
+	unsigned int id;
+	double elapsed; //Seconds spent decrypting, M_RESULT only
+	int length;
+	char payload[MAX_MESSAGE_LENGTH];
+} outgoing;
+
+//Messages waiting on the output being sent, oldest first
+outgoing* outbox;
+int outbox_head = 0;
+int outbox_count = 0;
+int outbox_capacity = 0;
+
+//True once the server asks for outputs to be sent back instead of written
+bool returning = false;
+//Output being sent back to the server, read straight from its spool file
+outgoing output;
+int output_fd = -1; //-1 when not sending
+off_t output_offset;
+off_t output_length;
+
+//Heartbeats are sent from their own thread, so they keep going while this
+//one splits or hashes a large file. Every write to the server socket holds
+//socket_lock.
+pthread_mutex_t socket_lock;
+pthread_cond_t heartbeat_wake = PTHREAD_COND_INITIALIZER;
+pthread_t heartbeat;
+bool heartbeat_running = false;
+bool heartbeat_stopping = false;
+
+//A file split between several children, reported to the server once every
+//part is done
+typedef struct {
+	bool in_use;
+	unsigned int id; //Id of the task the server sent
+	char input_file[MAX_LOCATION_LENGTH];
+	int remaining; //Parts not yet reported by a child
+	char status;   //M_SUCCESS, or M_ERROR once any part fails
+	double elapsed; //Seconds spent on the parts so far
+	char error[MAX_MESSAGE_LENGTH]; //First error reported
+	char spool[MAX_LOCATION_LENGTH]; //Local copy to delete once done, if shipped
+	bool incremental; //Record what the output was decrypted from once done
+	manifest_entry manifest;
+	char output_file[MAX_LOCATION_LENGTH];
+	char temp[MAX_LOCATION_LENGTH]; //Where the parts go, renamed to output_file once all succeed
+} split_task;
+
+//One per child, as each unfinished split task has a part in some child
+split_task* splits;
 
 /*
  * initialize
@@ -106,6 +219,54 @@ bool initialize(char* argv[])
 	return true;
 }
 
+/*
+ * watch
+ *
+ * Adds a file descriptor to those waited on by the main loop.
+ *
+ * fd: File descriptor to wait on
+ * id: Identifies the descriptor in events, a child index or *_EVENT
+ *
+ * returns: False if an error has occurred
+*/
+bool watch(int fd, int id)
+{
+	struct epoll_event event;
+	event.events = EPOLLIN;
+	event.data.u32 = id;
+	return epoll_ctl(epollfd, EPOLL_CTL_ADD, fd, &event) == 0;
+}
+
+/*
+ * queue_push
+ *
+ * Adds a task to the back of the queue, growing it if full.
+ *
+ * t: Task to queue, copied
+ *
+ * returns: False if the queue could not grow
+*/
+bool queue_push(task* t)
+{
+	if (queue_count == queue_capacity)
+	{
+		int capacity = queue_capacity == 0 ? QUEUE_CAPACITY : 2 * queue_capacity;
+		task* tasks = (task*)malloc(capacity * sizeof(task));
+		if (tasks == NULL)
+			return false;
+
+		for (int i = 0; i < queue_count; i++)
+			tasks[i] = queue[(queue_head + i) % queue_capacity];
+		free(queue);
+		queue = tasks;
+		queue_head = 0;
+		queue_capacity = capacity;
+	}
+
+	queue[(queue_head + queue_count++) % queue_capacity] = *t;
+	return true;
+}
+
 /*
  * create_children
  *
@@ -127,16 +288,46 @@ int create_children()
 	//Spawning 0 children would make no sense.
 	if (number == 0)
 		number = 1;
+	//Worker threads leave nothing for the main thread to do, use every core
+	if (options.threaded)
+		number = get_nprocs();
 
 	children = (pc_pipe*)malloc(number * sizeof(pc_pipe));
+	child_buffers = (frame_buffer*)calloc(number, sizeof(frame_buffer));
+	splits = (split_task*)calloc(number, sizeof(split_task));
 
-	if (children == NULL)
+	if (children == NULL || child_buffers == NULL || splits == NULL)
 	{
 		logmessage(NULL, "Memory allocation failed. Process ID #%i Exiting.", 
 					getpid());
 		return -3;
 	}
 
+	//A slot for each child or thread, and the last for this thread
+	if (options.stats_port >= 0 && !stats_create(number + 1))
+		logmessage(NULL, "Unable to allocate stats in process %i, continuing without them.", getpid());
+	stats_use(number);
+
+	if (options.threaded)
+	{
+		if (!workers_start(number))
+		{
+			logmessage(NULL, "Unable to create worker threads. Process ID #%i Exiting.", 
+					getpid());
+			return -3;
+		}
+
+		if (!watch(workers_notify_fd(), WORKERS_EVENT))
+		{
+			logmessage(NULL, "Unable to wait on worker threads. Process ID #%i Exiting.", 
+					getpid());
+			workers_stop();
+			return -3;
+		}
+
+		return -1;
+	}
+
 	for (int i = 0; i < number; i++)
 	{
 		pc_pipe connection;
@@ -150,6 +341,8 @@ int create_children()
 			return -2;
 		}
 
+		//Anything still in the log ring would be written by both processes
+		log_flush();
 		int pid = fork();
 		if (pid > 0)
 		{
@@ -157,9 +350,21 @@ int create_children()
 			close(connection.child[0]);
 
 			connection.pid = pid;
-			connection.ready = true;
+			connection.task = -1;
+			//Ready once it says so, a task sent sooner would be a second one
+			//in flight and its part of a split file would go unrecorded
+			connection.ready = false;
 			connection.terminated = false;
 			children[i] = connection;
+
+			if (!watch(connection.parent[0], i))
+			{
+				logmessage(NULL, "Unable to wait on child pipe. Process ID #%i will exit after existing children terminate.", 
+						getpid());
+
+				number = i + 1;
+				return -2;
+			}
 		}
 		else if (pid == 0)
 		{
@@ -173,8 +378,14 @@ int create_children()
 			close(connection.parent[0]);
 			close(connection.child[1]);
 			close(sockfd);
+			close(epollfd);
+			close(receiving.pipe[0]);
+			close(receiving.pipe[1]);
 
 			free(children);
+			free(child_buffers);
+			free(splits);
+			stats_use(i);
 
 			//Run the child process 'main' function
 			return child_process(connection);
@@ -193,58 +404,460 @@ int create_children()
 }
 
 /*
- * check_children
+ * output_spool
  *
- * Checks if there is any data on a child pipe, and if so reads and forwards any
- * messages to the server
+ * Gives the local file a task's output is written to before being sent back
+ * to the server.
  *
- * returns: False if a child has terminated or error has occurred
+ * id:   Id of the task
+ * path: Location to store the path
 */
-bool check_children()
+void output_spool(unsigned int id, char* path)
 {
-	fd_set set;
-	struct timeval tv;
-	tv.tv_sec = 0;
-	tv.tv_usec = 1000;
-	FD_ZERO(&set);
+	char* dir = getenv("TMPDIR");
+	snprintf(path, MAX_LOCATION_LENGTH, "%s/lyrebird.%i.%u.out", dir != NULL ? dir : "/tmp", 
+		getpid(), id);
+}
 
-	int maxfd = 0;
-	for (int i = 0; i < number; i++)
-	{
-		FD_SET(children[i].parent[0], &set);
-		maxfd = children[i].parent[0] > maxfd ? children[i].parent[0] : maxfd;
-	}
-	int val = select(maxfd + 1, &set, NULL, NULL, &tv); //no timeout curr
+/*
+ * watch_server
+ *
+ * Changes what the server socket is waited on for.
+ *
+ * events: EPOLLIN until the server has no more files, plus EPOLLOUT while 
+ *         an output is waiting for room to be sent
+*/
+void watch_server(unsigned int events)
+{
+	if (events == server_events)
+		return;
+
+	struct epoll_event event;
+	event.events = events;
+	event.data.u32 = SERVER_EVENT;
+	epoll_ctl(epollfd, EPOLL_CTL_MOD, sockfd, &event);
+	server_events = events;
+}
 
-	if (val == 0) //No messages
-		return true;
-	if (val < 0) //select failed
+/*
+ * outbox_push
+ *
+ * Adds a message to the back of the outbox, growing it if full.
+ *
+ * type:    Status code of message
+ * id:      Task the message is about, 0 if none
+ * payload: Null-terminated string to send
+ * length:  Length of payload, not counting the null
+ * elapsed: Seconds spent decrypting, for M_RESULT
+ *
+ * returns: False if the outbox could not grow
+*/
+bool outbox_push(char type, unsigned int id, const char* payload, int length, double elapsed)
+{
+	if (length >= MAX_MESSAGE_LENGTH)
 		return false;
-	
-	for (int i = 0; i < number; i++)
+
+	if (outbox_count == outbox_capacity)
 	{
-		if (FD_ISSET(children[i].parent[0], &set))
+		int capacity = outbox_capacity == 0 ? QUEUE_CAPACITY : 2 * outbox_capacity;
+		outgoing* messages = (outgoing*)malloc(capacity * sizeof(outgoing));
+		if (messages == NULL)
 		{
-			char buffer[MAX_MESSAGE_LENGTH];
-			int nbytes = 0;
+			logmessage(NULL, "Malloc failed holding a message for the server in process %i.", getpid());
+			return false;
+		}
+
+		for (int i = 0; i < outbox_count; i++)
+			messages[i] = outbox[(outbox_head + i) % outbox_capacity];
+		free(outbox);
+		outbox = messages;
+		outbox_head = 0;
+		outbox_capacity = capacity;
+	}
+
+	outgoing* m = outbox + (outbox_head + outbox_count++) % outbox_capacity;
+	m->type = type;
+	m->id = id;
+	m->elapsed = elapsed;
+	m->length = length;
+	memcpy(m->payload, payload, length);
+	m->payload[length] = '\0';
+	return true;
+}
+
+/*
+ * send_server
+ *
+ * Sends a message to the server, or holds it back if it would land in the 
+ * middle of an output being sent.
+ *
+ * type:    Status code of message
+ * id:      Task the message is about, 0 if none
+ * payload: Null-terminated string to send
+ * length:  Length of payload, not counting the null
+ *
+ * returns: False if an error occurs
+*/
+bool send_server(char type, unsigned int id, const char* payload, int length)
+{
+	bool sent;
+	pthread_mutex_lock(&socket_lock);
+	if (output_fd == -1 && outbox_count == 0)
+		sent = sendframe(sockfd, type, id, payload, length);
+	else
+		sent = outbox_push(type, id, payload, length, 0);
+	pthread_mutex_unlock(&socket_lock);
+	return sent;
+}
 
-			nbytes = read(children[i].parent[0], buffer, MAX_MESSAGE_LENGTH);
+/*
+ * report_timing
+ *
+ * Tells the server how long a task took to decrypt.
+ *
+ * id:      Id of the task
+ * elapsed: Seconds spent decrypting it
+*/
+void report_timing(unsigned int id, double elapsed)
+{
+	char text[32];
+	int length = snprintf(text, sizeof(text), "%.6f", elapsed);
+	send_server(M_TIMING, id, text, length);
+}
 
-			if (nbytes == 0)
+/*
+ * send_outbox
+ *
+ * Does the work of send_outputs, with socket_lock held.
+ *
+ * returns: False if the socket has failed
+*/
+bool send_outbox()
+{
+	char path[MAX_LOCATION_LENGTH];
+	while (true)
+	{
+		if (output_fd != -1)
+		{
+			//Never wait on the server here, so whatever it sends is still read
+			int flags = fcntl(sockfd, F_GETFL);
+			fcntl(sockfd, F_SETFL, flags | O_NONBLOCK);
+			ssize_t nbytes = 0;
+			while (output_offset < output_length)
 			{
-				children[i].terminated = true;
-				return false;
+				nbytes = sendfile(sockfd, output_fd, &output_offset, output_length - output_offset);
+				if (nbytes <= 0 && !(nbytes < 0 && errno == EINTR))
+					break;
 			}
-			else
+			int error = errno;
+			fcntl(sockfd, F_SETFL, flags);
+
+			if (output_offset < output_length)
 			{
-				//Forward message to server
-				write(sockfd, buffer, nbytes);
-				children[i].ready = true;
+				if (nbytes < 0 && (error == EAGAIN || error == EWOULDBLOCK))
+				{
+					watch_server(server_events | EPOLLOUT);
+					return true;
+				}
+				return false; //The spool file cannot be short, so the socket failed
 			}
+
+			close(output_fd);
+			output_fd = -1;
+			output_spool(output.id, path);
+			unlink(path);
+			if (!sendframe(sockfd, M_SUCCESS, output.id, output.payload, output.length))
+				return false;
+			report_timing(output.id, output.elapsed);
+		}
+
+		if (outbox_count == 0)
+		{
+			watch_server(server_events & ~EPOLLOUT);
+			return true;
 		}
+
+		output = outbox[outbox_head];
+		outbox_head = (outbox_head + 1) % outbox_capacity;
+		outbox_count--;
+		if (output.type != M_RESULT)
+		{
+			if (!sendframe(sockfd, output.type, output.id, output.payload, output.length))
+				return false;
+			continue;
+		}
+
+		output_spool(output.id, path);
+		struct stat st;
+		output_fd = open(path, O_RDONLY);
+		if (output_fd == -1 || fstat(output_fd, &st) == -1)
+		{
+			if (output_fd != -1)
+				close(output_fd);
+			output_fd = -1;
+			unlink(path);
+
+			char message[MAX_MESSAGE_LENGTH];
+			snprintf(message, sizeof(message), "Unable to read back the output of %.2048s", output.payload);
+			if (!sendframe(sockfd, M_ERROR, output.id, message, strlen(message)))
+				return false;
+			report_timing(output.id, output.elapsed);
+			continue;
+		}
+
+		char size[32];
+		int length = snprintf(size, sizeof(size), "%lld", (long long)st.st_size);
+		output_offset = 0;
+		output_length = st.st_size;
+		if (!sendframe(sockfd, M_RESULT, output.id, size, length))
+			return false;
 	}
+}
 
-	return true;
+/*
+ * send_outputs
+ *
+ * Sends the outbox to the server, for as long as the socket has room. An 
+ * output is sent straight from its spool file after an M_RESULT message 
+ * giving its length, followed by its task's success message. Once the 
+ * socket is full the server socket is also waited on for room.
+ *
+ * returns: False if the socket has failed
+*/
+bool send_outputs()
+{
+	//Held throughout, so a heartbeat never lands inside an output
+	pthread_mutex_lock(&socket_lock);
+	bool sent = send_outbox();
+	pthread_mutex_unlock(&socket_lock);
+	return sent;
+}
+
+/*
+ * send_heartbeats
+ *
+ * Heartbeat thread. Tells the server every HEARTBEAT_INTERVAL seconds that
+ * the client is alive, until stop_heartbeats is called. None is sent in the
+ * middle of an output, but the server hears from the client as it reads 
+ * the output.
+ *
+ * arg: Unused
+ *
+ * returns: NULL
+*/
+void* send_heartbeats(void* arg)
+{
+	pthread_mutex_lock(&socket_lock);
+	while (!heartbeat_stopping)
+	{
+		struct timespec due;
+		clock_gettime(CLOCK_REALTIME, &due);
+		due.tv_sec += HEARTBEAT_INTERVAL;
+		int waited = 0;
+		while (!heartbeat_stopping && waited != ETIMEDOUT)
+			waited = pthread_cond_timedwait(&heartbeat_wake, &socket_lock, &due);
+
+		if (!heartbeat_stopping && output_fd == -1)
+			sendframe(sockfd, M_HEARTBEAT, 0, "", 0);
+	}
+	pthread_mutex_unlock(&socket_lock);
+	return NULL;
+}
+
+/*
+ * start_heartbeats
+ *
+ * Starts the heartbeat thread. Must be called after the children are 
+ * forked, as they would not get a copy of it.
+ *
+ * returns: False if the thread could not be started
+*/
+bool start_heartbeats()
+{
+	heartbeat_stopping = false;
+	heartbeat_running = pthread_create(&heartbeat, NULL, send_heartbeats, NULL) == 0;
+	return heartbeat_running;
+}
+
+/*
+ * stop_heartbeats
+ *
+ * Stops the heartbeat thread, if running, and waits for it to finish.
+*/
+void stop_heartbeats()
+{
+	if (!heartbeat_running)
+		return;
+
+	pthread_mutex_lock(&socket_lock);
+	heartbeat_stopping = true;
+	pthread_cond_signal(&heartbeat_wake);
+	pthread_mutex_unlock(&socket_lock);
+	pthread_join(heartbeat, NULL);
+	heartbeat_running = false;
+}
+
+/*
+ * report_result
+ *
+ * Tells the server whether a task succeeded. When outputs are being sent 
+ * back, a successful task's output is sent before its result.
+ *
+ * id:      Id of the task
+ * status:  M_SUCCESS or M_ERROR
+ * text:    Message from the child or worker
+ * length:  Length of text
+ * elapsed: Seconds spent decrypting it
+*/
+void report_result(unsigned int id, char status, char* text, int length, double elapsed)
+{
+	if (returning && status == M_SUCCESS)
+	{
+		if (outbox_push(M_RESULT, id, text, length, elapsed) && output_fd == -1)
+			send_outputs();
+		return;
+	}
+
+	if (returning)
+	{
+		char path[MAX_LOCATION_LENGTH];
+		output_spool(id, path);
+		unlink(path);
+	}
+	send_server(status, id, text, length);
+	//Nothing was decrypted, so it says nothing about how long files take
+	if (status != M_SKIPPED)
+		report_timing(id, elapsed);
+}
+
+/*
+ * report_part
+ *
+ * Records the result of one part of a split file. Once every part is done
+ * a single message for the whole file is sent to the server.
+ *
+ * task:   Split task the part belongs to
+ * status: M_SUCCESS or M_ERROR
+ * text:    Message from the child or worker
+ * length:  Length of text
+ * elapsed: Seconds spent decrypting the part
+*/
+void report_part(int task, char status, char* text, int length, double elapsed)
+{
+	split_task* split = splits + task;
+	split->elapsed += elapsed;
+	if (status == M_ERROR && split->status != M_ERROR)
+	{
+		split->status = M_ERROR;
+		snprintf(split->error, sizeof(split->error), "%.*s", length, text);
+	}
+
+	if (--split->remaining == 0)
+	{
+		if (split->status != M_ERROR && rename(split->temp, split->output_file) == -1)
+		{
+			split->status = M_ERROR;
+			snprintf(split->error, sizeof(split->error), "Unable to open file %s in process %i.", 
+				split->output_file, getpid());
+			logmessage(NULL, "%s", split->error);
+		}
+
+		if (split->status == M_ERROR)
+		{
+			unlink(split->temp);
+			report_result(split->id, M_ERROR, split->error, strlen(split->error), split->elapsed);
+		}
+		else
+		{
+			char message[MAX_MESSAGE_LENGTH];
+			snprintf(message, sizeof(message), "%s in process %i", split->input_file, getpid());
+			if (split->incremental && !manifest_save(split->output_file, &split->manifest))
+				logmessage(NULL, "Unable to write the manifest for %s in process %i.", 
+					split->output_file, getpid());
+			report_result(split->id, M_SUCCESS, message, strlen(message), split->elapsed);
+		}
+		if (split->spool[0] != '\0')
+			unlink(split->spool);
+		split->in_use = false;
+	}
+}
+
+/*
+ * forward_message
+ *
+ * Passes a message from a child on to the server. Results for parts of a 
+ * split file are held back and combined into one message for the file.
+ *
+ * i: Index of child
+ * f: Message from the child
+*/
+void forward_message(int i, frame* f)
+{
+	int task = children[i].task;
+	if (f->type == M_READY)
+		return; //Server was already given credit for the child
+
+	double elapsed = getseconds() - children[i].started;
+	if (task < 0)
+		report_result(f->id, f->type, f->payload, f->length, elapsed);
+	else
+	{
+		children[i].task = -1;
+		report_part(task, f->type, f->payload, f->length, elapsed);
+	}
+}
+
+/*
+ * check_workers
+ *
+ * Forwards the results of any tasks the worker threads have finished to the
+ * server.
+*/
+void check_workers()
+{
+	task_result results[16];
+	int count;
+	while ((count = workers_results(results, 16)) > 0)
+	{
+		for (int i = 0; i < count; i++)
+		{
+			if (results[i].split < 0)
+				report_result(results[i].id, results[i].status, results[i].message, 
+					strlen(results[i].message), results[i].elapsed);
+			else
+				report_part(results[i].split, results[i].status, results[i].message, 
+					strlen(results[i].message), results[i].elapsed);
+		}
+	}
+}
+
+/*
+ * check_child
+ *
+ * Reads and forwards any messages on a child's pipe to the server.
+ *
+ * i: Index of child
+ *
+ * returns: False if the child has terminated or error has occurred
+*/
+bool check_child(int i)
+{
+	frame f;
+	int result;
+
+	if (readframes(children[i].parent[0], child_buffers + i) <= 0)
+	{
+		children[i].terminated = true;
+		return false;
+	}
+
+	//Forward messages to server
+	while ((result = nextframe(child_buffers + i, &f)) > 0)
+	{
+		forward_message(i, &f);
+		children[i].ready = true;
+	}
+	return result == 0;
 }
 
 /*
@@ -256,6 +869,12 @@ bool check_children()
 */
 void close_children()
 {
+	if (options.threaded)
+	{
+		workers_stop();
+		return;
+	}
+
 	//Close the pipes up and read any remaining messages.
 	for (int i = 0; i < number; i++)
 	{
@@ -266,10 +885,7 @@ void close_children()
 		close(children[i].child[1]);
 
 		//Read and forward any remaining messages off of pipe
-		char buffer[MAX_CONFIG_FILE_LINE];
-		int nbytes = 0;
-		while ((nbytes = read(children[i].parent[0], buffer, sizeof(buffer))) > 0)
-			write(sockfd, buffer, nbytes);
+		while (check_child(i));
 	}
 
 	//Ensure all children have successfully terminated
@@ -285,46 +901,559 @@ void close_children()
 	}
 }
 
+/*
+ * dispatch
+ *
+ * Sends queued tasks to whichever children are ready, oldest first.
+*/
+void dispatch()
+{
+	for (int i = 0; i < number && queue_count > 0; i++)
+	{
+		if (!children[i].ready || children[i].terminated)
+			continue;
+
+		task* t = queue + queue_head;
+		char line[MAX_CONFIG_FILE_LINE + MAX_LOCATION_LENGTH + 64];
+		int length = snprintf(line, sizeof(line), "%s %s %lld %lld %lld %i %s", t->input_file, t->output_file, 
+			t->range.in_offset, t->ranged ? t->range.in_length : -1, t->range.out_offset, 
+			t->incremental ? 1 : 0, t->source[0] != '\0' ? t->source : "-");
+
+		sendframe(children[i].child[1], M_LINE, t->id, line, length);
+		children[i].ready = false; // Busy!
+		children[i].task = t->split;
+		children[i].started = getseconds();
+		STATS_ADD(waited, 1);
+		STATS_ADD(wait_us, (children[i].started - t->queued) * 1000000);
+
+		queue_head = (queue_head + 1) % queue_capacity;
+		queue_count--;
+	}
+}
+
+/*
+ * schedule
+ *
+ * Hands a task to the worker threads, or queues it until a child is ready.
+ *
+ * t: Task to perform
+*/
+void schedule(task* t)
+{
+	t->queued = getseconds();
+	STATS_ADD(received, 1);
+	if (options.threaded)
+		workers_submit(t);
+	else if (!queue_push(t))
+	{
+		STATS_ADD(cancelled, 1);
+		//Report it like a failed task so the server does not wait on it
+		char message[MAX_MESSAGE_LENGTH];
+		snprintf(message, sizeof(message), "Malloc failed queueing %s in process %i", 
+			t->source[0] != '\0' ? t->source : t->input_file, getpid());
+		if (t->source[0] != '\0' && t->split < 0)
+			unlink(t->input_file);
+		if (t->split < 0)
+			send_server(M_ERROR, t->id, message, strlen(message));
+		else
+			report_part(t->split, M_ERROR, message, strlen(message), 0);
+	}
+}
+
+/*
+ * cancel_task
+ *
+ * Drops a task another client has already finished, if it has not been 
+ * started, and tells the server so. Parts of split files are always finished.
+ *
+ * id: Id of the task
+*/
+void cancel_task(unsigned int id)
+{
+	bool cancelled = false;
+
+	if (options.threaded)
+		cancelled = workers_cancel(id);
+	else
+	{
+		//Close up the gap left in the queue
+		int kept = 0;
+		for (int i = 0; i < queue_count; i++)
+		{
+			task* t = queue + (queue_head + i) % queue_capacity;
+			if (t->id == id && t->split < 0)
+			{
+				cancelled = true;
+				if (t->source[0] != '\0')
+					unlink(t->input_file);
+			}
+			else
+				queue[(queue_head + kept++) % queue_capacity] = *t;
+		}
+		queue_count = kept;
+	}
+
+	if (cancelled)
+	{
+		STATS_ADD(cancelled, 1);
+		send_server(M_CANCEL, id, "", 0);
+	}
+}
+
 /*
  * fcfs_scheduler
  *
  * First Come First Serve scheduler.
- * Will wait until a child is ready to decrypt, then send the file to the first
- * available one.
+ * Queues the file to be sent to the first available child. Files larger than
+ * the split size are cut into parts that are handed to several children.
+ *
+ * line:  Line specifying input and output file
+ * id:    Id the server gave the line
+ * spool: Local copy of the input file sent by the server, NULL if none
+*/
+void fcfs_scheduler(char* line, unsigned int id, char* spool)
+{
+	file_range ranges[MAX_SPLIT_RANGES];
+	int count = 0;
+	int slot = 0;
+	task t;
+	manifest_entry manifest;
+	struct stat st;
+
+	if (sscanf(line, "%s %s", t.input_file, t.output_file) != 2)
+		return; //Server only sends valid lines
+	t.ranged = false;
+	t.split = -1;
+	t.id = id;
+	t.source[0] = '\0';
+	//Outputs sent back are the server's to keep track of
+	t.incremental = options.incremental && !returning;
+	if (returning)
+		output_spool(id, t.output_file);
+	if (spool != NULL)
+	{
+		strcpy(t.source, t.input_file);
+		strcpy(t.input_file, spool);
+	}
+
+	if (options.split > 0 && number > 1)
+	{
+		while (slot < number && splits[slot].in_use)
+			slot++;
+		if (slot < number && stat(t.input_file, &st) == 0 && st.st_size > options.split)
+		{
+			//Each part is decrypted on its own, so the whole file is checked here
+			if (t.incremental && manifest_check(t.input_file, t.output_file, &manifest, true))
+			{
+				char message[MAX_MESSAGE_LENGTH];
+				snprintf(message, sizeof(message), "%s in process %i", 
+					spool != NULL ? t.source : t.input_file, getpid());
+				logmessage(NULL, "Process ID #%i skipped %s, its output is up to date.", getpid(), 
+					spool != NULL ? t.source : t.input_file);
+				if (spool != NULL)
+					unlink(spool);
+				report_result(id, M_SKIPPED, message, strlen(message), 0);
+				return;
+			}
+			//Parts are written beside the output and only replace it once 
+			//every one has succeeded
+			if (temp_output(t.output_file, splits[slot].temp))
+			{
+				count = split_file(t.input_file, splits[slot].temp, options.split, ranges, 
+					MAX_SPLIT_RANGES);
+				if (count <= 1)
+					unlink(splits[slot].temp);
+			}
+		}
+	}
+
+	if (count <= 1)
+	{
+		schedule(&t);
+		return;
+	}
+
+	split_task* split = splits + slot;
+	split->in_use = true;
+	split->id = id;
+	split->elapsed = 0;
+	split->remaining = count;
+	split->status = M_SUCCESS;
+	strcpy(split->input_file, spool != NULL ? t.source : t.input_file);
+	strcpy(split->spool, spool != NULL ? spool : "");
+	strcpy(split->output_file, t.output_file);
+	strcpy(t.output_file, split->temp);
+	split->incremental = t.incremental;
+	split->manifest = manifest;
+
+	t.ranged = true;
+	t.split = slot;
+	t.incremental = false;
+	for (int i = 0; i < count; i++)
+	{
+		t.range = ranges[i];
+		schedule(&t);
+	}
+}
+
+/*
+ * start_receiving
+ *
+ * Creates a spool file for a file the server is about to send.
+ *
+ * f: The M_DATA message that precedes the file
+ *
+ * returns: False if the message is malformed
+*/
+bool start_receiving(frame* f)
+{
+	int offset = 0;
+	if (sscanf(f->payload, "%lld %n", &receiving.remaining, &offset) != 1 || 
+		receiving.remaining < 0)
+		return false;
+
+	snprintf(receiving.line, sizeof(receiving.line), "%s", f->payload + offset);
+	receiving.id = f->id;
+
+	//The bytes still have to be read off the socket if this fails, and the
+	//child will report the missing spool file
+	char* dir = getenv("TMPDIR");
+	snprintf(receiving.path, sizeof(receiving.path), "%s/lyrebird.XXXXXX", 
+		dir != NULL ? dir : "/tmp");
+	receiving.fd = mkstemp(receiving.path);
+	if (receiving.fd == -1)
+		logmessage(NULL, "Unable to create spool file %s. Process ID #%i.", receiving.path, getpid());
+	return true;
+}
+
+/*
+ * spool_failed
+ *
+ * Gives up on the spool file, so decrypting it reports the file as missing
+ * instead of decrypting part of it.
+*/
+void spool_failed()
+{
+	logmessage(NULL, "Unable to write spool file %s. Process ID #%i.", receiving.path, getpid());
+	close(receiving.fd);
+	unlink(receiving.path);
+	receiving.fd = -1;
+}
+
+/*
+ * spool_bytes
+ *
+ * Adds bytes of the file being received to its spool file.
+ *
+ * data:   Bytes to add
+ * length: Number of bytes
+*/
+void spool_bytes(char* data, long long length)
+{
+	if (receiving.fd != -1 && !writeall(receiving.fd, data, length))
+		spool_failed();
+	receiving.remaining -= length;
+}
+
+/*
+ * finish_receiving
+ *
+ * Queues the file just received, decrypting the spool file in its place.
+*/
+void finish_receiving()
+{
+	if (receiving.fd != -1)
+		close(receiving.fd);
+	receiving.fd = -1;
+	fcfs_scheduler(receiving.line, receiving.id, receiving.path);
+}
+
+/*
+ * receive_file
  *
- * line: Line specifying input and output file
+ * Moves as much of the file being received as has arrived from the socket 
+ * into its spool file, without copying it through user space.
  *
- * returns: False if a child has terminated
+ * returns: False if the socket has closed or failed
 */
-bool fcfs_scheduler(char* line)
+bool receive_file()
 {
-	bool decrypting = false;
-	while (!decrypting)
+	long long max = receiving.remaining < RECEIVE_CHUNK ? receiving.remaining : RECEIVE_CHUNK;
+	ssize_t nbytes = -1;
+
+	if (receiving.fd != -1)
 	{
-		//Must constantly check if a child is ready.
-		if (!check_children())
+		nbytes = splice(sockfd, NULL, receiving.pipe[1], NULL, max, SPLICE_F_MOVE);
+		//errno only means something when splice was tried and failed
+		if (nbytes < 0 && errno == EINTR)
+			return true;
+		if (nbytes == 0)
 			return false;
+	}
 
-		for (int i = 0; i < number; i++)
+	if (nbytes > 0)
+	{
+		//The pipe holds RECEIVE_CHUNK bytes, so this never waits on the socket
+		ssize_t moved = 0;
+		while (moved < nbytes)
 		{
-			if (children[i].ready)
+			ssize_t n = splice(receiving.pipe[0], NULL, receiving.fd, NULL, nbytes - moved, SPLICE_F_MOVE);
+			if (n < 0 && errno == EINTR)
+				continue;
+			if (n <= 0)
 			{
-				write(children[i].child[1], line, strlen(line));
-				children[i].ready = false; // Busy!
-				decrypting = true;
+				//Drain what is left so the pipe is empty for the next file
+				char discard[RECEIVE_CHUNK];
+				read(receiving.pipe[0], discard, nbytes - moved);
+				spool_failed();
 				break;
 			}
+			moved += n;
+		}
+		receiving.remaining -= nbytes;
+	}
+	else
+	{
+		//Nowhere to put it or splice is unsupported, copy it instead
+		char buffer[RECEIVE_CHUNK];
+		nbytes = read(sockfd, buffer, max);
+		if (nbytes <= 0)
+			return nbytes < 0 && errno == EINTR;
+		spool_bytes(buffer, nbytes);
+	}
+
+	if (receiving.remaining == 0)
+		finish_receiving();
+	return true;
+}
+
+/*
+ * read_server
+ *
+ * Reads and acts on whatever the server has sent.
+ *
+ * exiting: Set once the server has no more files
+ *
+ * returns: False if the socket has closed or sent something malformed
+*/
+bool read_server(bool* exiting)
+{
+	frame f;
+	int parsed;
+
+	//A file being received is read straight off the socket once nothing 
+	//before it is left in the buffer
+	if (receiving.remaining > 0 && server_buffer.length == 0)
+		return receive_file();
+
+	if (readframes(sockfd, &server_buffer) <= 0)
+		return false;
+
+	while (!*exiting)
+	{
+		if (receiving.remaining > 0)
+		{
+			//Start of the file arrived along with the message before it
+			long long length = server_buffer.length < receiving.remaining ? 
+				server_buffer.length : receiving.remaining;
+			spool_bytes(server_buffer.data + server_buffer.start, length);
+			server_buffer.start += length;
+			server_buffer.length -= length;
+			if (receiving.remaining > 0)
+				return true;
+			finish_receiving();
+		}
+
+		if ((parsed = nextframe(&server_buffer, &f)) <= 0)
+			return parsed == 0;
+
+		if (f.type == M_EXIT)
+		{
+			*exiting = true;
+			watch_server(server_events & ~EPOLLIN);
+		}
+		else if (f.type == M_RETURN)
+			returning = true;
+		else if (f.type == M_LINE)
+			fcfs_scheduler(f.payload, f.id, NULL);
+		else if (f.type == M_CANCEL)
+			cancel_task(f.id);
+		else if (f.type == M_DATA)
+		{
+			if (!start_receiving(&f))
+				return false;
+			if (receiving.remaining == 0)
+				finish_receiving();
 		}
 	}
 	return true;
 }
 
+/*
+ * client_stats
+ *
+ * Describes the client's tasks and its children's or threads' work for the
+ * stats endpoint.
+ *
+ * text: Text to append the metrics to
+*/
+void client_stats(stats_text* text)
+{
+	stats_slot total, slot;
+	stats_read(-1, &total);
+	double elapsed = getseconds() - client_started;
+	//Counters are read one at a time while children update them, so the
+	//differences can briefly come out negative
+	long long queued = (long long)total.received - (long long)total.cancelled - 
+		(long long)total.started;
+	long long in_flight = (long long)total.started - (long long)total.completed - 
+		(long long)total.skipped - (long long)total.failed;
+
+	stats_metric(text, "lyrebird_client_kernel_info", "gauge", "Kernel batches of blocks are decrypted with.");
+	stats_printf(text, "lyrebird_client_kernel_info{kernel=\"%s\"} 1\n", decrypt_kernel_name());
+	stats_metric(text, "lyrebird_client_tasks_queued", "gauge", "Tasks waiting for a child or thread.");
+	stats_printf(text, "lyrebird_client_tasks_queued %lli\n", queued > 0 ? queued : 0);
+	stats_metric(text, "lyrebird_client_tasks_in_flight", "gauge", "Tasks being decrypted.");
+	stats_printf(text, "lyrebird_client_tasks_in_flight %lli\n", in_flight > 0 ? in_flight : 0);
+	stats_metric(text, "lyrebird_client_tasks_completed_total", "counter", "Tasks decrypted.");
+	stats_printf(text, "lyrebird_client_tasks_completed_total %llu\n", total.completed);
+	stats_metric(text, "lyrebird_client_tasks_skipped_total", "counter", "Tasks whose output was already up to date.");
+	stats_printf(text, "lyrebird_client_tasks_skipped_total %llu\n", total.skipped);
+	stats_metric(text, "lyrebird_client_tasks_failed_total", "counter", "Tasks that failed.");
+	stats_printf(text, "lyrebird_client_tasks_failed_total %llu\n", total.failed);
+	stats_metric(text, "lyrebird_client_bytes_decrypted_total", "counter", "Encrypted bytes decrypted.");
+	stats_printf(text, "lyrebird_client_bytes_decrypted_total %llu\n", total.bytes);
+	stats_metric(text, "lyrebird_client_tweets_decrypted_total", "counter", "Tweets decrypted.");
+	stats_printf(text, "lyrebird_client_tweets_decrypted_total %llu\n", total.tweets);
+	stats_metric(text, "lyrebird_client_blocks_decrypted_total", "counter", "Six character blocks decrypted.");
+	stats_printf(text, "lyrebird_client_blocks_decrypted_total %llu\n", total.blocks);
+	stats_metric(text, "lyrebird_client_throughput_bytes_per_second", "gauge", 
+		"Encrypted bytes decrypted per second since the client started.");
+	stats_printf(text, "lyrebird_client_throughput_bytes_per_second %.1f\n", 
+		elapsed > 0 ? total.bytes / elapsed : 0);
+	stats_metric(text, "lyrebird_client_queue_wait_seconds", "summary", 
+		"Time tasks spent queued before a child or thread started them.");
+	stats_printf(text, "lyrebird_client_queue_wait_seconds_sum %.6f\n", total.wait_us / 1000000.0);
+	stats_printf(text, "lyrebird_client_queue_wait_seconds_count %llu\n", total.waited);
+
+	stats_metric(text, "lyrebird_client_worker_tasks_total", "counter", 
+		"Tasks finished by each child or thread, whatever the outcome.");
+	for (int i = 0; i < number; i++)
+	{
+		stats_read(i, &slot);
+		stats_printf(text, "lyrebird_client_worker_tasks_total{worker=\"%i\"} %llu\n", 
+			i, slot.completed + slot.skipped + slot.failed);
+	}
+	stats_metric(text, "lyrebird_client_worker_bytes_total", "counter", 
+		"Encrypted bytes decrypted by each child or thread.");
+	for (int i = 0; i < number; i++)
+	{
+		stats_read(i, &slot);
+		stats_printf(text, "lyrebird_client_worker_bytes_total{worker=\"%i\"} %llu\n", i, slot.bytes);
+	}
+}
+
 int main(int argc, char **argv)
 {
 	//True if the socket prematurely closes
 	bool socket_error = false;
-	//Store messages from server
-	char buffer[MAX_MESSAGE_LENGTH];
+
+	//Parse the optional flags, which come before the IP address and port
+	int opt;
+	char* endptr;
+	unsigned int p, q;
+	char* kernel = NULL;
+	options.cache_entries = 0;
+	options.pipelined = false;
+	options.split = 0;
+	options.threaded = false;
+	options.window = 2;
+	options.incremental = false;
+	options.stats_port = -1;
+	while ((opt = getopt(argc, argv, "c:ik:K:m:ps:tw:")) != -1)
+	{
+		switch (opt)
+		{
+			case 'm': //Port of the stats endpoint
+				options.stats_port = strtol(optarg, &endptr, 10);
+				if (*endptr != '\0' || options.stats_port < 0 || options.stats_port > 65535)
+				{
+					logmessage(NULL, "'%s' is not a valid stats port. Process ID #%i Exiting.", 
+						optarg, getpid());
+
+					return EXIT_FAILURE;
+				}
+				break;
+			case 'i': //Skip files whose output is up to date
+				options.incremental = true;
+				break;
+			case 'w': //Files queued per child
+				options.window = strtol(optarg, &endptr, 10);
+				if (*endptr != '\0' || options.window < 1 || options.window > 1024)
+				{
+					logmessage(NULL, "'%s' is not a valid prefetch window. Process ID #%i Exiting.", 
+						optarg, getpid());
+
+					return EXIT_FAILURE;
+				}
+				break;
+			case 't': //Worker threads instead of child processes
+				options.threaded = true;
+				break;
+			case 's': //Share files larger than this between children
+				options.split = strtoll(optarg, &endptr, 10);
+				if (*endptr != '\0' || options.split < 0)
+				{
+					logmessage(NULL, "'%s' is not a valid split size. Process ID #%i Exiting.", 
+						optarg, getpid());
+
+					return EXIT_FAILURE;
+				}
+				break;
+			case 'p': //Pipelined reading, decrypting and writing
+				options.pipelined = true;
+				break;
+			case 'k': //Factors of the key, to decrypt with CRT
+				if (sscanf(optarg, "%u,%u", &p, &q) != 2 || !decrypt_set_factors(p, q))
+				{
+					logmessage(NULL, "'%s' are not the factors of the key. Process ID #%i Exiting.", 
+						optarg, getpid());
+
+					return EXIT_FAILURE;
+				}
+				break;
+			case 'K': //Kernel to decrypt batches with, instead of the fastest
+				kernel = optarg;
+				break;
+			case 'c': //Block cache entries per child
+				options.cache_entries = strtol(optarg, &endptr, 10);
+				if (*endptr != '\0' || options.cache_entries < 0)
+				{
+					logmessage(NULL, "'%s' is not a valid cache size. Process ID #%i Exiting.", 
+						optarg, getpid());
+
+					return EXIT_FAILURE;
+				}
+				break;
+			default:
+				return EXIT_FAILURE;
+		}
+	}
+	//Chosen once here, so every child and thread inherits it
+	if (!decrypt_select_kernel(kernel))
+	{
+		char names[64] = "";
+		for (int i = 0; decrypt_kernel_at(i) != NULL; i++)
+			snprintf(names + strlen(names), sizeof(names) - strlen(names), "%s, ", decrypt_kernel_at(i));
+		logmessage(NULL, "'%s' is not a kernel this CPU can run, choose from %sor auto. Process ID #%i Exiting.", 
+			kernel == NULL ? getenv(DECRYPT_KERNEL_ENV) : kernel, names, getpid());
+
+		return EXIT_FAILURE;
+	}
+
+	//Leave the IP address and port at argv[1] and argv[2]
+	argc -= optind - 1;
+	argv += optind - 1;
 
 	if (argc < 3)
 	{
@@ -337,6 +1466,33 @@ int main(int argc, char **argv)
 	//Initialize our server socket
 	if (!initialize(argv))
 		return EXIT_FAILURE;
+	logmessage(NULL, "lyrebird.client: PID %i decrypting batches with the %s kernel.", 
+		getpid(), decrypt_kernel_name());
+
+	receiving.fd = -1;
+	receiving.remaining = 0;
+	if (pipe(receiving.pipe) == -1)
+	{
+		logmessage(NULL, "Unable to create pipe. Process ID #%i Exiting.", getpid());
+		return EXIT_FAILURE;
+	}
+	fcntl(receiving.pipe[0], F_SETPIPE_SZ, RECEIVE_CHUNK);
+
+	epollfd = epoll_create1(0);
+	if (epollfd == -1 || !watch(sockfd, SERVER_EVENT))
+	{
+		logmessage(NULL, "Unable to create epoll instance. Process ID #%i Exiting.", 
+			getpid());
+
+		return EXIT_FAILURE;
+	}
+
+	//Recursive, as sending outputs also sends messages
+	pthread_mutexattr_t recursive;
+	pthread_mutexattr_init(&recursive);
+	pthread_mutexattr_settype(&recursive, PTHREAD_MUTEX_RECURSIVE);
+	pthread_mutex_init(&socket_lock, &recursive);
+	pthread_mutexattr_destroy(&recursive);
 
 	//Create children. See the function description for full meaning of return
 	//values.
@@ -350,55 +1506,88 @@ int main(int argc, char **argv)
 		//Parent process, no critical error has occurred so can continue with
 		//decryption of files
 
-		char status = 0;
-		fd_set set;
-		struct timeval tv;
-		int val;
+		//Let the server queue files here, so each child is handed its next
+		//file as soon as it finishes instead of after a round trip
+		char credit[32];
+		snprintf(credit, sizeof(credit), "%i %i", number * options.window, number);
+		sendmessage(sockfd, M_CREDIT, credit);
 
-		while (1)
+		//Lets the server tell a busy client from a failed one
+		if (!start_heartbeats())
 		{
-			tv.tv_sec = 0;
-			tv.tv_usec = 1000;
-			FD_ZERO(&set);
+			socket_error = true;
+			logmessage(NULL, "Unable to start the heartbeat thread. Process ID #%i will exit after children terminate.", 
+				getpid());
+		}
+
+		//Opened after forking, so the children never hold it
+		client_started = getseconds();
+		if (options.stats_port >= 0)
+		{
+			stats_fd = stats_listen(options.stats_port);
+			if (stats_fd == -1 || !watch(stats_fd, STATS_EVENT))
+				logmessage(NULL, "Unable to open the stats endpoint. Process ID #%i will continue without it.", 
+					getpid());
+		}
+
+		struct epoll_event events[MAX_EVENTS];
+		//Set once the server has no more files, queued tasks still need to finish
+		bool exiting = false;
+		bool failed = socket_error;
 
-			FD_SET(sockfd, &set);
-			val = select(sockfd + 1, &set, NULL, NULL, &tv); //no timeout curr
+		while (!failed)
+		{
+			//Only stop once nothing the server sent is left undone
+			if (exiting && queue_count == 0 && output_fd == -1 && outbox_count == 0 &&
+				(!options.threaded || workers_outstanding() == 0))
+				break;
 
-			if (val > 0 && FD_ISSET(sockfd, &set))
+			//Sleep until the server or a child has something for us. Logs are
+			//written while there is nothing to do, and at least this often.
+			log_flush();
+			int count = epoll_wait(epollfd, events, MAX_EVENTS, HEARTBEAT_INTERVAL * 1000);
+			if (count < 0 && errno != EINTR)
 			{
-				//Read in the message
-				if (read(sockfd, &status, 1) <= 0 || 
-					readnullstring(sockfd, buffer, MAX_MESSAGE_LENGTH - 1) <= 0)
-				{
-					socket_error = true;
-					logmessage(NULL, "Socket unexpectedly disconnected. Process ID #%i.", getpid());
-					break;
-				}
-				if (status == M_EXIT)
-					break;
+				socket_error = true;
+				logmessage(NULL, "Epoll failed. Process ID #%i will exit after children terminate.", getpid());
+				break;
+			}
 
-				if (status == M_LINE)
+			for (int e = 0; e < count && !failed; e++)
+			{
+				int id = (int)events[e].data.u32;
+				if (id == SERVER_EVENT)
 				{
-					if (!fcfs_scheduler(buffer))
+					if ((events[e].events & EPOLLOUT) && !send_outputs())
+					{
+						socket_error = true;
+						failed = true;
+						logmessage(NULL, "Socket unexpectedly disconnected. Process ID #%i.", getpid());
+						break;
+					}
+
+					//Read in as many messages as have arrived
+					if ((events[e].events & ~EPOLLOUT) && !read_server(&exiting))
 					{
-						logmessage(NULL, "Child unexpectedly disconnected. Process ID #%i.", getpid());
+						socket_error = true;
+						failed = true;
+						logmessage(NULL, "Socket unexpectedly disconnected. Process ID #%i.", getpid());
 						break;
 					}
 				}
-			}
-			else if (val < 0)
-			{
-				socket_error = true;
-				logmessage(NULL, "Select failed. Process ID #%i will exit after children terminate.", getpid());
-				break;
+				else if (id == WORKERS_EVENT)
+					check_workers();
+				else if (id == STATS_EVENT)
+					stats_serve(stats_fd, client_stats);
+				else if (!check_child(id))
+				{
+					failed = true;
+					logmessage(NULL, "Child unexpectedly disconnected. Process ID #%i.", getpid());
+				}
 			}
 
-			//Check, read and forward any messages from children
-			if (!check_children())
-			{
-				logmessage(NULL, "Child unexpectedly disconnected. Process ID #%i.", getpid());
-				break;
-			}
+			if (!options.threaded)
+				dispatch();
 		}
 	}
 	//Fourth case: -2, failed to create a child. Simply continue execution here
@@ -407,6 +1596,34 @@ int main(int argc, char **argv)
 	//Tell children to terminate
 	close_children();
 
+	//Outputs of the last tasks have to reach the server before it is told 
+	//we are done
+	while (!socket_error && (output_fd != -1 || outbox_count > 0))
+	{
+		struct pollfd out = {sockfd, POLLOUT, 0};
+		poll(&out, 1, -1);
+		socket_error = !send_outputs();
+	}
+
+	//Outputs that never made it back are not needed
+	char path[MAX_LOCATION_LENGTH];
+	if (output_fd != -1)
+	{
+		close(output_fd);
+		output_spool(output.id, path);
+		unlink(path);
+	}
+	for (int i = 0; i < outbox_count; i++)
+	{
+		outgoing* m = outbox + (outbox_head + i) % outbox_capacity;
+		if (m->type == M_RESULT)
+		{
+			output_spool(m->id, path);
+			unlink(path);
+		}
+	}
+
+	stop_heartbeats();
 	if (!socket_error) //Send successful exit message
 		sendmessage(sockfd, M_EXIT, "");
 
@@ -414,7 +1631,16 @@ int main(int argc, char **argv)
 		getpid());
 
 	close(sockfd);
+	close(epollfd);
+	close(receiving.pipe[0]);
+	close(receiving.pipe[1]);
+	if (stats_fd != -1)
+		close(stats_fd);
 	free(children);
+	free(child_buffers);
+	free(splits);
+	free(queue);
+	free(outbox);
 
 	return socket_error ? EXIT_FAILURE : EXIT_SUCCESS;
 } 
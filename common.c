@@ -10,8 +10,13 @@
  */
 
 #include <arpa/inet.h>
+#include <errno.h>
+#include <poll.h>
+#include <sched.h>
 #include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
+#include <sys/uio.h>
 #include <time.h>
 #include <unistd.h>
 #include "common.h"
@@ -19,6 +24,36 @@
 //Stores the datetime when gettime is called
 char current_time[30];
 
+//Most log records waiting to be written, a power of two
+#define LOG_CAPACITY 128
+//Longest message logged, longer ones are cut short
+#define LOG_TEXT_LENGTH (MAX_CONFIG_FILE_LINE + 255)
+//Room for a formatted time
+#define LOG_STAMP_LENGTH 64
+//Bytes gathered before each write of the log
+#define LOG_BATCH (1 << 16)
+
+//A message waiting to be written. sequence says whose turn the record is: 
+//equal to its position when free to be claimed, one more once it holds a
+//message to write.
+typedef struct {
+	unsigned int sequence;
+	time_t when;
+	FILE* file;
+	int length;
+	char text[LOG_TEXT_LENGTH];
+} log_record;
+
+//Messages logged by every thread of the process, claimed at the head and
+//written out from the tail
+static log_record log_ring[LOG_CAPACITY];
+static unsigned int log_head = 0;
+static unsigned int log_tail = 0;
+//Set while a thread is writing records out
+static bool log_draining = false;
+//True to write every message as soon as it is logged
+static bool log_sync = false;
+
 /*
  * gettime
  *
@@ -35,81 +70,355 @@ char* gettime()
 }
 
 /*
- * sendmessage
+ * getseconds
  *
- * Formats the string, like sprintf, and then sends it to the specified file 
- * descriptor along with the status code.
+ * Retrieves the current time in seconds, for measuring how long things take
  * 
- * sockfd:   File descriptor to send to
- * status:   Status code of message
- * fmt, ...: See sprintf
+ * returns: Seconds since the epoch, to the microsecond
 */
-void sendmessage(int fd, char status, char* line, ...)
+double getseconds()
 {
-	//Format of a message:
-	//1 byte - message type (success, error, etc.)
-	//n bytes - null terminated string
-	char buffer[MAX_MESSAGE_LENGTH];
-	buffer[0] = status;
+	struct timeval tv;
+	gettimeofday(&tv, NULL);
+	return tv.tv_sec + tv.tv_usec / 1000000.0;
+}
 
-	va_list vl;
-	va_start(vl, line);
-	int length = vsnprintf(buffer + 1, MAX_MESSAGE_LENGTH - 1, line, vl);
-	va_end(vl);
-	if (length < 0)
-		return;
-	
-	write(fd, buffer, length + 2);
+/*
+ * sendframe
+ *
+ * Sends a frame to the specified file descriptor in one write where 
+ * possible, waiting if the descriptor is non-blocking and full.
+ * 
+ * fd:      File descriptor to send to
+ * type:    Status code of message
+ * id:      Task the message is about, 0 if none
+ * payload: Null-terminated string to send
+ * length:  Length of payload, not counting the null
+ *
+ * returns: False if an error occurs
+*/
+bool sendframe(int fd, char type, unsigned int id, const char* payload, int length)
+{
+	if (length >= MAX_MESSAGE_LENGTH)
+		return false;
+
+	frame_header header;
+	header.version = FRAME_VERSION;
+	header.type = type;
+	header.reserved = 0;
+	header.id = htonl(id);
+	header.length = htonl(length + 1);
+
+	struct iovec iov[2];
+	iov[0].iov_base = &header;
+	iov[0].iov_len = FRAME_HEADER_SIZE;
+	iov[1].iov_base = (void*)payload;
+	iov[1].iov_len = length + 1;
+
+	int count = 2;
+	struct iovec* next = iov;
+	while (count > 0)
+	{
+		ssize_t written = writev(fd, next, count);
+		if (written < 0)
+		{
+			if (errno == EAGAIN || errno == EWOULDBLOCK)
+			{
+				struct pollfd out = {fd, POLLOUT, 0};
+				poll(&out, 1, -1);
+				continue;
+			}
+			if (errno == EINTR)
+				continue;
+			return false;
+		}
+
+		//Skip past whatever was written
+		while (count > 0 && (size_t)written >= next->iov_len)
+		{
+			written -= next->iov_len;
+			next++;
+			count--;
+		}
+		if (count > 0)
+		{
+			next->iov_base = (char*)next->iov_base + written;
+			next->iov_len -= written;
+		}
+	}
+	return true;
 }
 
 /*
- * readnullstring
+ * sendmessage
  *
- * Reads a null-terminated string from a file descriptor and stores in buffer, 
- * limiting itself to read max bytes.
+ * Sends the string to the specified file descriptor along with the status 
+ * code, not about any particular task.
  * 
  * fd:     File descriptor to send to
- * buffer: Location to store string
- * max:    Maximum number of bytes to read
+ * status: Status code of message
+ * text:   Null-terminated string to send
+*/
+void sendmessage(int fd, char status, const char* text)
+{
+	sendframe(fd, status, 0, text, strlen(text));
+}
+
+/*
+ * readframes
+ *
+ * Reads as much as fits into a frame_buffer with a single read, moving any
+ * unparsed bytes to the front first.
+ * 
+ * fd:  File descriptor to read from
+ * in:  Buffer to read into
  *
  * returns:
- * 		   Length if no error occurs
- *         -1 - the socket has closed
+ *         Number of bytes read if no error occurs
+ *          0 - the descriptor has closed
+ *         -1 - read failed, see errno
 */
-int readnullstring(int fd, char* buffer, int max)
+int readframes(int fd, frame_buffer* in)
 {
-	int i = 0;
-	while (i < max)
+	if (in->start > 0)
 	{
-		if (read(fd, buffer + i, 1) <= 0)
-			return -1;
-		i++;
-		if (buffer[i - 1] == '\0')
-			break;
+		memmove(in->data, in->data + in->start, in->length);
+		in->start = 0;
 	}
-	return i;
+
+	int nbytes;
+	do
+		nbytes = read(fd, in->data + in->length, FRAME_BUFFER_SIZE - in->length);
+	while (nbytes < 0 && errno == EINTR);
+
+	if (nbytes > 0)
+		in->length += nbytes;
+	return nbytes;
+}
+
+/*
+ * nextframe
+ *
+ * Takes the next whole frame from a frame_buffer.
+ * 
+ * in: Buffer to take from
+ * f:  Location to store frame
+ *
+ * returns:
+ *          1 - a frame was taken
+ *          0 - the next frame has not been fully received
+ *         -1 - the next frame is malformed
+*/
+int nextframe(frame_buffer* in, frame* f)
+{
+	if (in->length < FRAME_HEADER_SIZE)
+		return 0;
+
+	frame_header header;
+	memcpy(&header, in->data + in->start, FRAME_HEADER_SIZE);
+	unsigned int length = ntohl(header.length);
+	if (header.version != FRAME_VERSION || length == 0 || length > MAX_MESSAGE_LENGTH)
+		return -1;
+	if (in->length < FRAME_HEADER_SIZE + (int)length)
+		return 0;
+
+	f->type = header.type;
+	f->id = ntohl(header.id);
+	f->payload = in->data + in->start + FRAME_HEADER_SIZE;
+	f->length = length - 1;
+	if (f->payload[f->length] != '\0')
+		return -1;
+
+	in->start += FRAME_HEADER_SIZE + length;
+	in->length -= FRAME_HEADER_SIZE + length;
+	return 1;
+}
+
+/*
+ * writeall
+ *
+ * Writes the whole buffer to a file descriptor, retrying after short writes.
+ * 
+ * fd:     File descriptor to write to
+ * buffer: Data to write
+ * length: Number of bytes to write
+ *
+ * returns: False if an error occurs
+*/
+bool writeall(int fd, const char* buffer, size_t length)
+{
+	while (length > 0)
+	{
+		ssize_t written = write(fd, buffer, length);
+		if (written < 0)
+		{
+			if (errno == EINTR)
+				continue;
+			return false;
+		}
+		buffer += written;
+		length -= written;
+	}
+	return true;
+}
+
+/*
+ * log_setup
+ *
+ * Prepares the ring of log records before main runs, and makes sure it is 
+ * drained when the process exits.
+*/
+__attribute__((constructor))
+static void log_setup()
+{
+	for (unsigned int i = 0; i < LOG_CAPACITY; i++)
+		log_ring[i].sequence = i;
+
+	char* mode = getenv("LYREBIRD_LOG_FLUSH");
+	log_sync = mode != NULL && strcmp(mode, "sync") == 0;
+	atexit(log_flush);
+}
+
+/*
+ * log_append
+ *
+ * Adds a record to a batch being written, writing the batch out first if 
+ * there is no room.
+ *
+ * fd:     Where the batch goes, if file is NULL
+ * file:   Log file the batch goes to, or NULL
+ * batch:  Batch of LOG_BATCH bytes
+ * length: Bytes in the batch so far
+ * stamp:  Formatted time of the record
+ * record: Record to add
+*/
+static void log_append(int fd, FILE* file, char* batch, int* length, const char* stamp, 
+	log_record* record)
+{
+	if (*length + LOG_STAMP_LENGTH + record->length + 4 > LOG_BATCH)
+	{
+		if (file != NULL)
+			fwrite(batch, 1, *length, file);
+		else
+			writeall(fd, batch, *length);
+		*length = 0;
+	}
+	*length += sprintf(batch + *length, "[%s] %.*s\n", stamp, record->length, record->text);
+}
+
+/*
+ * log_flush
+ *
+ * Writes every finished log record to STDOUT and its log file, in as few 
+ * writes as possible. Only one thread drains at a time, any other returns 
+ * straight away.
+*/
+void log_flush()
+{
+	if (__atomic_exchange_n(&log_draining, true, __ATOMIC_ACQUIRE))
+		return;
+
+	static char out[LOG_BATCH];
+	static char to_file[LOG_BATCH];
+	int out_length = 0;
+	int file_length = 0;
+	FILE* file = NULL;
+	//Formatting the time is the slow part, and most records share a second
+	static time_t stamped = -1;
+	static char stamp[LOG_STAMP_LENGTH];
+
+	while (true)
+	{
+		log_record* record = log_ring + (log_tail & (LOG_CAPACITY - 1));
+		if (__atomic_load_n(&record->sequence, __ATOMIC_ACQUIRE) != log_tail + 1)
+			break; //Empty, or the next record is still being written
+
+		if (record->when != stamped)
+		{
+			struct tm local;
+			strftime(stamp, sizeof(stamp), "%c", localtime_r(&record->when, &local));
+			stamped = record->when;
+		}
+
+		log_append(STDOUT_FILENO, NULL, out, &out_length, stamp, record);
+		if (record->file != NULL)
+		{
+			//Records for another file start a batch of their own
+			if (record->file != file && file_length > 0)
+			{
+				fwrite(to_file, 1, file_length, file);
+				fflush(file);
+				file_length = 0;
+			}
+			file = record->file;
+			log_append(-1, file, to_file, &file_length, stamp, record);
+		}
+
+		__atomic_store_n(&record->sequence, log_tail + LOG_CAPACITY, __ATOMIC_RELEASE);
+		log_tail++;
+	}
+
+	if (out_length > 0)
+		writeall(STDOUT_FILENO, out, out_length);
+	if (file != NULL)
+	{
+		fwrite(to_file, 1, file_length, file);
+		fflush(file); // Ensure whatever it is gets properly written.
+	}
+
+	__atomic_store_n(&log_draining, false, __ATOMIC_RELEASE);
 }
 
 /*
  * logmessage
  *
- * Logs a message to both STDOUT and the given file
+ * Logs a message to both STDOUT and the given file. The message is 
+ * formatted into a record in the log ring straight away, but only written 
+ * out by log_flush, unless LYREBIRD_LOG_FLUSH is set to sync.
  * 
  * file:      File to write to
  * line, ...: See sprintf
 */
 void logmessage(FILE * file, char* line, ...)
 {
-	char buf[MAX_CONFIG_FILE_LINE + 255];
+	//Claim the next free record. Any number of threads can log at once.
+	log_record* record;
+	unsigned int position = __atomic_load_n(&log_head, __ATOMIC_RELAXED);
+	while (true)
+	{
+		record = log_ring + (position & (LOG_CAPACITY - 1));
+		int difference = (int)(__atomic_load_n(&record->sequence, __ATOMIC_ACQUIRE) - position);
+		if (difference == 0)
+		{
+			if (__atomic_compare_exchange_n(&log_head, &position, position + 1, true, 
+				__ATOMIC_RELAXED, __ATOMIC_RELAXED))
+				break;
+		}
+		else if (difference < 0)
+		{
+			//Full, make room. Another thread may already be doing so.
+			log_flush();
+			sched_yield();
+			position = __atomic_load_n(&log_head, __ATOMIC_RELAXED);
+		}
+		else
+			position = __atomic_load_n(&log_head, __ATOMIC_RELAXED);
+	}
+
+	struct timespec now;
+	clock_gettime(CLOCK_REALTIME_COARSE, &now);
+	record->when = now.tv_sec;
+	record->file = file;
 	va_list vl;
 	va_start(vl, line);
-	vsnprintf(buf, sizeof(buf), line, vl);
+	record->length = vsnprintf(record->text, LOG_TEXT_LENGTH, line, vl);
 	va_end(vl);
-	printf("[%s] %s\n", gettime(), buf);
+	if (record->length >= LOG_TEXT_LENGTH)
+		record->length = LOG_TEXT_LENGTH - 1;
+	if (record->length < 0)
+		record->length = 0;
+	__atomic_store_n(&record->sequence, position + 1, __ATOMIC_RELEASE);
 
-	if (file != NULL)
-	{
-		fprintf(file, "[%s] %s\n", gettime(), buf);
-		fflush(file); // Ensure whatever it is gets properly written.
-	}
-}
\ No newline at end of file
+	if (log_sync)
+		log_flush();
+}
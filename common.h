@@ -15,6 +15,7 @@
 #include <stdarg.h>
 #include <stdbool.h>
 #include <stdio.h>
+#include <sys/time.h>
 
 //Parent-child pipe struct
 typedef struct {
@@ -23,6 +24,8 @@ typedef struct {
 	int pid;
 	bool ready;
 	bool terminated;
+	int task; //Split task the child is decrypting part of, -1 if none
+	double started; //When the child was given its current task
 } pc_pipe;
 
 //Max length of an encrypted tweet
@@ -40,45 +43,144 @@ typedef struct {
 #define M_ERROR   0x05 //Unsuccessful/error
 #define M_READY   0x03 //Indicates a child is ready to receive file
 #define M_LINE    0x01 //File to decrypt
+#define M_CREDIT  0x07 //Number of files the client can hold, payload is the count then the number of children
+#define M_TIMING  0x09 //Seconds spent decrypting the task with this id, payload is the time
+#define M_CANCEL  0x0B //Drop the task with this id if not started, or that it was dropped
+#define M_HEARTBEAT 0x0D //Client is still alive
+#define M_DATA    0x0E //File to decrypt, payload is the length then the line, followed by the file
+#define M_RETURN  0x11 //Send outputs back to the server instead of writing them
+#define M_RESULT  0x12 //Output of the task with this id, payload is the length, followed by the output
+#define M_SKIPPED 0x13 //Output was already up to date with its input, counts as a success
+
+//Seconds between heartbeats from each client
+#define HEARTBEAT_INTERVAL 2
+
+//Version of the frame format, frames of any other version are rejected
+#define FRAME_VERSION 1
+//Size of frame_header as sent, with no padding
+#define FRAME_HEADER_SIZE 12
+//Bytes a frame_buffer holds, room for a full frame and many small ones
+#define FRAME_BUFFER_SIZE 8192
+
+//Every message is a header followed by length bytes of payload. The payload
+//is a null-terminated string, and length counts the null. Multi-byte fields
+//are in network byte order.
+typedef struct {
+	unsigned char version;
+	unsigned char type;      //Status code of message
+	unsigned short reserved;
+	unsigned int id;         //Task the message is about, echoed in its result
+	unsigned int length;     //Bytes of payload, at most MAX_MESSAGE_LENGTH
+} frame_header;
+
+//A message taken from a frame_buffer
+typedef struct {
+	char type;
+	unsigned int id;
+	char* payload; //Points into the buffer, valid until it is next read into
+	int length;    //Length of payload, not counting the null
+} frame;
+
+//Bytes received from a connection that do not yet make up whole frames
+typedef struct {
+	char data[FRAME_BUFFER_SIZE];
+	int start;  //Where the first unparsed frame begins
+	int length; //Bytes from start that have been received
+} frame_buffer;
 
 /*
- * sendmessage
+ * sendframe
  *
- * Formats the string, like sprintf, and then sends it to the specified file 
- * descriptor along with the status code.
+ * Sends a frame to the specified file descriptor in one write where 
+ * possible, waiting if the descriptor is non-blocking and full.
  * 
- * sockfd:   File descriptor to send to
- * status:   Status code of message
- * fmt, ...: See sprintf
+ * fd:      File descriptor to send to
+ * type:    Status code of message
+ * id:      Task the message is about, 0 if none
+ * payload: Null-terminated string to send
+ * length:  Length of payload, not counting the null
+ *
+ * returns: False if an error occurs
 */
-void sendmessage(int sockfd, char status, char* fmt, ...);
+bool sendframe(int fd, char type, unsigned int id, const char* payload, int length);
 
 /*
- * readnullstring
+ * sendmessage
  *
- * Reads a null-terminated string from a file descriptor and stores in buffer, 
- * limiting itself to read max bytes.
+ * Sends the string to the specified file descriptor along with the status 
+ * code, not about any particular task.
  * 
  * fd:     File descriptor to send to
- * buffer: Location to store string
- * max:    Maximum number of bytes to read
+ * status: Status code of message
+ * text:   Null-terminated string to send
+*/
+void sendmessage(int fd, char status, const char* text);
+
+/*
+ * readframes
+ *
+ * Reads as much as fits into a frame_buffer with a single read, moving any
+ * unparsed bytes to the front first.
+ * 
+ * fd:  File descriptor to read from
+ * in:  Buffer to read into
+ *
+ * returns:
+ *         Number of bytes read if no error occurs
+ *          0 - the descriptor has closed
+ *         -1 - read failed, see errno
+*/
+int readframes(int fd, frame_buffer* in);
+
+/*
+ * nextframe
+ *
+ * Takes the next whole frame from a frame_buffer.
+ * 
+ * in: Buffer to take from
+ * f:  Location to store frame
  *
  * returns:
- * 		   Length if no error occurs
- *         -1 - the socket has closed
+ *          1 - a frame was taken
+ *          0 - the next frame has not been fully received
+ *         -1 - the next frame is malformed
+*/
+int nextframe(frame_buffer* in, frame* f);
+
+/*
+ * writeall
+ *
+ * Writes the whole buffer to a file descriptor, retrying after short writes.
+ * 
+ * fd:     File descriptor to write to
+ * buffer: Data to write
+ * length: Number of bytes to write
+ *
+ * returns: False if an error occurs
 */
-int readnullstring(int fd, char* buffer, int max);
+bool writeall(int fd, const char* buffer, size_t length);
 
 /*
- * log
+ * logmessage
  *
- * Logs a message to both STDOUT and the given file
+ * Logs a message to both STDOUT and the given file. The message is 
+ * formatted into a record in the log ring straight away, but only written 
+ * out by log_flush, unless LYREBIRD_LOG_FLUSH is set to sync.
  * 
  * file:      File to write to
  * line, ...: See sprintf
 */
 void logmessage(FILE * file, char* line, ...);
 
+/*
+ * log_flush
+ *
+ * Writes every finished log record to STDOUT and its log file, in as few 
+ * writes as possible. Only one thread drains at a time, any other returns 
+ * straight away.
+*/
+void log_flush();
+
 /*
  * gettime
  *
@@ -88,4 +190,13 @@ void logmessage(FILE * file, char* line, ...);
 */
 char* gettime();
 
+/*
+ * getseconds
+ *
+ * Retrieves the current time in seconds, for measuring how long things take
+ * 
+ * returns: Seconds since the epoch, to the microsecond
+*/
+double getseconds();
+
 #endif
\ No newline at end of file
@@ -9,63 +9,91 @@
  * TA Scott Kristjanson
  */
 
-#include <math.h>
+#include <pthread.h>
 #include <stdbool.h>
 #include <stdlib.h>
+#include <string.h>
 #include "decrypt.h"
 #include "memwatch.h"
 
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define DECRYPT_X86
+#endif
+
 //this table will map ascii values to the corresponding 'numeric' values
-//as defined in the assignment's table
-char conversion_table[255];
+//as defined in the assignment's table. -1 marks characters outside of it.
+static const signed char conversion_table[256] = {
+	[0 ... 255] = -1,
+	[' '] = 0,
+	['a'] = 1, ['b'] = 2, ['c'] = 3, ['d'] = 4, ['e'] = 5, ['f'] = 6, ['g'] = 7,
+	['h'] = 8, ['i'] = 9, ['j'] = 10, ['k'] = 11, ['l'] = 12, ['m'] = 13, 
+	['n'] = 14, ['o'] = 15, ['p'] = 16, ['q'] = 17, ['r'] = 18, ['s'] = 19, 
+	['t'] = 20, ['u'] = 21, ['v'] = 22, ['w'] = 23, ['x'] = 24, ['y'] = 25, 
+	['z'] = 26,
+	['#'] = 27, ['.'] = 28, [','] = 29, ['\''] = 30, ['!'] = 31, ['?'] = 32, 
+	['('] = 33, [')'] = 34, ['-'] = 35, [':'] = 36, ['$'] = 37, ['/'] = 38,
+	['&'] = 39, ['\\'] = 40
+};
 
 //Performs the inverse of the above, taking one of the 41 given characters 
 //and converting it into corresponding ascii
-char inversion_table[255];
+static const char inversion_table[41] = " abcdefghijklmnopqrstuvwxyz#.,'!?()-:$/&\\";
 
-//Don't reinitialize tables every time
-bool tables_initialized = false;
+//Place value of each character within a 6 character block
+static const unsigned int powers_of_41[6] = {
+	115856201, 2825761, 68921, 1681, 41, 1
+};
 
-/*
- * initialize_table
- *
- * Initializes our lookup and inverse lookup tables
-*/
-void initialize_table()
-{
-	int i;
-	for (i = 0; i < 255; i++)
-		conversion_table[i] = -1; //default 'error' value.
+//Number of blocks gathered from a set of tweets before they are exponentiated
+#define BATCH_BLOCKS 1024
+//Widest kernel processes this many blocks per iteration
+#define BATCH_LANES 16
 
-	//ASCII characters to our base 41 encoding
-	conversion_table[' '] = 0;
-	for (i = 'a'; i <= 'z'; i++)
-		conversion_table[i] = i - 'a' + 1; //goes 1 thru 26
-	conversion_table['#'] = 27;
-	conversion_table['.'] = 28;
-	conversion_table[','] = 29;
-	conversion_table['\''] = 30;
-	conversion_table['!'] = 31;
-	conversion_table['?'] = 32;
-	conversion_table['('] = 33;
-	conversion_table[')'] = 34;
-	conversion_table['-'] = 35;
-	conversion_table[':'] = 36;
-	conversion_table['$'] = 37;
-	conversion_table['/'] = 38;
-	conversion_table['&'] = 39;
-	conversion_table['\\'] = 40;
+//Blocks gathered out of many tweets, in structure-of-arrays layout so the
+//exponentiation kernels can load lanes directly
+typedef struct {
+	unsigned int values[BATCH_BLOCKS];
+	unsigned int results[BATCH_BLOCKS];
+	char* destination[BATCH_BLOCKS]; //Where the decrypted block is written
+	char width[BATCH_BLOCKS];        //Characters in the block, 1 to 6
+	int count;
+	//Blocks that missed the cache, compacted for the kernel
+	unsigned int miss_values[BATCH_BLOCKS];
+	unsigned int miss_results[BATCH_BLOCKS];
+	int miss_index[BATCH_BLOCKS];
+} block_batch;
 
-	//Set up the inverse table
-	for (i = 0; i < 255; i++)
-		if (conversion_table[i] != -1)
-			inversion_table[conversion_table[i]] = i;
-}
+//Marks an unused cache entry. Decrypted blocks are below DECRYPT_KEY_N so
+//can never take this value.
+#define CACHE_EMPTY 0xFFFFFFFFU
+//Entries probed before a block is considered missing
+#define CACHE_PROBES 4
+
+//One packed block and its decryption. Eight bytes, so a whole probe 
+//sequence usually sits in one cache line.
+typedef struct {
+	unsigned int key;
+	unsigned int value;
+} cache_entry;
+
+//Open-addressed table of recently decrypted blocks
+typedef struct {
+	cache_entry* entries; //NULL when the cache is disabled
+	unsigned int mask;
+	int shift;
+	unsigned long long hits;
+	unsigned long long misses;
+} block_cache;
+
+//Each thread has its own cache so that decrypting stays reentrant
+static __thread block_cache cache;
 
 /*
  * modular_exponentiation
  *
- * Quickly calculates num^n % mod
+ * Quickly calculates num^n % mod. Kept as the reference for any key; the 
+ * built-in key goes through fixed_exponentiation instead.
  * Source: http://homepages.math.uic.edu/~leon/cs-mcs401-s08/handouts/fastexp.pdf
  * 
  * returns: num^n % mod
@@ -92,87 +120,992 @@ unsigned long long modular_exponentiation(unsigned int num, unsigned int n, unsi
 	return y;
 }
 
+//Montgomery constants for DECRYPT_KEY_N with R = 2^32
+//n^-1 % R
+#define MONT_NINV 0x04082001U
+//R^2 % n, used to move a value into Montgomery form
+#define MONT_R2   0x0607FFBFULL
+
+//Montgomery constants for an odd modulus below 2^32, with R = 2^32
+typedef struct {
+	unsigned int n;
+	unsigned int ninv;     //n^-1 % R
+	unsigned long long r2; //R^2 % n
+} montgomery_modulus;
+
+//Parameters for decrypting with the Chinese Remainder Theorem, set up once 
+//by decrypt_set_factors
+typedef struct {
+	bool enabled;
+	montgomery_modulus p;
+	montgomery_modulus q;
+	unsigned int dp;   //d % (p - 1)
+	unsigned int dq;   //d % (q - 1)
+	unsigned int qinv; //q^-1 % p
+	int bits;          //Bits in the larger of dp and dq
+} crt_key;
+
+static crt_key crt;
+
+//Sliding window (width 4) decomposition of DECRYPT_KEY_D, most significant
+//window first. Each step squares the accumulator 'squarings' times then
+//multiplies by num^power. DECRYPT_KEY_D = 0b111 00101 00011 00101 011 000101 0011
+typedef struct {
+	int squarings;
+	int power;
+} window_step;
+
+static const window_step key_d_windows[] = {
+	{0, 7}, {5, 5}, {5, 3}, {5, 5}, {3, 3}, {6, 5}, {4, 3}
+};
+
 /*
- * decrypt
+ * montgomery_reduce
  *
- * Decrypts the given encrypted string, then stores it at same location
+ * Computes t * R^-1 % n for t < n * R without dividing. Uses the subtractive 
+ * form of REDC so nothing overflows 64 bits even though n is close to 2^32.
+ *
+ * returns: t * R^-1 % n, fully reduced
+*/
+static inline unsigned long long montgomery_reduce(unsigned long long t)
+{
+	unsigned int m = (unsigned int)t * MONT_NINV;
+	unsigned long long mn = (unsigned long long)m * DECRYPT_KEY_N;
+	//Low halves of t and m*n are identical, so only the high halves matter
+	unsigned long long hi = t >> 32;
+	unsigned long long mnhi = mn >> 32;
+
+	return hi >= mnhi ? hi - mnhi : hi - mnhi + DECRYPT_KEY_N;
+}
+
+/*
+ * fixed_exponentiation
+ *
+ * Calculates num^DECRYPT_KEY_D % DECRYPT_KEY_N using Montgomery multiplication
+ * and a precomputed sliding window over the exponent. Never divides.
  * 
- * encrypted_string: Location of encrypted string. Used for storing decrypted 
- *                   string.
+ * returns: num^DECRYPT_KEY_D % DECRYPT_KEY_N
+*/
+unsigned long long fixed_exponentiation(unsigned int num)
+{
+	//Odd powers num^1, num^3, num^5, num^7 in Montgomery form
+	unsigned long long powers[8];
+	powers[1] = montgomery_reduce(num * MONT_R2);
+	unsigned long long square = montgomery_reduce(powers[1] * powers[1]);
+	powers[3] = montgomery_reduce(powers[1] * square);
+	powers[5] = montgomery_reduce(powers[3] * square);
+	powers[7] = montgomery_reduce(powers[5] * square);
+
+	unsigned long long x = powers[key_d_windows[0].power];
+	for (int i = 1; i < sizeof(key_d_windows) / sizeof(window_step); i++)
+	{
+		for (int k = 0; k < key_d_windows[i].squarings; k++)
+			x = montgomery_reduce(x * x);
+		x = montgomery_reduce(x * powers[key_d_windows[i].power]);
+	}
+
+	//Leave Montgomery form
+	return montgomery_reduce(x);
+}
+
+/*
+ * montgomery_reduce_modulus
+ *
+ * montgomery_reduce for a modulus only known at runtime.
+ *
+ * m: Modulus and its constants
+ * t: Value to reduce, below m->n * R
+ *
+ * returns: t * R^-1 % m->n, fully reduced
+*/
+static inline unsigned long long montgomery_reduce_modulus(const montgomery_modulus* m, unsigned long long t)
+{
+	unsigned int k = (unsigned int)t * m->ninv;
+	unsigned long long hi = t >> 32;
+	unsigned long long khi = ((unsigned long long)k * m->n) >> 32;
+
+	return hi >= khi ? hi - khi : hi - khi + m->n;
+}
+
+/*
+ * montgomery_setup
+ *
+ * Works out the Montgomery constants for an odd modulus. Divides, so only
+ * used when the key is set.
+ *
+ * m: Location to store the constants
+ * n: Odd modulus
+*/
+static void montgomery_setup(montgomery_modulus* m, unsigned int n)
+{
+	//Newton's iteration, each step doubles the number of correct bits
+	unsigned int ninv = n;
+	for (int i = 0; i < 4; i++)
+		ninv *= 2 - n * ninv;
+
+	unsigned long long r = (1ULL << 32) % n;
+	m->n = n;
+	m->ninv = ninv;
+	m->r2 = r * r % n;
+}
+
+/*
+ * crt_exponentiation
+ *
+ * Calculates num^DECRYPT_KEY_D % DECRYPT_KEY_N from two exponentiations 
+ * modulo the factors of the key, run side by side so that they overlap.
+ * Only valid once decrypt_set_factors has succeeded.
  * 
- * returns:
- * 		   Length if no errors occur
- * 		   -1 if an error occurs
- *         -2 if malloc fails
+ * returns: num^DECRYPT_KEY_D % DECRYPT_KEY_N
 */
-int decrypt(char* encrypted_string)
+static unsigned long long crt_exponentiation(unsigned int num)
 {
-	//Initialize our conversion arrays
-	if (!tables_initialized)
+	const montgomery_modulus* p = &crt.p;
+	const montgomery_modulus* q = &crt.q;
+
+	//num % p and num % q in Montgomery form
+	unsigned long long xp = montgomery_reduce_modulus(p, num * p->r2);
+	unsigned long long xq = montgomery_reduce_modulus(q, num * q->r2);
+	//1 in Montgomery form
+	unsigned long long yp = montgomery_reduce_modulus(p, p->r2);
+	unsigned long long yq = montgomery_reduce_modulus(q, q->r2);
+
+	for (int bit = crt.bits - 1; bit >= 0; bit--)
 	{
-		initialize_table();
-		tables_initialized = true;
+		yp = montgomery_reduce_modulus(p, yp * yp);
+		yq = montgomery_reduce_modulus(q, yq * yq);
+		if ((crt.dp >> bit) & 1)
+			yp = montgomery_reduce_modulus(p, yp * xp);
+		if ((crt.dq >> bit) & 1)
+			yq = montgomery_reduce_modulus(q, yq * xq);
 	}
 
-	int length = strlen(encrypted_string);
-	//length when we factor out the excess 8th characters
-	int true_length = strlen(encrypted_string) - (strlen(encrypted_string) / 8);
+	//Garner's recombination: m = mq + q * (qinv * (mp - mq) % p)
+	unsigned long long mq = montgomery_reduce_modulus(q, yq);
+	unsigned long long mq_p = montgomery_reduce_modulus(p, mq * p->r2);
+	unsigned long long diff = yp >= mq_p ? yp - mq_p : yp + p->n - mq_p;
+	unsigned long long h = montgomery_reduce_modulus(p, diff * crt.qinv);
+
+	return mq + h * q->n;
+}
+
+/*
+ * decrypt_set_factors
+ *
+ * Switches decryption to the Chinese Remainder Theorem using the factors 
+ * of DECRYPT_KEY_N. Not thread-safe, call before any decryption starts.
+ *
+ * p, q: Prime factors of DECRYPT_KEY_N, in either order
+ *
+ * returns: False if p and q are not the factors of the key. Decryption then 
+ *          stays on the direct path.
+*/
+bool decrypt_set_factors(unsigned int p, unsigned int q)
+{
+	crt.enabled = false;
+	if (p < 3 || q < 3 || p % 2 == 0 || q % 2 == 0 || p == q ||
+		(unsigned long long)p * q != DECRYPT_KEY_N)
+		return false;
+
+	montgomery_setup(&crt.p, p);
+	montgomery_setup(&crt.q, q);
+
+	//Reduced exponents. A zero exponent would turn multiples of a factor
+	//into 1 rather than 0, p - 1 is equivalent and avoids that.
+	crt.dp = DECRYPT_KEY_D % (p - 1);
+	if (crt.dp == 0)
+		crt.dp = p - 1;
+	crt.dq = DECRYPT_KEY_D % (q - 1);
+	if (crt.dq == 0)
+		crt.dq = q - 1;
 
-	//we use an array to temporarily store the decrypted string
-	//in the event that we are unable to successfuly decrypt it
-	//so that we don't destroy the original data
-	char* intermediary = (char*)malloc(length);
-	if (intermediary == NULL)
+	crt.bits = 0;
+	while ((crt.dp | crt.dq) >> crt.bits)
+		crt.bits++;
+
+	//q^-1 % p through Fermat's little theorem, so p must be prime
+	unsigned long long qinv = 1;
+	unsigned long long base = q % p;
+	for (unsigned int e = p - 2; e > 0; e >>= 1)
 	{
-		return -2;
+		if (e & 1)
+			qinv = qinv * base % p;
+		base = base * base % p;
 	}
+	crt.qinv = qinv;
+
+	//Catches factors that are not prime
+	for (unsigned int num = 2; num < 64; num++)
+		if (crt_exponentiation(num * 0x9E3779B1U) != fixed_exponentiation(num * 0x9E3779B1U))
+			return false;
+
+	crt.enabled = true;
+	return true;
+}
+
+#ifdef DECRYPT_X86
+/*
+ * montgomery_multiply_avx2
+ *
+ * Four lane version of montgomery_reduce(a * b). Every lane holds a value
+ * below 2^32, so _mm256_mul_epu32 gives exact products.
+ *
+ * returns: a * b * R^-1 % n in each lane
+*/
+__attribute__((target("avx2")))
+static inline __m256i montgomery_multiply_avx2(__m256i a, __m256i b)
+{
+	const __m256i ninv = _mm256_set1_epi64x(MONT_NINV);
+	const __m256i n = _mm256_set1_epi64x(DECRYPT_KEY_N);
+
+	__m256i t = _mm256_mul_epu32(a, b);
+	__m256i mn = _mm256_mul_epu32(_mm256_mul_epu32(t, ninv), n);
+	__m256i hi = _mm256_srli_epi64(t, 32);
+	__m256i mnhi = _mm256_srli_epi64(mn, 32);
+	__m256i u = _mm256_sub_epi64(hi, mnhi);
 
-	for (int i = 0, j = 0; i < true_length; i++, j++)
+	//Values are below 2^32, so the signed compare is safe
+	return _mm256_add_epi64(u, _mm256_and_si256(_mm256_cmpgt_epi64(mnhi, hi), n));
+}
+
+/*
+ * fixed_exponentiation_avx2
+ *
+ * Four lane version of fixed_exponentiation.
+ *
+ * returns: num^DECRYPT_KEY_D % DECRYPT_KEY_N in each lane
+*/
+__attribute__((target("avx2")))
+static inline __m256i fixed_exponentiation_avx2(__m256i num)
+{
+	__m256i powers[8];
+	powers[1] = montgomery_multiply_avx2(num, _mm256_set1_epi64x(MONT_R2));
+	__m256i square = montgomery_multiply_avx2(powers[1], powers[1]);
+	powers[3] = montgomery_multiply_avx2(powers[1], square);
+	powers[5] = montgomery_multiply_avx2(powers[3], square);
+	powers[7] = montgomery_multiply_avx2(powers[5], square);
+
+	__m256i x = powers[key_d_windows[0].power];
+	for (int i = 1; i < sizeof(key_d_windows) / sizeof(window_step); i++)
 	{
-		//Skip every 8th character in encrypted_string
-		if ((j + 1) % 8 == 0)
-			j++;
+		for (int k = 0; k < key_d_windows[i].squarings; k++)
+			x = montgomery_multiply_avx2(x, x);
+		x = montgomery_multiply_avx2(x, powers[key_d_windows[i].power]);
+	}
 
-		intermediary[i] = encrypted_string[j];
+	return montgomery_multiply_avx2(x, _mm256_set1_epi64x(1));
+}
+
+/*
+ * exponentiate_blocks_avx2
+ *
+ * Runs fixed_exponentiation over count blocks, eight at a time as two 
+ * independent four lane chains. count must be a multiple of 8.
+*/
+__attribute__((target("avx2")))
+static void exponentiate_blocks_avx2(const unsigned int* values, unsigned int* results, int count)
+{
+	//Gathers the low 32 bits of each 64 bit lane into the bottom half
+	const __m256i pack = _mm256_setr_epi32(0, 2, 4, 6, 0, 2, 4, 6);
+
+	for (int i = 0; i < count; i += 8)
+	{
+		__m256i a = _mm256_cvtepu32_epi64(_mm_loadu_si128((const __m128i*)(values + i)));
+		__m256i b = _mm256_cvtepu32_epi64(_mm_loadu_si128((const __m128i*)(values + i + 4)));
+
+		a = fixed_exponentiation_avx2(a);
+		b = fixed_exponentiation_avx2(b);
+
+		_mm_storeu_si128((__m128i*)(results + i), 
+			_mm256_castsi256_si128(_mm256_permutevar8x32_epi32(a, pack)));
+		_mm_storeu_si128((__m128i*)(results + i + 4), 
+			_mm256_castsi256_si128(_mm256_permutevar8x32_epi32(b, pack)));
 	}
-	//Make sure remainder is clear.
-	for (int i = true_length; i < length; i++)
-		intermediary[i] = 0;
+}
+
+/*
+ * montgomery_multiply_avx512
+ *
+ * Eight lane version of montgomery_reduce(a * b).
+ *
+ * returns: a * b * R^-1 % n in each lane
+*/
+__attribute__((target("avx512f")))
+static inline __m512i montgomery_multiply_avx512(__m512i a, __m512i b)
+{
+	const __m512i ninv = _mm512_set1_epi64(MONT_NINV);
+	const __m512i n = _mm512_set1_epi64(DECRYPT_KEY_N);
+
+	__m512i t = _mm512_mul_epu32(a, b);
+	__m512i mn = _mm512_mul_epu32(_mm512_mul_epu32(t, ninv), n);
+	__m512i hi = _mm512_srli_epi64(t, 32);
+	__m512i mnhi = _mm512_srli_epi64(mn, 32);
+	__m512i u = _mm512_sub_epi64(hi, mnhi);
+
+	return _mm512_mask_add_epi64(u, _mm512_cmplt_epu64_mask(hi, mnhi), u, n);
+}
+
+/*
+ * fixed_exponentiation_avx512
+ *
+ * Eight lane version of fixed_exponentiation.
+ *
+ * returns: num^DECRYPT_KEY_D % DECRYPT_KEY_N in each lane
+*/
+__attribute__((target("avx512f")))
+static inline __m512i fixed_exponentiation_avx512(__m512i num)
+{
+	__m512i powers[8];
+	powers[1] = montgomery_multiply_avx512(num, _mm512_set1_epi64(MONT_R2));
+	__m512i square = montgomery_multiply_avx512(powers[1], powers[1]);
+	powers[3] = montgomery_multiply_avx512(powers[1], square);
+	powers[5] = montgomery_multiply_avx512(powers[3], square);
+	powers[7] = montgomery_multiply_avx512(powers[5], square);
 
-	//Loop through in groups of 6
-	for (int i = 0; i < true_length; i += 6)
+	__m512i x = powers[key_d_windows[0].power];
+	for (int i = 1; i < sizeof(key_d_windows) / sizeof(window_step); i++)
 	{
-		unsigned long long temp = 0;
-		for (int k = 0; k < 6 && i + k < true_length; k++)
+		for (int k = 0; k < key_d_windows[i].squarings; k++)
+			x = montgomery_multiply_avx512(x, x);
+		x = montgomery_multiply_avx512(x, powers[key_d_windows[i].power]);
+	}
+
+	return montgomery_multiply_avx512(x, _mm512_set1_epi64(1));
+}
+
+/*
+ * exponentiate_blocks_avx512
+ *
+ * Runs fixed_exponentiation over count blocks, sixteen at a time as two 
+ * independent eight lane chains. count must be a multiple of 16.
+*/
+__attribute__((target("avx512f")))
+static void exponentiate_blocks_avx512(const unsigned int* values, unsigned int* results, int count)
+{
+	for (int i = 0; i < count; i += 16)
+	{
+		__m512i a = _mm512_cvtepu32_epi64(_mm256_loadu_si256((const __m256i*)(values + i)));
+		__m512i b = _mm512_cvtepu32_epi64(_mm256_loadu_si256((const __m256i*)(values + i + 8)));
+
+		a = fixed_exponentiation_avx512(a);
+		b = fixed_exponentiation_avx512(b);
+
+		_mm256_storeu_si256((__m256i*)(results + i), _mm512_cvtepi64_epi32(a));
+		_mm256_storeu_si256((__m256i*)(results + i + 8), _mm512_cvtepi64_epi32(b));
+	}
+}
+#endif
+
+/*
+ * exponentiate_blocks_scalar
+ *
+ * Runs fixed_exponentiation, or crt_exponentiation when the factors are 
+ * known, over count blocks one at a time.
+*/
+static void exponentiate_blocks_scalar(const unsigned int* values, unsigned int* results, int count)
+{
+	if (crt.enabled)
+		for (int i = 0; i < count; i++)
+			results[i] = crt_exponentiation(values[i]);
+	else
+		for (int i = 0; i < count; i++)
+			results[i] = fixed_exponentiation(values[i]);
+}
+
+#ifdef DECRYPT_X86
+static bool supports_avx512()
+{
+	return __builtin_cpu_supports("avx512f");
+}
+
+static bool supports_avx2()
+{
+	return __builtin_cpu_supports("avx2");
+}
+#endif
+
+static bool supports_scalar()
+{
+	return true;
+}
+
+//A way of exponentiating a batch of blocks, and whether this CPU can run it
+typedef struct {
+	const char* name;
+	bool (*supported)();
+	void (*exponentiate)(const unsigned int* values, unsigned int* results, int count);
+} block_kernel;
+
+//Every kernel built in, fastest first
+static const block_kernel kernels[] = {
+#ifdef DECRYPT_X86
+	{"avx512", supports_avx512, exponentiate_blocks_avx512},
+	{"avx2", supports_avx2, exponentiate_blocks_avx2},
+#endif
+	{"scalar", supports_scalar, exponentiate_blocks_scalar}
+};
+#define KERNEL_COUNT (int)(sizeof(kernels) / sizeof(kernels[0]))
+
+//Kernel batches are exponentiated with, NULL until one is selected
+static const block_kernel* kernel = NULL;
+//Picks a kernel the first time one is needed, if none was selected
+static pthread_once_t kernel_once = PTHREAD_ONCE_INIT;
+
+/*
+ * decrypt_select_kernel
+ *
+ * Chooses the kernel that batches of blocks are exponentiated with. The CPU
+ * is only checked here, never per batch. Not thread-safe, call before any
+ * decryption starts.
+ *
+ * name: Name of a kernel, or "auto" for the fastest this CPU supports. NULL
+ *       takes the name from the DECRYPT_KERNEL_ENV environment variable, or
+ *       "auto" if it is not set.
+ *
+ * returns: False if the kernel is unknown or this CPU cannot run it. The
+ *          kernel chosen before is then kept.
+*/
+bool decrypt_select_kernel(const char* name)
+{
+	if (name == NULL)
+		name = getenv(DECRYPT_KERNEL_ENV);
+	bool automatic = name == NULL || strcmp(name, "auto") == 0;
+
+	for (int i = 0; i < KERNEL_COUNT; i++)
+	{
+		if (automatic || strcmp(name, kernels[i].name) == 0)
 		{
-			int value = conversion_table[intermediary[i + k]];
-			if (value == -1)
+			if (kernels[i].supported())
 			{
-				free(intermediary);
-				return -1; //Undefined character in the encrypted text
+				kernel = kernels + i;
+				return true;
 			}
+			if (!automatic)
+				return false;
+		}
+	}
+	return false;
+}
+
+/*
+ * select_default_kernel
+ *
+ * Selects the kernel decrypt_select_kernel(NULL) would, falling back to the
+ * fastest one, unless one has already been selected. Run by pthread_once.
+*/
+static void select_default_kernel()
+{
+	if (kernel == NULL && !decrypt_select_kernel(NULL))
+		decrypt_select_kernel("auto");
+}
+
+/*
+ * decrypt_kernel_name
+ *
+ * returns: Name of the kernel batches are exponentiated with. If none has
+ *          been selected, one is, as decrypt_select_kernel(NULL) would, 
+ *          exactly once however many threads get here first.
+*/
+const char* decrypt_kernel_name()
+{
+	pthread_once(&kernel_once, select_default_kernel);
+	return kernel->name;
+}
+
+/*
+ * decrypt_kernel_at
+ *
+ * Lists the kernels built in, whether or not this CPU can run them.
+ *
+ * index: Position in the list, fastest first
+ *
+ * returns: Name of the kernel, or NULL past the end of the list
+*/
+const char* decrypt_kernel_at(int index)
+{
+	return index >= 0 && index < KERNEL_COUNT ? kernels[index].name : NULL;
+}
+
+/*
+ * exponentiate_blocks
+ *
+ * Runs fixed_exponentiation over count blocks with the selected kernel.
+ * count must be a multiple of BATCH_LANES, pad with zeroes. The vector 
+ * kernels stay on the direct path even when the factors are known, as a 
+ * lane of Montgomery multiplications beats scalar CRT.
+*/
+static void exponentiate_blocks(const unsigned int* values, unsigned int* results, int count)
+{
+	pthread_once(&kernel_once, select_default_kernel);
+	kernel->exponentiate(values, results, count);
+}
+
+/*
+ * decrypt_cache_init
+ *
+ * Enables the block cache for the calling thread, replacing any existing 
+ * cache. Repeated blocks are then looked up instead of exponentiated.
+ *
+ * entries: Number of entries, rounded up to a power of two. 0 disables the 
+ *          cache.
+ *
+ * returns: False if malloc fails, the cache is then disabled
+*/
+bool decrypt_cache_init(int entries)
+{
+	decrypt_cache_free();
+	if (entries <= 0)
+		return true;
+
+	int bits = 1;
+	while ((1U << bits) < (unsigned int)entries && bits < 30)
+		bits++;
+
+	cache.entries = (cache_entry*)malloc(sizeof(cache_entry) << bits);
+	if (cache.entries == NULL)
+		return false;
+
+	for (unsigned int i = 0; i < 1U << bits; i++)
+		cache.entries[i].value = CACHE_EMPTY;
+	cache.mask = (1U << bits) - 1;
+	cache.shift = 32 - bits;
+
+	return true;
+}
+
+/*
+ * decrypt_cache_free
+ *
+ * Disables the block cache for the calling thread and frees it. The hit and
+ * miss counters are kept.
+*/
+void decrypt_cache_free()
+{
+	free(cache.entries);
+	cache.entries = NULL;
+}
+
+/*
+ * decrypt_cache_stats
+ *
+ * Retrieves the block cache counters of the calling thread.
+ *
+ * hits:   Location to store number of blocks found in the cache
+ * misses: Location to store number of blocks that had to be exponentiated
+*/
+void decrypt_cache_stats(unsigned long long* hits, unsigned long long* misses)
+{
+	*hits = cache.hits;
+	*misses = cache.misses;
+}
 
-			temp += value * pow (41, 5 - k);
+/*
+ * cache_lookup
+ *
+ * Looks a packed block up in the calling thread's cache.
+ *
+ * block:  Packed block
+ * result: Location to store the decrypted block
+ *
+ * returns: False if the block is not cached
+*/
+static inline bool cache_lookup(unsigned int block, unsigned int* result)
+{
+	unsigned int slot = (block * 2654435761U) >> cache.shift;
+	for (int i = 0; i < CACHE_PROBES; i++)
+	{
+		cache_entry* entry = cache.entries + ((slot + i) & cache.mask);
+		if (entry->value == CACHE_EMPTY)
+			break;
+		if (entry->key == block)
+		{
+			cache.hits++;
+			*result = entry->value;
+			return true;
 		}
+	}
+
+	cache.misses++;
+	return false;
+}
+
+/*
+ * cache_insert
+ *
+ * Stores a decrypted block in the calling thread's cache. When the probe 
+ * sequence is full the first entry is replaced.
+ *
+ * block:  Packed block
+ * result: Decrypted block
+*/
+static inline void cache_insert(unsigned int block, unsigned int result)
+{
+	unsigned int slot = (block * 2654435761U) >> cache.shift;
+	cache_entry* entry = cache.entries + (slot & cache.mask);
+	for (int i = 0; i < CACHE_PROBES; i++)
+	{
+		cache_entry* candidate = cache.entries + ((slot + i) & cache.mask);
+		if (candidate->value == CACHE_EMPTY || candidate->key == block)
+		{
+			entry = candidate;
+			break;
+		}
+	}
+
+	entry->key = block;
+	entry->value = result;
+}
+
+/*
+ * block_exponentiation
+ *
+ * Decrypts a single packed block, going through the cache when enabled.
+ *
+ * returns: block^DECRYPT_KEY_D % DECRYPT_KEY_N
+*/
+static inline unsigned int block_exponentiation(unsigned int block)
+{
+	unsigned int result;
+	if (cache.entries == NULL)
+		return key_exponentiation(block, DECRYPT_KEY_D, DECRYPT_KEY_N);
+	if (cache_lookup(block, &result))
+		return result;
+
+	result = key_exponentiation(block, DECRYPT_KEY_D, DECRYPT_KEY_N);
+	cache_insert(block, result);
+	return result;
+}
+
+/*
+ * key_exponentiation
+ *
+ * Calculates num^n % mod, using fixed_exponentiation when (n, mod) is the 
+ * built-in key and modular_exponentiation otherwise.
+ * 
+ * returns: num^n % mod
+*/
+unsigned long long key_exponentiation(unsigned int num, unsigned int n, unsigned int mod)
+{
+	if (n == DECRYPT_KEY_D && mod == DECRYPT_KEY_N)
+		return crt.enabled ? crt_exponentiation(num) : fixed_exponentiation(num);
+	return modular_exponentiation(num, n, mod);
+}
+
+/*
+ * pack_block
+ *
+ * Reads the characters of one block, skipping every 8th character of the 
+ * input, and packs them into a base 41 number. A partial block is padded 
+ * with zeroes on the right.
+ *
+ * input: Encrypted string
+ * j:     Position in input to read from. Advanced past the block.
+ * width: Number of characters in the block, 1 to 6
+ * block: Location to store packed block. Truncated to 32 bits, like the 
+ *        original implementation.
+ *
+ * returns: False if the block has an invalid character
+*/
+static inline bool pack_block(const char* input, int* j, int width, unsigned int* block)
+{
+	unsigned long long temp = 0;
+	int position = *j;
+
+	for (int k = 0; k < width; k++)
+	{
+		//Skip every 8th character
+		if ((position + 1) % 8 == 0)
+			position++;
+
+		int value = conversion_table[(unsigned char)input[position++]];
+		if (value == -1)
+			return false;
+		temp += (unsigned long long)value * powers_of_41[k];
+	}
+
+	*j = position;
+	*block = (unsigned int)temp;
+	return true;
+}
+
+/*
+ * unpack_block
+ *
+ * Converts a decrypted block back into characters.
+ *
+ * block:  Decrypted block
+ * output: Location to store characters
+ * width:  Number of characters to store, 1 to 6
+*/
+static inline void unpack_block(unsigned int block, char* output, int width)
+{
+	char digits[6];
+	for (int k = 5; k >= 0; k--)
+	{
+		digits[k] = block % 41;
+		block /= 41;
+	}
+
+	for (int k = 0; k < width; k++)
+		output[k] = inversion_table[(int)digits[k]];
+}
+
+/*
+ * validate
+ *
+ * Checks that every character of an encrypted string, other than the 
+ * skipped 8th characters, is in the conversion table.
+ *
+ * input:  Encrypted string
+ * length: Length of input
+ *
+ * returns: False if there is an invalid character
+*/
+static bool validate(const char* input, int length)
+{
+	for (int j = 0; j < length; j++)
+		if ((j + 1) % 8 != 0 && conversion_table[(unsigned char)input[j]] == -1)
+			return false;
+	return true;
+}
+
+/*
+ * decrypt_r
+ *
+ * Decrypts the given encrypted string into a separate buffer. Does not 
+ * allocate and writes no shared state. It reads the key factors and the 
+ * kernel, so it is safe to call from many threads once decrypt_set_factors
+ * and decrypt_select_kernel, if used, have returned.
+ * 
+ * input:  Encrypted string, need not be null-terminated
+ * length: Length of input
+ * output: Location to store the null-terminated decrypted string. Must hold
+ *         DECRYPTED_LENGTH(length) + 1 bytes and may be the same as input.
+ * 
+ * returns:
+ * 		   Length of the decrypted string if no errors occur
+ * 		   -1 if input has an invalid character. Output is then undefined.
+*/
+int decrypt_r(const char* input, int length, char* output)
+{
+	int true_length = DECRYPTED_LENGTH(length);
+
+	for (int i = 0, j = 0; i < true_length; i += 6)
+	{
+		int width = true_length - i < 6 ? true_length - i : 6;
+		unsigned int block;
+		if (!pack_block(input, &j, width, &block))
+			return -1; //Undefined character in the encrypted text
 
 		//Step 3
 		//M=C^d % n
 		//d=1921821779
 		//n=4294434817
-		temp = modular_exponentiation(temp, 1921821779, 4294434817);
+		unpack_block(block_exponentiation(block), output + i, width);
+	}
+
+	output[true_length] = 0;
+	return true_length;
+}
 
-		for (int k = 0; k < 6 && i + k < true_length; k++)
+/*
+ * decrypt
+ *
+ * Decrypts the given encrypted string, then stores it at same location
+ * 
+ * encrypted_string: Location of encrypted string. Used for storing decrypted 
+ *                   string.
+ * 
+ * returns:
+ * 		   Length if no errors occur
+ * 		   -1 if an error occurs, the string is left untouched
+*/
+int decrypt(char* encrypted_string)
+{
+	int length = strlen(encrypted_string);
+
+	//Check first so that the original data is not destroyed on an error
+	if (!validate(encrypted_string, length))
+		return -1;
+
+	return decrypt_r(encrypted_string, length, encrypted_string);
+}
+
+/*
+ * gather_tweet
+ *
+ * Strips every 8th character out of a tweet and appends its blocks to the 
+ * batch. The decrypted string is null-terminated straight away, which is 
+ * safe even when decrypting in place as the whole tweet has been read.
+ *
+ * batch:  Batch to append to, must have room for every block of the tweet
+ * input:  Encrypted tweet
+ * length: Length of the tweet
+ * output: Location to store the decrypted tweet
+ *
+ * returns: False if the tweet has an invalid character. The batch and output
+ *          are then left as they were.
+*/
+static bool gather_tweet(block_batch* batch, const char* input, int length, char* output)
+{
+	int true_length = DECRYPTED_LENGTH(length);
+	int start = batch->count;
+
+	for (int i = 0, j = 0; i < true_length; i += 6)
+	{
+		int width = true_length - i < 6 ? true_length - i : 6;
+		if (!pack_block(input, &j, width, batch->values + batch->count))
 		{
+			batch->count = start;
+			return false;
+		}
+
+		batch->destination[batch->count] = output + i;
+		batch->width[batch->count] = width;
+		batch->count++;
+	}
 
-			int result = (temp / (long)pow(41, 5 - k)) % 41;
-			intermediary[i + k] = inversion_table[result];
+	output[true_length] = 0;
+	return true;
+}
+
+/*
+ * flush_batch
+ *
+ * Exponentiates every block in the batch and scatters the decrypted 
+ * characters back into their tweets, leaving the batch empty.
+ *
+ * batch: Batch to flush
+*/
+static void flush_batch(block_batch* batch)
+{
+	if (cache.entries == NULL)
+	{
+		//Pad up to a whole number of vectors
+		int count = (batch->count + BATCH_LANES - 1) / BATCH_LANES * BATCH_LANES;
+		for (int i = batch->count; i < count; i++)
+			batch->values[i] = 0;
+
+		exponentiate_blocks(batch->values, batch->results, count);
+	}
+	else
+	{
+		//Only blocks missing from the cache go through the kernel
+		int misses = 0;
+		for (int i = 0; i < batch->count; i++)
+		{
+			if (cache_lookup(batch->values[i], batch->results + i))
+				continue;
+			batch->miss_values[misses] = batch->values[i];
+			batch->miss_index[misses++] = i;
+		}
+
+		int count = (misses + BATCH_LANES - 1) / BATCH_LANES * BATCH_LANES;
+		for (int i = misses; i < count; i++)
+			batch->miss_values[i] = 0;
+
+		exponentiate_blocks(batch->miss_values, batch->miss_results, count);
+
+		for (int i = 0; i < misses; i++)
+		{
+			batch->results[batch->miss_index[i]] = batch->miss_results[i];
+			cache_insert(batch->miss_values[i], batch->miss_results[i]);
+		}
+	}
+
+	for (int i = 0; i < batch->count; i++)
+		unpack_block(batch->results[i], batch->destination[i], batch->width[i]);
+
+	batch->count = 0;
+}
+
+/*
+ * decrypt_batch_r
+ *
+ * Decrypts many tweets at once into separate buffers. Blocks from all the 
+ * tweets are gathered together so that the exponentiation runs several lanes
+ * wide. Does not allocate and writes no shared state, so it is safe to 
+ * call from many threads on the same terms as decrypt_r.
+ * 
+ * input:   Encrypted tweets, need not be null-terminated
+ * lengths: Length of each tweet
+ * output:  Locations to store the null-terminated decrypted tweets. Each must
+ *          hold DECRYPTED_LENGTH(length) + 1 bytes and may be the same as 
+ *          its input.
+ * n:       Number of tweets
+ * 
+ * returns:
+ *         n if every tweet was decrypted
+ *         Index of the first tweet that could not be decrypted otherwise. 
+ *         Tweets before it are decrypted, it and the rest are left untouched.
+*/
+int decrypt_batch_r(const char** input, const int* lengths, char** output, int n)
+{
+	block_batch batch;
+	batch.count = 0;
+
+	for (int t = 0; t < n; t++)
+	{
+		int blocks = (DECRYPTED_LENGTH(lengths[t]) + 5) / 6;
+
+		if (blocks > BATCH_BLOCKS)
+		{
+			//Too long to ever fit in a batch
+			flush_batch(&batch);
+			if (!validate(input[t], lengths[t]))
+				return t;
+			decrypt_r(input[t], lengths[t], output[t]);
+			continue;
+		}
+
+		if (batch.count + blocks > BATCH_BLOCKS)
+			flush_batch(&batch);
+
+		if (!gather_tweet(&batch, input[t], lengths[t], output[t]))
+		{
+			flush_batch(&batch);
+			return t;
 		}
 	}
 
-	//Copy our decrypted string to the given pointer
-	memcpy(encrypted_string, intermediary, length);
+	flush_batch(&batch);
+	return n;
+}
 
-	free(intermediary);
+/*
+ * decrypt_batch
+ *
+ * Decrypts many tweets at once, storing each at the same location. Blocks 
+ * from all the tweets are gathered together so that the exponentiation runs
+ * several lanes wide.
+ * 
+ * tweets: Encrypted, null-terminated tweets. Used for storing the decrypted
+ *         tweets.
+ * n:      Number of tweets
+ * 
+ * returns:
+ *         n if every tweet was decrypted
+ *         Index of the first tweet that could not be decrypted otherwise. 
+ *         Tweets before it are decrypted, it and the rest are left untouched.
+*/
+int decrypt_batch(char** tweets, int n)
+{
+	int lengths[DECRYPT_BATCH_TWEETS];
+	int done = 0;
 
- 	return strlen(encrypted_string);
-} 
+	//Work through in groups so the lengths fit on the stack
+	while (done < n)
+	{
+		int count = n - done < DECRYPT_BATCH_TWEETS ? n - done : DECRYPT_BATCH_TWEETS;
+		for (int i = 0; i < count; i++)
+			lengths[i] = strlen(tweets[done + i]);
+
+		int result = decrypt_batch_r((const char**)tweets + done, lengths, 
+			tweets + done, count);
+		done += result;
+		if (result < count)
+			break;
+	}
+
+	return done;
+}
@@ -12,8 +12,151 @@
 #ifndef _DECRYPT_H_
 #define _DECRYPT_H_
 
+#include <stdbool.h>
 #include <string.h>
 
+//The private key the tweets were encrypted for. M=C^d % n
+#define DECRYPT_KEY_D 1921821779U
+#define DECRYPT_KEY_N 4294434817U
+
+//Environment variable naming the kernel to use, see decrypt_select_kernel
+#define DECRYPT_KERNEL_ENV "LYREBIRD_KERNEL"
+
+//Number of tweets worth handing to decrypt_batch at once
+#define DECRYPT_BATCH_TWEETS 256
+
+//Length of an encrypted string once every 8th character is removed, which is
+//also the length of its decryption
+#define DECRYPTED_LENGTH(length) ((length) - (length) / 8)
+
+/*
+ * modular_exponentiation
+ *
+ * Reference implementation. Quickly calculates num^n % mod for any key.
+ * 
+ * returns: num^n % mod
+*/
+unsigned long long modular_exponentiation(unsigned int num, unsigned int n, unsigned int mod);
+
+/*
+ * fixed_exponentiation
+ *
+ * Calculates num^DECRYPT_KEY_D % DECRYPT_KEY_N using Montgomery multiplication
+ * and a precomputed sliding window over the exponent. Never divides.
+ * 
+ * returns: num^DECRYPT_KEY_D % DECRYPT_KEY_N
+*/
+unsigned long long fixed_exponentiation(unsigned int num);
+
+/*
+ * key_exponentiation
+ *
+ * Calculates num^n % mod, using fixed_exponentiation when (n, mod) is the 
+ * built-in key and modular_exponentiation otherwise.
+ * 
+ * returns: num^n % mod
+*/
+unsigned long long key_exponentiation(unsigned int num, unsigned int n, unsigned int mod);
+
+/*
+ * decrypt_set_factors
+ *
+ * Switches decryption to the Chinese Remainder Theorem using the factors 
+ * of DECRYPT_KEY_N. Not thread-safe, call before any decryption starts.
+ *
+ * p, q: Prime factors of DECRYPT_KEY_N, in either order
+ *
+ * returns: False if p and q are not the factors of the key. Decryption then 
+ *          stays on the direct path.
+*/
+bool decrypt_set_factors(unsigned int p, unsigned int q);
+
+/*
+ * decrypt_select_kernel
+ *
+ * Chooses the kernel that batches of blocks are exponentiated with. The CPU
+ * is only checked here, never per batch. Not thread-safe, call before any
+ * decryption starts.
+ *
+ * name: Name of a kernel, or "auto" for the fastest this CPU supports. NULL
+ *       takes the name from the DECRYPT_KERNEL_ENV environment variable, or
+ *       "auto" if it is not set.
+ *
+ * returns: False if the kernel is unknown or this CPU cannot run it. The
+ *          kernel chosen before is then kept.
+*/
+bool decrypt_select_kernel(const char* name);
+
+/*
+ * decrypt_kernel_name
+ *
+ * returns: Name of the kernel batches are exponentiated with. If none has
+ *          been selected, one is, as decrypt_select_kernel(NULL) would, 
+ *          exactly once however many threads get here first.
+*/
+const char* decrypt_kernel_name();
+
+/*
+ * decrypt_kernel_at
+ *
+ * Lists the kernels built in, whether or not this CPU can run them.
+ *
+ * index: Position in the list, fastest first
+ *
+ * returns: Name of the kernel, or NULL past the end of the list
+*/
+const char* decrypt_kernel_at(int index);
+
+/*
+ * decrypt_cache_init
+ *
+ * Enables the block cache for the calling thread, replacing any existing 
+ * cache. Repeated blocks are then looked up instead of exponentiated.
+ *
+ * entries: Number of entries, rounded up to a power of two. 0 disables the 
+ *          cache.
+ *
+ * returns: False if malloc fails, the cache is then disabled
+*/
+bool decrypt_cache_init(int entries);
+
+/*
+ * decrypt_cache_free
+ *
+ * Disables the block cache for the calling thread and frees it. The hit and
+ * miss counters are kept.
+*/
+void decrypt_cache_free();
+
+/*
+ * decrypt_cache_stats
+ *
+ * Retrieves the block cache counters of the calling thread.
+ *
+ * hits:   Location to store number of blocks found in the cache
+ * misses: Location to store number of blocks that had to be exponentiated
+*/
+void decrypt_cache_stats(unsigned long long* hits, unsigned long long* misses);
+
+/*
+ * decrypt_r
+ *
+ * Decrypts the given encrypted string into a separate buffer. Does not 
+ * allocate and writes no shared state. It reads the key factors and the 
+ * kernel, so it is safe to call from many threads once decrypt_set_factors
+ * and decrypt_select_kernel, if used, have returned.
+ * 
+ * input:  Encrypted string, need not be null-terminated
+ * length: Length of input
+ * output: Location to store the null-terminated decrypted string. Must hold
+ *         DECRYPTED_LENGTH(length) + 1 bytes and may be the same as input.
+ * 
+ * returns:
+ * 		   Length of the decrypted string if no errors occur
+ * 		   -1 if input has an invalid character. Output is then undefined.
+*/
+int decrypt_r(const char* input, int length, char* output);
+
 /*
  * decrypt
  *
@@ -24,10 +167,49 @@
  * 
  * returns:
  * 		   Length if no errors occur
- * 		   -1 if an error occurs
- *         -2 if malloc fails
+ * 		   -1 if an error occurs, the string is left untouched
 */
 int decrypt(char* encrypted_string);
 
+/*
+ * decrypt_batch_r
+ *
+ * Decrypts many tweets at once into separate buffers. Blocks from all the 
+ * tweets are gathered together so that the exponentiation runs several lanes
+ * wide. Does not allocate and writes no shared state, so it is safe to 
+ * call from many threads on the same terms as decrypt_r.
+ * 
+ * input:   Encrypted tweets, need not be null-terminated
+ * lengths: Length of each tweet
+ * output:  Locations to store the null-terminated decrypted tweets. Each must
+ *          hold DECRYPTED_LENGTH(length) + 1 bytes and may be the same as 
+ *          its input.
+ * n:       Number of tweets
+ * 
+ * returns:
+ *         n if every tweet was decrypted
+ *         Index of the first tweet that could not be decrypted otherwise. 
+ *         Tweets before it are decrypted, it and the rest are left untouched.
+*/
+int decrypt_batch_r(const char** input, const int* lengths, char** output, int n);
+
+/*
+ * decrypt_batch
+ *
+ * Decrypts many tweets at once, storing each at the same location. Blocks 
+ * from all the tweets are gathered together so that the exponentiation runs
+ * several lanes wide.
+ * 
+ * tweets: Encrypted, null-terminated tweets. Used for storing the decrypted
+ *         tweets.
+ * n:      Number of tweets
+ * 
+ * returns:
+ *         n if every tweet was decrypted
+ *         Index of the first tweet that could not be decrypted otherwise. 
+ *         Tweets before it are decrypted, it and the rest are left untouched.
+*/
+int decrypt_batch(char** tweets, int n);
+
 #endif 
 
@@ -0,0 +1,1052 @@
+/*
+ * gen.c
+ *
+ * Generates encrypted corpora for load testing. Plaintext is encrypted with
+ * the public exponent of the built-in key, with filler at every 8th
+ * character, so the files decrypt exactly as real tweets would. Files are
+ * cut into segments of a known size which are written in parallel by a set
+ * of children, so a corpus of any size is generated as fast as the disks
+ * allow.
+ *
+ * James Shephard
+ * CMPT 300 - D100 Burnaby
+ * Instructor Brian Booth
+ * TA Scott Kristjanson
+ */
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/sysinfo.h>
+#include <sys/wait.h>
+#include <time.h>
+#include <unistd.h>
+#include "common.h"
+#include "decrypt.h"
+#include "memwatch.h"
+
+//The public key matching DECRYPT_KEY_D. C=M^e % n
+#define GEN_KEY_E 57839U
+//n is the product of two Mersenne primes, 2^13-1 and 2^19-1, so blocks are
+//encrypted modulo each and combined with the Chinese Remainder Theorem
+#define GEN_P_BITS 13
+#define GEN_Q_BITS 19
+#define GEN_P ((1U << GEN_P_BITS) - 1)
+#define GEN_Q ((1U << GEN_Q_BITS) - 1)
+//q^-1 % p
+#define GEN_Q_INVERSE 8061U
+
+//Bytes of a file generated at once by one child
+#define GEN_SEGMENT_SIZE (8 << 20)
+//Encrypted characters read by each fgets when decrypting
+#define GEN_PIECE (MAX_TWEET_LENGTH - 1)
+//Plaintext characters in a whole piece
+#define GEN_PIECE_TEXT DECRYPTED_LENGTH(GEN_PIECE)
+#define GEN_PIECE_BLOCKS ((GEN_PIECE_TEXT + 5) / 6)
+//Entries of the table words are drawn from
+#define GEN_WORD_TABLE 4096
+//Entries of each child's cache of encrypted blocks, a power of two
+#define GEN_CACHE_ENTRIES 65536
+#define GEN_CACHE_EMPTY 0xFFFFFFFFU
+//Share of the corpus held by the giant file
+#define GEN_GIANT_SHARE 0.9
+//Default seed
+#define GEN_SEED 0x6C797265ULL
+
+//Ways of spreading sizes out
+typedef enum {
+	DIST_UNIFORM,
+	DIST_ZIPF,
+	DIST_FIXED,
+	DIST_GIANT
+} distribution;
+
+//Part of an input file generated in one go
+typedef struct {
+	int file;
+	long long offset;
+	long long size;
+	long long expected_offset; //Offset of its decryption in the expected file
+	unsigned long long seed;
+} segment;
+
+//Table for drawing ranks from a Zipf distribution
+typedef struct {
+	double* cumulative;
+	int count;
+} zipf;
+
+//The 41 characters of the encrypted alphabet, in value order
+static const char alphabet[] = " abcdefghijklmnopqrstuvwxyz#.,'!?()-:$/&\\";
+
+//Place value of each character within a 6 character block
+static const unsigned long long place[6] = {
+	115856201, 2825761, 68921, 1681, 41, 1
+};
+
+//Words the plaintext is made of, most common first. Their characters all
+//come early in the alphabet, so every block they make is below n.
+static const char* words[] = {
+	"the", "to", "a", "i", "and", "is", "in", "it", "you", "of", "for", "on",
+	"my", "that", "at", "with", "me", "do", "have", "just", "this", "be",
+	"so", "are", "not", "was", "but", "out", "up", "what", "now", "new",
+	"from", "your", "like", "good", "no", "get", "all", "about", "we",
+	"love", "day", "today", "can", "there", "how", "time", "one", "lol",
+	"know", "going", "back", "got", "will", "see", "people", "great",
+	"really", "think", "night", "want", "follow", "twitter"
+};
+#define WORD_COUNT (int)(sizeof(words) / sizeof(words[0]))
+
+static signed char values[256];
+//Index of a word for each entry, each word taking its share of the table
+static unsigned char word_table[GEN_WORD_TABLE];
+//Recently encrypted blocks, common words come up again and again
+static unsigned int cache_blocks[GEN_CACHE_ENTRIES];
+static unsigned int cache_results[GEN_CACHE_ENTRIES];
+static zipf line_ranks;
+
+//Settings from the command line
+static const char* directory;
+static distribution file_distribution = DIST_UNIFORM;
+static distribution line_distribution = DIST_UNIFORM;
+static int longest = MAX_TWEET_LENGTH - 2;
+static bool expected = false;
+
+static segment* segments;
+static int segment_count;
+//Shared with the children
+static int* next_segment;
+static long long* expected_sizes;
+
+/*
+ * next_random
+ *
+ * state: State of the generator, never zero
+ *
+ * returns: Next number of the seeded generator (xorshift64*)
+*/
+static inline unsigned int next_random(unsigned long long* state)
+{
+	*state ^= *state >> 12;
+	*state ^= *state << 25;
+	*state ^= *state >> 27;
+	return (unsigned int)((*state * 0x2545F4914F6CDD1DULL) >> 32);
+}
+
+/*
+ * mix_seed
+ *
+ * Scrambles a seed, so seeds that differ by one start unrelated streams
+ * (splitmix64).
+ *
+ * returns: Seed for next_random, never zero
+*/
+static unsigned long long mix_seed(unsigned long long seed)
+{
+	seed += 0x9E3779B97F4A7C15ULL;
+	seed = (seed ^ (seed >> 30)) * 0xBF58476D1CE4E5B9ULL;
+	seed = (seed ^ (seed >> 27)) * 0x94D049BB133111EBULL;
+	seed ^= seed >> 31;
+	return seed == 0 ? 1 : seed;
+}
+
+/*
+ * zipf_create
+ *
+ * Builds a table giving rank k (from 0) a weight of 1/(k+1).
+ *
+ * count: Number of ranks
+ *
+ * returns: False if malloc fails
+*/
+static bool zipf_create(zipf* z, int count)
+{
+	z->count = count;
+	z->cumulative = (double*)malloc(count * sizeof(double));
+	if (z->cumulative == NULL)
+		return false;
+
+	double total = 0;
+	for (int k = 0; k < count; k++)
+	{
+		total += 1.0 / (k + 1);
+		z->cumulative[k] = total;
+	}
+	return true;
+}
+
+/*
+ * zipf_rank
+ *
+ * point: Point in the distribution, from 0 to 2^32
+ *
+ * returns: The rank from 0 to count - 1 the point falls in
+*/
+static int zipf_rank(const zipf* z, unsigned int point)
+{
+	double target = point / 4294967296.0 * z->cumulative[z->count - 1];
+	int low = 0, high = z->count - 1;
+	while (low < high)
+	{
+		int middle = (low + high) / 2;
+		if (z->cumulative[middle] <= target)
+			low = middle + 1;
+		else
+			high = middle;
+	}
+	return low;
+}
+
+/*
+ * zipf_draw
+ *
+ * returns: A random rank from 0 to count - 1
+*/
+static int zipf_draw(const zipf* z, unsigned long long* state)
+{
+	return zipf_rank(z, next_random(state));
+}
+
+/*
+ * mersenne_reduce
+ *
+ * returns: x % (2^bits - 1), for x below 2^38
+*/
+static inline unsigned int mersenne_reduce(unsigned long long x, int bits)
+{
+	unsigned long long m = (1ULL << bits) - 1;
+	x = (x & m) + (x >> bits);
+	x = (x & m) + (x >> bits);
+	return x >= m ? x - m : x;
+}
+
+/*
+ * encrypt_blocks
+ *
+ * Encrypts blocks with the public key, modulo p and q separately and then
+ * combined. The blocks are worked on side by side, so the multiplications
+ * of one never wait on those of another. Never divides.
+ *
+ * blocks: Packed plaintext blocks, each below DECRYPT_KEY_N. Replaced by
+ *         block^GEN_KEY_E % DECRYPT_KEY_N.
+ * count:  Number of blocks, up to GEN_PIECE_BLOCKS
+*/
+static void encrypt_blocks(unsigned int* blocks, int count)
+{
+	unsigned int base_p[GEN_PIECE_BLOCKS], base_q[GEN_PIECE_BLOCKS];
+	unsigned int result_p[GEN_PIECE_BLOCKS], result_q[GEN_PIECE_BLOCKS];
+	for (int i = 0; i < count; i++)
+	{
+		base_p[i] = mersenne_reduce(blocks[i], GEN_P_BITS);
+		base_q[i] = mersenne_reduce(blocks[i], GEN_Q_BITS);
+		result_p[i] = 1;
+		result_q[i] = 1;
+	}
+
+	for (unsigned int n = GEN_KEY_E; n > 0; n >>= 1)
+	{
+		for (int i = 0; i < count; i++)
+		{
+			if (n & 1)
+			{
+				result_p[i] = mersenne_reduce((unsigned long long)result_p[i] * base_p[i], GEN_P_BITS);
+				result_q[i] = mersenne_reduce((unsigned long long)result_q[i] * base_q[i], GEN_Q_BITS);
+			}
+			base_p[i] = mersenne_reduce((unsigned long long)base_p[i] * base_p[i], GEN_P_BITS);
+			base_q[i] = mersenne_reduce((unsigned long long)base_q[i] * base_q[i], GEN_Q_BITS);
+		}
+	}
+
+	//Garner's formula, c = cq + q * ((cp - cq) * q^-1 % p)
+	for (int i = 0; i < count; i++)
+	{
+		unsigned int difference = mersenne_reduce(result_p[i] + GEN_P -
+			mersenne_reduce(result_q[i], GEN_P_BITS), GEN_P_BITS);
+		unsigned int h = mersenne_reduce((unsigned long long)difference * GEN_Q_INVERSE, GEN_P_BITS);
+		blocks[i] = result_q[i] + h * GEN_Q;
+	}
+}
+
+/*
+ * encrypt_cached
+ *
+ * Encrypts blocks, looking each up in the cache first. Only the ones missing
+ * are encrypted, side by side.
+ *
+ * blocks: See encrypt_blocks
+ * count:  See encrypt_blocks
+*/
+static void encrypt_cached(unsigned int* blocks, int count)
+{
+	unsigned int missing[GEN_PIECE_BLOCKS];
+	int where[GEN_PIECE_BLOCKS];
+	int misses = 0;
+	for (int i = 0; i < count; i++)
+	{
+		unsigned int slot = (blocks[i] * 0x9E3779B1U) >> 16 & (GEN_CACHE_ENTRIES - 1);
+		if (cache_blocks[slot] == blocks[i])
+			blocks[i] = cache_results[slot];
+		else
+		{
+			where[misses] = i;
+			missing[misses++] = blocks[i];
+		}
+	}
+
+	encrypt_blocks(missing, misses);
+	for (int k = 0; k < misses; k++)
+	{
+		unsigned int block = blocks[where[k]];
+		unsigned int slot = (block * 0x9E3779B1U) >> 16 & (GEN_CACHE_ENTRIES - 1);
+		cache_blocks[slot] = block;
+		cache_results[slot] = missing[k];
+		blocks[where[k]] = missing[k];
+	}
+}
+
+/*
+ * pack_text
+ *
+ * Packs 6 plaintext characters into a block, the first most significant.
+ *
+ * returns: The block, or -1 if a character is not in the alphabet
+*/
+static long long pack_text(const char* text)
+{
+	long long block = 0;
+	for (int k = 0; k < 6; k++)
+	{
+		int value = values[(unsigned char)text[k]];
+		if (value == -1)
+			return -1;
+		block += value * place[k];
+	}
+	return block;
+}
+
+/*
+ * spread_blocks
+ *
+ * Writes encrypted blocks out as characters, with filler at every 8th
+ * character where decrypt skips one.
+ *
+ * blocks: Encrypted blocks
+ * output: Location to store the encrypted string, not null-terminated
+ * length: Length of the encrypted string, its DECRYPTED_LENGTH characters
+ *         are taken from the blocks
+ * state:  Generator the filler is drawn from
+*/
+static void spread_blocks(const unsigned int* blocks, char* output, int length, unsigned long long* state)
+{
+	char digits[GEN_PIECE_BLOCKS * 6];
+	for (int b = 0; b < (DECRYPTED_LENGTH(length) + 5) / 6; b++)
+	{
+		unsigned int block = blocks[b];
+		for (int k = 5; k >= 0; k--)
+		{
+			digits[b * 6 + k] = alphabet[block % 41];
+			block /= 41;
+		}
+	}
+
+	for (int j = 0, i = 0; j < length; j++)
+	{
+		if ((j + 1) % 8 == 0)
+			output[j] = alphabet[next_random(state) % 41];
+		else
+			output[j] = digits[i++];
+	}
+}
+
+/*
+ * make_text
+ *
+ * Writes plaintext made of words, the common ones far more often than the
+ * rest, as in real tweets. One word in four is made up of random letters, 
+ * standing in for names, tags and typos, so not every block repeats.
+ *
+ * text:   Location to store the text, not null-terminated
+ * length: Length of the text
+*/
+static void make_text(unsigned long long* state, char* text, int length)
+{
+	int i = 0;
+	while (i < length)
+	{
+		unsigned int r = next_random(state);
+		if ((r >> 12) % 4 == 0)
+		{
+			for (int k = 1 + (r >> 14) % 8; k > 0 && i < length; k--)
+				text[i++] = 'a' + next_random(state) % 26;
+		}
+		else
+		{
+			const char* word = words[word_table[r % GEN_WORD_TABLE]];
+			while (*word != '\0' && i < length)
+				text[i++] = *word++;
+		}
+
+		r = (r >> 24) % 16;
+		if (r < 2 && i < length)
+			text[i++] = r == 0 ? '.' : ',';
+		if (i < length)
+			text[i++] = ' ';
+	}
+}
+
+/*
+ * make_piece
+ *
+ * Generates one fgets sized piece of an encrypted line. Whole blocks are
+ * encrypted from generated text. A shorter block at the end is decrypted
+ * with its missing characters taken as spaces, which rarely matches a
+ * plaintext, so one is drawn at random and its decryption is the text. Only
+ * the last line of a segment has one.
+ *
+ * output: Location to store the encrypted piece, not null-terminated
+ * plain:  Location to store its decryption, or NULL
+ * length: Length of the piece, up to GEN_PIECE
+*/
+static void make_piece(unsigned long long* state, char* output, char* plain, int length)
+{
+	char text[GEN_PIECE_TEXT + 6];
+	unsigned int blocks[GEN_PIECE_BLOCKS];
+	int text_length = DECRYPTED_LENGTH(length);
+	int whole = text_length / 6;
+	int width = text_length % 6;
+
+	make_text(state, text, whole * 6);
+	for (int b = 0; b < whole; b++)
+		blocks[b] = pack_text(text + b * 6);
+	encrypt_cached(blocks, whole);
+
+	if (width > 0)
+	{
+		unsigned int unit = place[width - 1];
+		blocks[whole] = next_random(state) % ((DECRYPT_KEY_N - 1) / unit + 1) * unit;
+		if (plain != NULL)
+		{
+			unsigned long long block = key_exponentiation(blocks[whole], DECRYPT_KEY_D, DECRYPT_KEY_N);
+			for (int k = 0; k < width; k++)
+				text[whole * 6 + k] = alphabet[block / place[k] % 41];
+		}
+	}
+
+	spread_blocks(blocks, output, length, state);
+	if (plain != NULL)
+		memcpy(plain, text, text_length);
+}
+
+/*
+ * whole_blocks
+ *
+ * Moves the end of a line to the nearest place where its last piece
+ * decrypts to whole blocks, later if the line can be that long.
+ *
+ * length: Length of an encrypted line
+ *
+ * returns: The length moved
+*/
+static int whole_blocks(int length)
+{
+	int last = length % GEN_PIECE;
+	int up = last, down = last;
+	while (DECRYPTED_LENGTH(up) % 6 != 0)
+		up++;
+	while (DECRYPTED_LENGTH(down) % 6 != 0)
+		down--;
+	return length - last + (length - last + up <= longest ? up : down);
+}
+
+/*
+ * draw_length
+ *
+ * returns: Length of the next encrypted line, without its newline. Every
+ *          block of it is whole.
+*/
+static int draw_length(unsigned long long* state)
+{
+	switch (line_distribution)
+	{
+		case DIST_ZIPF:
+			return whole_blocks(1 + zipf_draw(&line_ranks, state));
+		case DIST_FIXED:
+			return whole_blocks(longest);
+		default:
+			return whole_blocks(1 + next_random(state) % longest);
+	}
+}
+
+/*
+ * walk_segment
+ *
+ * Generates the lines of a segment. The last line is cut to end exactly
+ * at the end of the segment. Line lengths come from their own generator, so
+ * the size of the decryption can be found without generating any text.
+ *
+ * s:      Segment to generate
+ * output: Location to store the encrypted segment, or NULL to only measure
+ * plain:  Location to store its decryption, or NULL
+ *
+ * returns: Size of the decryption of the segment
+*/
+static long long walk_segment(const segment* s, char* output, char* plain)
+{
+	unsigned long long lengths = s->seed;
+	unsigned long long content = mix_seed(s->seed);
+	long long remaining = s->size;
+	long long position = 0, decrypted = 0;
+
+	while (remaining > 0)
+	{
+		int length = draw_length(&lengths);
+		if (length + 1 >= remaining)
+			length = remaining - 1;
+
+		//Longer lines are decrypted in pieces, each skipping its own filler
+		for (int j = 0; j < length; j += GEN_PIECE)
+		{
+			int piece = length - j < GEN_PIECE ? length - j : GEN_PIECE;
+			if (output != NULL)
+				make_piece(&content, output + position + j, plain == NULL ? NULL : plain + decrypted, piece);
+			decrypted += DECRYPTED_LENGTH(piece);
+		}
+		position += length;
+		if (output != NULL)
+			output[position] = '\n';
+		if (plain != NULL)
+			plain[decrypted] = '\n';
+		position++;
+		decrypted++;
+		remaining -= length + 1;
+	}
+	return decrypted;
+}
+
+/*
+ * write_at
+ *
+ * Writes a buffer into place in an existing file.
+ *
+ * returns: False if an error occurs
+*/
+static bool write_at(const char* path, const char* buffer, long long size, long long offset)
+{
+	int fd = open(path, O_WRONLY);
+	if (fd == -1)
+		return false;
+
+	while (size > 0)
+	{
+		ssize_t written = pwrite(fd, buffer, size, offset);
+		if (written < 0)
+		{
+			if (errno == EINTR)
+				continue;
+			close(fd);
+			return false;
+		}
+		buffer += written;
+		size -= written;
+		offset += written;
+	}
+	return close(fd) == 0;
+}
+
+/*
+ * file_path
+ *
+ * Builds the path of a generated file.
+ *
+ * path:      Location to store the path, MAX_LOCATION_LENGTH bytes
+ * file:      Index of the file
+ * extension: txt for the input, out for the output, expected for its
+ *            decryption
+*/
+static void file_path(char* path, int file, const char* extension)
+{
+	snprintf(path, MAX_LOCATION_LENGTH, "%s/gen.%i.%s", directory, file, extension);
+}
+
+/*
+ * work
+ *
+ * Run by each child. Takes segments until there are none left and either
+ * measures or writes them.
+ *
+ * measure: Only find the size of each segment's decryption
+ *
+ * returns: False if an error occurs
+*/
+static bool work(bool measure)
+{
+	char* output = NULL;
+	char* plain = NULL;
+	if (!measure)
+	{
+		output = (char*)malloc(GEN_SEGMENT_SIZE);
+		plain = expected ? (char*)malloc(GEN_SEGMENT_SIZE) : NULL;
+		if (output == NULL || (expected && plain == NULL))
+			return false;
+	}
+
+	bool success = true;
+	int i;
+	while (success && (i = __atomic_fetch_add(next_segment, 1, __ATOMIC_RELAXED)) < segment_count)
+	{
+		segment* s = segments + i;
+		if (measure)
+		{
+			expected_sizes[i] = walk_segment(s, NULL, NULL);
+			continue;
+		}
+
+		char path[MAX_LOCATION_LENGTH];
+		long long decrypted = walk_segment(s, output, plain);
+		file_path(path, s->file, "txt");
+		success = write_at(path, output, s->size, s->offset);
+		if (success && expected)
+		{
+			file_path(path, s->file, "expected");
+			success = write_at(path, plain, decrypted, s->expected_offset);
+		}
+	}
+
+	free(output);
+	free(plain);
+	return success;
+}
+
+/*
+ * run_workers
+ *
+ * Forks children to work through every segment, and waits for them.
+ *
+ * jobs:    Number of children
+ * measure: See work
+ *
+ * returns: False if any child failed
+*/
+static bool run_workers(int jobs, bool measure)
+{
+	*next_segment = 0;
+	int started = 0;
+	for (; started < jobs; started++)
+	{
+		pid_t pid = fork();
+		if (pid == -1)
+			break;
+		if (pid == 0)
+			_exit(work(measure) ? EXIT_SUCCESS : EXIT_FAILURE);
+	}
+
+	bool success = started > 0;
+	for (int i = 0; i < started; i++)
+	{
+		int status;
+		if (wait(&status) == -1 || !WIFEXITED(status) || WEXITSTATUS(status) != EXIT_SUCCESS)
+			success = false;
+	}
+	return success;
+}
+
+/*
+ * file_sizes
+ *
+ * Shares the corpus out between the files.
+ *
+ * sizes: Location to store the size of each file
+ * files: Number of files
+ * total: Bytes in the corpus
+ *
+ * returns: False if malloc fails
+*/
+static bool file_sizes(long long* sizes, int files, long long total, unsigned long long* state)
+{
+	double* weights = (double*)malloc(files * sizeof(double));
+	if (weights == NULL)
+		return false;
+
+	for (int i = 0; i < files; i++)
+	{
+		if (file_distribution == DIST_ZIPF)
+			weights[i] = 1.0 / (i + 1);
+		else if (file_distribution == DIST_GIANT)
+			weights[i] = files == 1 ? 1 : (1 - GEN_GIANT_SHARE) / (files - 1);
+		else
+			weights[i] = 0.5 + next_random(state) / 4294967296.0;
+	}
+
+	if (file_distribution == DIST_GIANT)
+		weights[files - 1] = files == 1 ? 1 : GEN_GIANT_SHARE; //Last, the worst place for it
+	else if (file_distribution == DIST_ZIPF)
+	{
+		//Shuffle, so the largest files are not simply first
+		for (int i = files - 1; i > 0; i--)
+		{
+			int j = next_random(state) % (i + 1);
+			double temp = weights[i];
+			weights[i] = weights[j];
+			weights[j] = temp;
+		}
+	}
+
+	//Cut the corpus at each running total, so the sizes add up exactly
+	double sum = 0, running = 0;
+	for (int i = 0; i < files; i++)
+		sum += weights[i];
+	long long previous = 0;
+	for (int i = 0; i < files; i++)
+	{
+		running += weights[i];
+		long long end = i == files - 1 ? total : (long long)(total * (running / sum));
+		sizes[i] = end - previous;
+		previous = end;
+	}
+
+	free(weights);
+	return true;
+}
+
+/*
+ * create_file
+ *
+ * Creates a file of the given size, to be filled in by the children.
+ *
+ * returns: False if an error occurs
+*/
+static bool create_file(const char* path, long long size)
+{
+	int fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+	if (fd == -1)
+		return false;
+	bool success = ftruncate(fd, size) == 0;
+	return close(fd) == 0 && success;
+}
+
+/*
+ * generate
+ *
+ * Generates a corpus and the configuration file listing it.
+ *
+ * files: Number of files
+ * total: Bytes in the corpus
+ * jobs:  Number of children generating it
+ * seed:  Seed of the corpus, the same seed gives the same files
+ *
+ * returns: False if an error occurs
+*/
+static bool generate(int files, long long total, int jobs, unsigned long long seed)
+{
+	unsigned long long state = mix_seed(seed);
+	long long* sizes = (long long*)malloc(files * sizeof(long long));
+	if (sizes == NULL || !file_sizes(sizes, files, total, &state))
+		return false;
+
+	//Cut each file into segments
+	segment_count = 0;
+	for (int f = 0; f < files; f++)
+		segment_count += (sizes[f] + GEN_SEGMENT_SIZE - 1) / GEN_SEGMENT_SIZE;
+	segments = (segment*)malloc((segment_count + 1) * sizeof(segment));
+	void* shared = mmap(NULL, sizeof(int) + (segment_count + 1) * sizeof(long long),
+		PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+	if (segments == NULL || shared == MAP_FAILED)
+	{
+		free(sizes);
+		free(segments);
+		return false;
+	}
+	expected_sizes = (long long*)shared;
+	next_segment = (int*)(expected_sizes + segment_count + 1);
+
+	int count = 0;
+	for (int f = 0; f < files; f++)
+	{
+		for (long long offset = 0; offset < sizes[f]; offset += GEN_SEGMENT_SIZE)
+		{
+			segment* s = segments + count;
+			s->file = f;
+			s->offset = offset;
+			s->size = sizes[f] - offset < GEN_SEGMENT_SIZE ? sizes[f] - offset : GEN_SEGMENT_SIZE;
+			s->expected_offset = 0;
+			s->seed = mix_seed(seed ^ ((unsigned long long)f << 32 | offset / GEN_SEGMENT_SIZE));
+			count++;
+		}
+	}
+
+	char path[MAX_LOCATION_LENGTH];
+	bool success = true;
+	for (int f = 0; f < files && success; f++)
+	{
+		file_path(path, f, "txt");
+		success = create_file(path, sizes[f]);
+	}
+
+	//The decryptions are only as long as the lines make them
+	if (success && expected)
+	{
+		success = run_workers(jobs, true);
+		long long offset = 0;
+		for (int i = 0; i < segment_count && success; i++)
+		{
+			if (i > 0 && segments[i].file != segments[i - 1].file)
+				offset = 0;
+			segments[i].expected_offset = offset;
+			offset += expected_sizes[i];
+		}
+		for (int f = 0, i = 0; f < files && success; f++)
+		{
+			long long size = 0;
+			for (; i < segment_count && segments[i].file == f; i++)
+				size += expected_sizes[i];
+			file_path(path, f, "expected");
+			success = create_file(path, size);
+		}
+	}
+
+	if (success)
+		success = run_workers(jobs, false);
+
+	if (success)
+	{
+		snprintf(path, sizeof(path), "%s/config.txt", directory);
+		FILE* config = fopen(path, "w");
+		success = config != NULL;
+		for (int f = 0; f < files && success; f++)
+			fprintf(config, "%s/gen.%i.txt %s/gen.%i.out\n", directory, f, directory, f);
+		if (config != NULL && fclose(config) != 0)
+			success = false;
+	}
+
+	munmap(shared, sizeof(int) + (segment_count + 1) * sizeof(long long));
+	free(segments);
+	free(sizes);
+	return success;
+}
+
+/*
+ * encrypt_file
+ *
+ * Encrypts a plaintext file line by line. Lines are encrypted in pieces
+ * that decrypt one fgets at a time, and the end of each piece is padded
+ * with spaces to a whole block.
+ *
+ * returns: False if an error occurs or the text cannot be encrypted
+*/
+static bool encrypt_file(const char* file_in, const char* file_out)
+{
+	FILE* in = fopen(file_in, "r");
+	FILE* out = fopen(file_out, "w");
+	if (in == NULL || out == NULL)
+	{
+		printf("Unable to open %s.\n", in == NULL ? file_in : file_out);
+		if (in != NULL)
+			fclose(in);
+		if (out != NULL)
+			fclose(out);
+		return false;
+	}
+
+	unsigned long long state = mix_seed(GEN_SEED);
+	char* line = NULL;
+	size_t capacity = 0;
+	ssize_t read;
+	int number = 0;
+	bool success = true;
+	while (success && (read = getline(&line, &capacity, in)) != -1)
+	{
+		number++;
+		if (read > 0 && line[read - 1] == '\n')
+			read--;
+
+		for (ssize_t i = 0; i < read && success; i += GEN_PIECE_TEXT)
+		{
+			char text[GEN_PIECE_TEXT];
+			unsigned int blocks[GEN_PIECE_BLOCKS];
+			char output[GEN_PIECE];
+			int length = read - i < GEN_PIECE_TEXT ? read - i : GEN_PIECE_TEXT;
+			int padded = (length + 5) / 6 * 6;
+			memcpy(text, line + i, length);
+			memset(text + length, ' ', padded - length);
+
+			for (int b = 0; b < padded / 6 && success; b++)
+			{
+				long long block = pack_text(text + b * 6);
+				if (block == -1 || block >= DECRYPT_KEY_N)
+				{
+					printf("Line %i of %s cannot be encrypted, \"%.6s\" %s.\n", number, file_in, text + b * 6,
+						block == -1 ? "has a character outside the alphabet" : "packs to a block above the modulus");
+					success = false;
+				}
+				else
+					blocks[b] = block;
+			}
+			encrypt_cached(blocks, padded / 6);
+
+			//Shortest encrypted length with that many characters left once
+			//every 8th one is skipped
+			int encrypted = padded + (padded - 1) / 7;
+			if (success)
+			{
+				spread_blocks(blocks, output, encrypted, &state);
+				fwrite(output, 1, encrypted, out);
+			}
+		}
+		fputc('\n', out);
+	}
+
+	free(line);
+	fclose(in);
+	if (fclose(out) != 0)
+		success = false;
+	return success;
+}
+
+/*
+ * parse_distribution
+ *
+ * returns: The distribution named, or -1 if it is not one of those allowed
+*/
+static int parse_distribution(const char* name, bool lines)
+{
+	if (strcmp(name, "uniform") == 0)
+		return DIST_UNIFORM;
+	if (strcmp(name, "zipf") == 0)
+		return DIST_ZIPF;
+	if (lines && strcmp(name, "fixed") == 0)
+		return DIST_FIXED;
+	if (!lines && strcmp(name, "giant") == 0)
+		return DIST_GIANT;
+	return -1;
+}
+
+/*
+ * parse_size
+ *
+ * returns: Bytes given with an optional K, M, G or T suffix, -1 if invalid
+*/
+static long long parse_size(const char* text)
+{
+	char* end;
+	long long size = strtoll(text, &end, 10);
+	const char* units = "KMGT";
+	const char* unit = *end == '\0' ? NULL : strchr(units, *end);
+	if (unit != NULL)
+	{
+		for (int i = 0; i <= unit - units; i++)
+			size *= 1024;
+		end++;
+	}
+	return *end == '\0' && size >= 0 ? size : -1;
+}
+
+int main(int argc, char* argv[])
+{
+	int files = 16;
+	long long total = 64LL << 20;
+	int jobs = get_nprocs();
+	unsigned long long seed = GEN_SEED;
+	const char* usage = "Usage: %s [-d uniform|zipf|giant] [-j Jobs] [-l uniform|zipf|fixed] "
+		"[-L Longest line] [-n Files] [-p] [-S Seed] [-s Bytes] [Directory]\n"
+		"       %s -e [Plaintext file] [Encrypted file]\n";
+
+	for (int i = 0; i < 256; i++)
+		values[i] = -1;
+	for (int i = 0; i < 41; i++)
+		values[(unsigned char)alphabet[i]] = i;
+	memset(cache_blocks, 0xFF, sizeof(cache_blocks)); //GEN_CACHE_EMPTY, above any block
+
+	int opt;
+	while ((opt = getopt(argc, argv, "d:ej:l:L:n:pS:s:")) != -1)
+	{
+		switch (opt)
+		{
+			case 'd': //Distribution of file sizes
+				file_distribution = parse_distribution(optarg, false);
+				if ((int)file_distribution == -1)
+				{
+					printf("Unknown distribution of file sizes %s.\n", optarg);
+					return EXIT_FAILURE;
+				}
+				break;
+			case 'e': //Encrypt a plaintext file
+				if (argc - optind != 2)
+				{
+					printf(usage, argv[0], argv[0]);
+					return EXIT_FAILURE;
+				}
+				return encrypt_file(argv[optind], argv[optind + 1]) ? EXIT_SUCCESS : EXIT_FAILURE;
+			case 'j': //Children generating the corpus
+				jobs = atoi(optarg);
+				break;
+			case 'l': //Distribution of line lengths
+				line_distribution = parse_distribution(optarg, true);
+				if ((int)line_distribution == -1)
+				{
+					printf("Unknown distribution of line lengths %s.\n", optarg);
+					return EXIT_FAILURE;
+				}
+				break;
+			case 'L': //Longest line, without its newline
+				longest = atoi(optarg);
+				break;
+			case 'n': //Number of files
+				files = atoi(optarg);
+				break;
+			case 'p': //Write the expected decryption of each file
+				expected = true;
+				break;
+			case 'S': //Seed
+				seed = strtoull(optarg, NULL, 0);
+				break;
+			case 's': //Bytes in the whole corpus
+				total = parse_size(optarg);
+				break;
+			default:
+				printf(usage, argv[0], argv[0]);
+				return EXIT_FAILURE;
+		}
+	}
+
+	if (argc - optind != 1 || files < 1 || jobs < 1 || longest < 1 || total < 0)
+	{
+		printf(usage, argv[0], argv[0]);
+		return EXIT_FAILURE;
+	}
+	directory = argv[optind];
+	if (mkdir(directory, 0755) == -1 && errno != EEXIST)
+	{
+		printf("Unable to create %s.\n", directory);
+		return EXIT_FAILURE;
+	}
+	zipf word_ranks;
+	if (!zipf_create(&word_ranks, WORD_COUNT) || !zipf_create(&line_ranks, longest))
+		return EXIT_FAILURE;
+	for (int i = 0; i < GEN_WORD_TABLE; i++)
+	{
+		unsigned long long point = (i * 2ULL + 1) << 31; //Middle of the entry
+		word_table[i] = zipf_rank(&word_ranks, point / GEN_WORD_TABLE);
+	}
+	free(word_ranks.cumulative);
+
+	struct timespec start, end;
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	bool success = generate(files, total, jobs, seed);
+	clock_gettime(CLOCK_MONOTONIC, &end);
+	free(line_ranks.cumulative);
+
+	if (!success)
+	{
+		printf("Unable to generate the corpus in %s.\n", directory);
+		return EXIT_FAILURE;
+	}
+	double seconds = (end.tv_sec - start.tv_sec) + (end.tv_nsec - start.tv_nsec) / 1e9;
+	printf("Generated %i files, %lld bytes in %.3f seconds (%.1f MB/s), listed in %s/config.txt\n",
+		files, total, seconds, total / seconds / 1e6, directory);
+	return EXIT_SUCCESS;
+}
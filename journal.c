@@ -0,0 +1,233 @@
+/*
+ * journal.c
+ *
+ * Append-only record of which configuration lines the server has sent out
+ * and which have been decrypted, so a restarted server can skip the files
+ * already done. Each record is a line of text: its kind, the id of the
+ * configuration line, then the configuration line itself.
+ *
+ * James Shephard
+ * CMPT 300 - D100 Burnaby
+ * Instructor Brian Booth
+ * TA Scott Kristjanson
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/types.h>
+#include <unistd.h>
+#include "common.h"
+#include "journal.h"
+#include "memwatch.h"
+
+static FILE* journal = NULL;
+//Records written since the journal was last flushed to disk
+static int unsynced = 0;
+
+//Text of every line decrypted before the restart, indexed by id, NULL if
+//not decrypted
+static char** finished = NULL;
+static unsigned int finished_count = 0;
+
+/*
+ * linelength
+ *
+ * returns: Length of a configuration line without its newline
+*/
+static int linelength(const char* line)
+{
+	return strcspn(line, "\n");
+}
+
+/*
+ * replay
+ *
+ * Reads the records in the journal, keeping the text of every line that was
+ * decrypted. A record cut short by a crash ends the journal, and is cut off
+ * so new records start on a line of their own.
+ *
+ * done:       Location to store the number of lines already decrypted
+ * unfinished: Location to store the number of lines sent but not decrypted
+ *
+ * returns: False if memory ran out
+*/
+static bool replay(int* done, int* unfinished)
+{
+	char record[MAX_CONFIG_FILE_LINE + 32];
+	//Lines sent but not yet decrypted, indexed by id
+	bool* sent = NULL;
+	long end = 0;
+
+	while (fgets(record, sizeof(record), journal) != NULL)
+	{
+		char type;
+		unsigned int id;
+		int offset = 0;
+		int length = strlen(record);
+		if (record[length - 1] != '\n' || sscanf(record, "%c %u %n", &type, &id, &offset) != 2 || 
+			offset == 0 || id == 0)
+			break;
+		end = ftell(journal);
+
+		if (id > finished_count)
+		{
+			unsigned int count = id > 2 * finished_count ? id : 2 * finished_count;
+			char** grown = (char**)realloc(finished, count * sizeof(char*));
+			bool* grown_sent = (bool*)realloc(sent, count * sizeof(bool));
+			if (grown != NULL)
+				finished = grown;
+			if (grown_sent != NULL)
+				sent = grown_sent;
+			if (grown == NULL || grown_sent == NULL)
+			{
+				free(sent);
+				return false;
+			}
+			for (unsigned int i = finished_count; i < count; i++)
+			{
+				finished[i] = NULL;
+				sent[i] = false;
+			}
+			finished_count = count;
+		}
+
+		record[length - 1] = '\0';
+		if (type == J_SENT)
+			sent[id - 1] = true;
+		else if (type == J_SUCCESS && finished[id - 1] == NULL)
+		{
+			finished[id - 1] = strdup(record + offset);
+			if (finished[id - 1] == NULL)
+			{
+				free(sent);
+				return false;
+			}
+		}
+	}
+
+	*done = 0;
+	*unfinished = 0;
+	for (unsigned int i = 0; i < finished_count; i++)
+	{
+		if (finished[i] != NULL)
+			(*done)++;
+		else if (sent[i])
+			(*unfinished)++;
+	}
+	free(sent);
+
+	fflush(journal);
+	ftruncate(fileno(journal), end);
+	fseek(journal, end, SEEK_SET);
+	return true;
+}
+
+/*
+ * journal_open
+ *
+ * Opens the journal. When resuming, the records already in it are replayed
+ * and new ones are added after them, otherwise it is started afresh.
+ *
+ * path:       Location of the journal
+ * resume:     True to replay the existing journal
+ * done:       Location to store the number of lines already decrypted
+ * unfinished: Location to store the number of lines sent but not decrypted
+ *
+ * returns: False if the journal could not be opened or read
+*/
+bool journal_open(char* path, bool resume, int* done, int* unfinished)
+{
+	*done = 0;
+	*unfinished = 0;
+
+	//Resuming without a journal simply starts from the beginning
+	journal = fopen(path, resume ? "r+" : "w");
+	if (journal == NULL && resume)
+		journal = fopen(path, "w");
+	if (journal == NULL)
+		return false;
+
+	if (resume && !replay(done, unfinished))
+	{
+		journal_close();
+		return false;
+	}
+	return true;
+}
+
+/*
+ * journal_completed
+ *
+ * Checks whether a line was decrypted before the server was restarted. A 
+ * record only counts if the line still has the same text, so an edited 
+ * configuration file never skips a changed line.
+ *
+ * id:   Id of the line
+ * line: Text of the line
+ *
+ * returns: True if the line can be skipped
+*/
+bool journal_completed(unsigned int id, const char* line)
+{
+	if (id == 0 || id > finished_count || finished[id - 1] == NULL)
+		return false;
+
+	int length = linelength(line);
+	return (int)strlen(finished[id - 1]) == length && strncmp(finished[id - 1], line, length) == 0;
+}
+
+/*
+ * journal_record
+ *
+ * Appends a record, flushing the journal to disk once a batch has built up.
+ *
+ * type: J_SENT, J_SUCCESS or J_ERROR
+ * id:   Id of the line
+ * line: Text of the line
+*/
+void journal_record(char type, unsigned int id, const char* line)
+{
+	if (journal == NULL)
+		return;
+
+	fprintf(journal, "%c %u %.*s\n", type, id, linelength(line), line);
+	if (++unsynced >= JOURNAL_BATCH)
+		journal_sync();
+}
+
+/*
+ * journal_sync
+ *
+ * Flushes any records not yet on disk.
+*/
+void journal_sync()
+{
+	if (journal == NULL || unsynced == 0)
+		return;
+
+	fflush(journal);
+	fdatasync(fileno(journal));
+	unsynced = 0;
+}
+
+/*
+ * journal_close
+ *
+ * Flushes and closes the journal.
+*/
+void journal_close()
+{
+	if (journal == NULL)
+		return;
+
+	journal_sync();
+	fclose(journal);
+	journal = NULL;
+
+	for (unsigned int i = 0; i < finished_count; i++)
+		free(finished[i]);
+	free(finished);
+	finished = NULL;
+	finished_count = 0;
+}
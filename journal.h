@@ -0,0 +1,81 @@
+/*
+ * journal.h
+ *
+ * Append-only record of which configuration lines the server has sent out
+ * and which have been decrypted, so a restarted server can skip the files
+ * already done.
+ *
+ * James Shephard
+ * CMPT 300 - D100 Burnaby
+ * Instructor Brian Booth
+ * TA Scott Kristjanson
+ */
+
+#ifndef _JOURNAL_H_
+#define _JOURNAL_H_
+
+#include <stdbool.h>
+
+//Records written between each flush to disk
+#define JOURNAL_BATCH 64
+
+//Kinds of record, each followed by the id and text of its line
+#define J_SENT    'D' //Given to a client
+#define J_SUCCESS 'S' //Decrypted
+#define J_ERROR   'E' //Failed, sent again when resuming
+
+/*
+ * journal_open
+ *
+ * Opens the journal. When resuming, the records already in it are replayed
+ * and new ones are added after them, otherwise it is started afresh.
+ *
+ * path:       Location of the journal
+ * resume:     True to replay the existing journal
+ * done:       Location to store the number of lines already decrypted
+ * unfinished: Location to store the number of lines sent but not decrypted
+ *
+ * returns: False if the journal could not be opened or read
+*/
+bool journal_open(char* path, bool resume, int* done, int* unfinished);
+
+/*
+ * journal_completed
+ *
+ * Checks whether a line was decrypted before the server was restarted. A 
+ * record only counts if the line still has the same text, so an edited 
+ * configuration file never skips a changed line.
+ *
+ * id:   Id of the line
+ * line: Text of the line
+ *
+ * returns: True if the line can be skipped
+*/
+bool journal_completed(unsigned int id, const char* line);
+
+/*
+ * journal_record
+ *
+ * Appends a record, flushing the journal to disk once a batch has built up.
+ *
+ * type: J_SENT, J_SUCCESS or J_ERROR
+ * id:   Id of the line
+ * line: Text of the line
+*/
+void journal_record(char type, unsigned int id, const char* line);
+
+/*
+ * journal_sync
+ *
+ * Flushes any records not yet on disk.
+*/
+void journal_sync();
+
+/*
+ * journal_close
+ *
+ * Flushes and closes the journal.
+*/
+void journal_close();
+
+#endif
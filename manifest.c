@@ -0,0 +1,297 @@
+/*
+ * manifest.c
+ *
+ * Records kept alongside each output file of the input it was decrypted 
+ * from, so a rerun can skip inputs that have not changed since. Each output
+ * has a one line file next to it, named after it with .manifest added.
+ *
+ * James Shephard
+ * CMPT 300 - D100 Burnaby
+ * Instructor Brian Booth
+ * TA Scott Kristjanson
+ */
+
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <unistd.h>
+#include "common.h"
+#include "manifest.h"
+#include "memwatch.h"
+
+#if defined(__x86_64__)
+#include <immintrin.h>
+#define MANIFEST_X86
+#endif
+
+//CRC32C polynomial, bit reversed
+#define CRC32C_POLYNOMIAL 0x82F63B78
+//Bytes of an input hashed per read
+#define HASH_CHUNK (1 << 16)
+
+//CRC32C of a byte followed by 0 to 7 zero bytes, for slice-by-8
+static unsigned int crc32c_tables[8][256];
+//Fills crc32c_tables the first time the table fallback is needed
+static pthread_once_t crc32c_tables_once = PTHREAD_ONCE_INIT;
+
+/*
+ * build_crc32c_tables
+ *
+ * Fills crc32c_tables. Run by pthread_once.
+*/
+static void build_crc32c_tables()
+{
+	for (unsigned int i = 0; i < 256; i++)
+	{
+		unsigned int entry = i;
+		for (int bit = 0; bit < 8; bit++)
+			entry = (entry >> 1) ^ (entry & 1 ? CRC32C_POLYNOMIAL : 0);
+		crc32c_tables[0][i] = entry;
+	}
+	for (int slice = 1; slice < 8; slice++)
+		for (unsigned int i = 0; i < 256; i++)
+		{
+			unsigned int previous = crc32c_tables[slice - 1][i];
+			crc32c_tables[slice][i] = (previous >> 8) ^ crc32c_tables[0][previous & 0xFF];
+		}
+}
+
+/*
+ * crc32c_table
+ *
+ * Adds bytes eight at a time with lookup tables (slice-by-8), for CPUs
+ * without the crc32 instruction.
+*/
+static unsigned int crc32c_table(unsigned int crc, const unsigned char* data, size_t length)
+{
+	pthread_once(&crc32c_tables_once, build_crc32c_tables);
+
+	for (; length >= 8; data += 8, length -= 8)
+	{
+		//Assembled byte by byte so the result does not depend on endianness
+		unsigned int low = crc ^ (data[0] | data[1] << 8 | data[2] << 16 | (unsigned int)data[3] << 24);
+		crc = crc32c_tables[7][low & 0xFF] ^ crc32c_tables[6][(low >> 8) & 0xFF]
+			^ crc32c_tables[5][(low >> 16) & 0xFF] ^ crc32c_tables[4][low >> 24]
+			^ crc32c_tables[3][data[4]] ^ crc32c_tables[2][data[5]]
+			^ crc32c_tables[1][data[6]] ^ crc32c_tables[0][data[7]];
+	}
+	for (; length > 0; data++, length--)
+		crc = (crc >> 8) ^ crc32c_tables[0][(crc ^ *data) & 0xFF];
+	return crc;
+}
+
+#ifdef MANIFEST_X86
+/*
+ * crc32c_sse42
+ *
+ * Adds bytes eight at a time with the SSE4.2 crc32 instruction.
+*/
+__attribute__((target("sse4.2")))
+static unsigned int crc32c_sse42(unsigned int crc, const unsigned char* data, size_t length)
+{
+	unsigned long long wide = crc;
+	for (; length >= 8; data += 8, length -= 8)
+	{
+		unsigned long long word;
+		memcpy(&word, data, 8);
+		wide = _mm_crc32_u64(wide, word);
+	}
+	crc = (unsigned int)wide;
+	for (; length > 0; data++, length--)
+		crc = _mm_crc32_u8(crc, *data);
+	return crc;
+}
+#endif
+
+/*
+ * crc32c
+ *
+ * Continues a CRC32C (Castagnoli) checksum over more data, using the SSE4.2
+ * instruction for it where the CPU has one.
+ *
+ * crc:    Checksum so far, 0 to start
+ * data:   Bytes to add
+ * length: Number of bytes
+ *
+ * returns: The checksum including data
+*/
+unsigned int crc32c(unsigned int crc, const void* data, size_t length)
+{
+	crc = ~crc;
+#ifdef MANIFEST_X86
+	if (__builtin_cpu_supports("sse4.2"))
+		crc = crc32c_sse42(crc, (const unsigned char*)data, length);
+	else
+#endif
+		crc = crc32c_table(crc, (const unsigned char*)data, length);
+	return ~crc;
+}
+
+/*
+ * hashfile
+ *
+ * Finds the CRC32C of a file's contents.
+ *
+ * path: File to hash
+ * hash: Location to store the hash
+ *
+ * returns: False if the file could not be read
+*/
+static bool hashfile(const char* path, unsigned int* hash)
+{
+	int fd = open(path, O_RDONLY);
+	if (fd == -1)
+		return false;
+	posix_fadvise(fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+
+	char buffer[HASH_CHUNK];
+	ssize_t nbytes;
+	*hash = 0;
+	while ((nbytes = read(fd, buffer, sizeof(buffer))) != 0)
+	{
+		if (nbytes < 0 && errno == EINTR)
+			continue;
+		if (nbytes < 0)
+		{
+			close(fd);
+			return false;
+		}
+		*hash = crc32c(*hash, buffer, nbytes);
+	}
+
+	close(fd);
+	return true;
+}
+
+/*
+ * manifestname
+ *
+ * Gives the location of the manifest for an output file.
+ *
+ * output: Output file
+ * path:   Location to store the path, holds MAX_LOCATION_LENGTH bytes
+*/
+static void manifestname(const char* output, char* path)
+{
+	snprintf(path, MAX_LOCATION_LENGTH, "%s.manifest", output);
+}
+
+/*
+ * manifest_check
+ *
+ * Checks whether an output file is up to date with its input. It is if the
+ * manifest alongside it matches the input's size and either its 
+ * modification time or the hash of its contents, and the output is still 
+ * the size it was written at. A manifest that does not match is removed, as
+ * the output is about to be rewritten.
+ *
+ * input:  Input file
+ * output: Output file
+ * entry:  Location to store the input's details, with its hash whenever 
+ *         the output is not up to date, for manifest_save once it is
+ * saving: True if entry will be passed to manifest_save. Otherwise the 
+ *         input is not hashed when there is no manifest to compare with.
+ *
+ * returns: True if the input need not be decrypted again
+*/
+bool manifest_check(const char* input, const char* output, manifest_entry* entry, bool saving)
+{
+	struct stat in;
+	entry->size = -1;
+	if (stat(input, &in) == -1)
+		return false;
+	entry->mtime = in.st_mtim.tv_sec * 1000000000LL + in.st_mtim.tv_nsec;
+
+	//Whatever is on record, if anything
+	char path[MAX_LOCATION_LENGTH];
+	manifestname(output, path);
+	manifest_entry recorded;
+	bool found = false;
+	FILE* manifest = fopen(path, "r");
+	if (manifest != NULL)
+	{
+		found = fscanf(manifest, "%lld %lld %x %lld", &recorded.size, &recorded.mtime, 
+			&recorded.hash, &recorded.output_size) == 4;
+		fclose(manifest);
+	}
+
+	struct stat out;
+	if (found && (recorded.size != in.st_size || stat(output, &out) == -1 || 
+		out.st_size != recorded.output_size))
+		found = false;
+
+	//An untouched input needs no hashing
+	if (found && recorded.mtime == entry->mtime)
+	{
+		*entry = recorded;
+		entry->size = in.st_size;
+		return true;
+	}
+
+	//Nothing to compare the hash with, and nobody to record it for
+	if (!found && !saving)
+	{
+		if (manifest != NULL)
+			unlink(path);
+		return false;
+	}
+
+	if (!hashfile(input, &entry->hash))
+		return false;
+	entry->size = in.st_size;
+
+	//Touched but not changed, record the new time so the next check is quick
+	if (found && recorded.hash == entry->hash)
+	{
+		entry->output_size = recorded.output_size;
+		manifest_save(output, entry);
+		return true;
+	}
+
+	if (manifest != NULL)
+		unlink(path);
+	return false;
+}
+
+/*
+ * manifest_save
+ *
+ * Writes the manifest alongside an output file just decrypted.
+ *
+ * output: Output file
+ * entry:  Details of its input, from manifest_check
+ *
+ * returns: False if the manifest could not be written
+*/
+bool manifest_save(const char* output, manifest_entry* entry)
+{
+	struct stat out;
+	if (entry->size < 0 || stat(output, &out) == -1)
+		return false;
+	entry->output_size = out.st_size;
+
+	//Written whole then renamed into place, so a crash never leaves half of
+	//one. The name is unique to the process, as two copies of a file can 
+	//finish at once.
+	char path[MAX_LOCATION_LENGTH];
+	char temporary[MAX_LOCATION_LENGTH + 32];
+	manifestname(output, path);
+	snprintf(temporary, sizeof(temporary), "%s.%i", path, getpid());
+
+	FILE* manifest = fopen(temporary, "w");
+	if (manifest == NULL)
+		return false;
+	bool written = fprintf(manifest, "%lld %lld %08x %lld\n", entry->size, entry->mtime, 
+		entry->hash, entry->output_size) > 0;
+	if (fclose(manifest) != 0 || !written || rename(temporary, path) == -1)
+	{
+		unlink(temporary);
+		return false;
+	}
+	return true;
+}
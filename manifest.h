@@ -0,0 +1,73 @@
+/*
+ * manifest.h
+ *
+ * Records kept alongside each output file of the input it was decrypted 
+ * from, so a rerun can skip inputs that have not changed since.
+ *
+ * James Shephard
+ * CMPT 300 - D100 Burnaby
+ * Instructor Brian Booth
+ * TA Scott Kristjanson
+ */
+
+#ifndef _MANIFEST_H_
+#define _MANIFEST_H_
+
+#include <stdbool.h>
+#include <stddef.h>
+
+//What an output file was decrypted from
+typedef struct {
+	long long size;        //Size of the input file, -1 if it could not be read
+	long long mtime;       //Modification time of the input, in nanoseconds
+	unsigned int hash;     //CRC32C of the input's contents
+	long long output_size; //Size of the output file it produced
+} manifest_entry;
+
+/*
+ * crc32c
+ *
+ * Continues a CRC32C (Castagnoli) checksum over more data, using the SSE4.2
+ * instruction for it where the CPU has one.
+ *
+ * crc:    Checksum so far, 0 to start
+ * data:   Bytes to add
+ * length: Number of bytes
+ *
+ * returns: The checksum including data
+*/
+unsigned int crc32c(unsigned int crc, const void* data, size_t length);
+
+/*
+ * manifest_check
+ *
+ * Checks whether an output file is up to date with its input. It is if the
+ * manifest alongside it matches the input's size and either its 
+ * modification time or the hash of its contents, and the output is still 
+ * the size it was written at. A manifest that does not match is removed, as
+ * the output is about to be rewritten.
+ *
+ * input:  Input file
+ * output: Output file
+ * entry:  Location to store the input's details, with its hash whenever 
+ *         the output is not up to date, for manifest_save once it is
+ * saving: True if entry will be passed to manifest_save. Otherwise the 
+ *         input is not hashed when there is no manifest to compare with.
+ *
+ * returns: True if the input need not be decrypted again
+*/
+bool manifest_check(const char* input, const char* output, manifest_entry* entry, bool saving);
+
+/*
+ * manifest_save
+ *
+ * Writes the manifest alongside an output file just decrypted.
+ *
+ * output: Output file
+ * entry:  Details of its input, from manifest_check
+ *
+ * returns: False if the manifest could not be written
+*/
+bool manifest_save(const char* output, manifest_entry* entry);
+
+#endif
@@ -12,40 +12,159 @@
 
 #include <arpa/inet.h>
 #include <errno.h>
+#include <getopt.h>
 #include <ifaddrs.h>
 #include <linux/if.h>
 #include <netinet/in.h>
+#include <signal.h>
 #include <stdbool.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <fcntl.h>
+#include <sys/epoll.h>
 #include <sys/ioctl.h>
+#include <sys/sendfile.h>
 #include <sys/socket.h>
+#include <sys/stat.h>
 #include <sys/time.h>
 #include <sys/types.h>
 #include <unistd.h>
 #include "common.h"
+#include "journal.h"
+#include "manifest.h"
+#include "stats.h"
 
 //The maximum number of clients that can connect
 #define MAX_CLIENTS 4096
+//Most events taken from epoll at once
+#define MAX_EVENTS 64
+//Event data for the server socket and stats endpoint, clients use their index
+#define LISTEN_EVENT MAX_CLIENTS
+#define STATS_EVENT (MAX_CLIENTS + 1)
+//Files taking this many times longer than expected are given to a second client
+#define SPECULATE_FACTOR 2
+//Files are never given to a second client sooner than this many seconds
+#define SPECULATE_MIN 1.0
+//Milliseconds between checks for slow files once every file has been sent
+#define SPECULATE_INTERVAL 100
+//Clients not heard from for this many seconds are treated as failed
+#define HEARTBEAT_TIMEOUT (5 * HEARTBEAT_INTERVAL)
+//Most bytes of a returned output moved with one splice
+#define RESULT_CHUNK (1 << 16)
+//Most bytes read from one client before the others get a turn
+#define READ_BUDGET (4 * RESULT_CHUNK)
+//Most files a client may ask to have queued with it, and most workers it
+//may claim
+#define MAX_CREDIT (MAX_CLIENTS * 1024)
 
 //Holds all important information about each client connected.
 typedef struct {
 	int sockfd;
 	int ready;
 	bool terminated;
+	int status; //Status code of the last message received
+	int workers; //Number of children decrypting
+	double heard; //When the client last sent anything
+	bool unread;  //Has more to read after using up its READ_BUDGET
 	char ip[16];
+	frame_buffer in;
+	//Lines to send along with their input files, oldest first. Never holds
+	//more than the credit the client has given.
+	unsigned int* ships;
+	int ship_count;
+	int ship_capacity;
+	int ship_fd;       //Input file being sent, -1 if none
+	off_t ship_offset; //Bytes of it sent so far
+	off_t ship_length;
+	//Output being sent back, written straight to its output file
+	unsigned int result_id;
+	int result_fd;               //Output file, -1 if the output is discarded
+	long long result_remaining;  //Bytes of it still to come
+	bool result_failed;          //The output file could not be written
+	bool result_discarded;       //Another copy's output was kept instead
+	//Counted for the stats endpoint
+	double connected;
+	int decrypted;
+	int failed;
+	long long bytes; //Input bytes of the lines decrypted
 } client;
 int c_current = 0;
+//Clients with unread set. Epoll will not report them again, so they are
+//read from without waiting.
+int unread_count = 0;
+//Sum of ready over every client
+int ready_total = 0;
 
 //Containts a list of all clients
 client clients[MAX_CLIENTS];
-//Used for reading/writing to clients
-char buffer[MAX_MESSAGE_LENGTH];
 FILE * config_file;
 FILE * log_file;
 //Server socket to accept clients from
 int sockfd;
+//Waits on the server socket and every client at once
+int epollfd;
+
+//Current line of the configuration file we are on
+int current_line = 1;
+//True to send the largest files first instead of in configuration file order
+bool lpt = false;
+//True to give slow files to a second client once every file has been sent
+bool speculate = false;
+//True to send clients the contents of input files rather than their names
+bool ship = false;
+//True to have clients send outputs back to be written here
+bool returning = false;
+//Moves returned outputs from sockets to files in the kernel
+int result_pipe[2];
+//True to skip lines whose output is up to date with their input
+bool incremental = false;
+//Lines whose output was decrypted, and found to be up to date already
+int decrypted_count = 0;
+int skipped_count = 0;
+//Lines that failed, and input bytes of those decrypted
+int failed_count = 0;
+long long decrypted_bytes = 0;
+//Listening socket of the stats endpoint, -1 if none
+int stats_fd = -1;
+
+//A line of the configuration file, kept until every client has exited
+typedef struct {
+	char* line;
+	long long size; //Size of the input file, 0 if it could not be read
+	double service; //Seconds a client spent decrypting it, -1 until known
+	double sent;    //When it was first given to a client
+	double latency; //Seconds from being sent to its result, -1 until known
+	int holders[2]; //Clients that have it and have yet to report on it
+	int copies;     //Number of holders
+	bool speculated; //Has been given to a second client for being slow
+	bool done;      //A result has been logged
+	int writer;     //Client writing its output back, -1 if none
+	manifest_entry manifest; //What the output is decrypted from, when incremental
+} config_line;
+
+//Every valid line read so far, the id of a line is its index plus one
+config_line* config_lines;
+int config_count = 0;
+int config_capacity = 0;
+//Lines sent that are not yet done
+int outstanding = 0;
+//Ids of lines taken back from failed clients, to be sent again
+unsigned int* retry;
+int retry_count = 0;
+int retry_capacity = 0;
+//Totals over lines whose service time is known, for estimating the others
+double service_total = 0;
+long long service_bytes = 0;
+int service_count = 0;
+//Indices of config_lines, largest input file first
+int* config_order;
+//Position in config_order of the next line to send
+int config_next = 0;
+
+//When the first file was sent out and the last result came back
+double first_dispatch = 0;
+double last_result = 0;
 
 /*
  * getipaddress
@@ -169,6 +288,23 @@ bool initialize(char* argv[])
 		return false;
 	}
 
+	//Accepting is drained until it would block, as epoll only reports
+	//new connections once
+	fcntl(sockfd, F_SETFL, fcntl(sockfd, F_GETFL) | O_NONBLOCK);
+	struct epoll_event event;
+	event.events = EPOLLIN | EPOLLET;
+	event.data.u32 = LISTEN_EVENT;
+	epollfd = epoll_create1(0);
+	if (epollfd == -1 || epoll_ctl(epollfd, EPOLL_CTL_ADD, sockfd, &event) == -1)
+	{
+		logmessage(NULL, "Unable to create epoll instance. Process ID #%i Exiting.", 
+			getpid());
+
+		fclose(config_file);
+		fclose(log_file);
+		return false;
+	}
+
 	logmessage(NULL, "lyrebird.server: PID %i on host %s, port %i", 
 			getpid(), inet_ntoa(cli_addr.sin_addr), ntohs(cli_addr.sin_port));
 
@@ -176,153 +312,821 @@ bool initialize(char* argv[])
 }
 
 /*
- * acceptclient
+ * acceptclients
  *
- * If a client is currently attempting to connect, accept and add to list of 
- * connected client structs.
+ * Accepts every client currently attempting to connect and adds them to list
+ * of connected client structs.
  *
  * returns: false if an error occurs
 */
-bool acceptclient()
+bool acceptclients()
 {
-	fd_set set;
-	struct timeval tv;
-	int val;
-
-	FD_ZERO(&set);
-	FD_SET(sockfd, &set);
-	tv.tv_sec = 0;
-	tv.tv_usec = 1000;
-	val = select(sockfd + 1, &set, NULL, NULL, &tv);
-
 	struct sockaddr_in cli_addr;
 	socklen_t clilen = sizeof(cli_addr);
 
-	if (val > 0)
+	while (true)
 	{
 		int clientfd = accept(sockfd, (struct sockaddr*) &cli_addr, &clilen);
 		if (clientfd < 0)
+		{
+			if (errno == EAGAIN || errno == EWOULDBLOCK)
+				return true; //No more waiting
+			if (errno == EINTR || errno == ECONNABORTED)
+				continue;
 			return false;
+		}
 
-		if (c_current + 1 == MAX_CLIENTS)
+		if (c_current == MAX_CLIENTS)
 		{
 			//Cannot accept any more clients
 			close(clientfd);
-			return true;
+			continue;
 		}
 
 		//Create a client struct
-		client c;
-		c.sockfd = clientfd;
-		c.ready = 0; //Client will tell how many are ready
-		c.terminated = false;
-		strcpy(c.ip, inet_ntoa(cli_addr.sin_addr));
-
-		clients[c_current++] = c;
+		client* c = clients + c_current;
+		c->sockfd = clientfd;
+		c->ready = 0; //Client will tell how many are ready
+		c->terminated = false;
+		c->status = 0;
+		c->workers = 0;
+		c->heard = getseconds();
+		c->in.start = 0;
+		c->in.length = 0;
+		c->ships = NULL;
+		c->ship_count = 0;
+		c->ship_capacity = 0;
+		c->ship_fd = -1;
+		c->result_fd = -1;
+		c->result_remaining = 0;
+		c->result_failed = false;
+		c->result_discarded = false;
+		c->unread = false;
+		c->connected = getseconds();
+		c->decrypted = 0;
+		c->failed = 0;
+		c->bytes = 0;
+		strcpy(c->ip, inet_ntoa(cli_addr.sin_addr));
+
+		//Reads are drained until they would block, as with accepting.
+		//Input files are sent until the socket is full, then resumed once
+		//it has room.
+		fcntl(clientfd, F_SETFL, fcntl(clientfd, F_GETFL) | O_NONBLOCK);
+		struct epoll_event event;
+		event.events = EPOLLIN | EPOLLOUT | EPOLLET;
+		event.data.u32 = c_current;
+		if (epoll_ctl(epollfd, EPOLL_CTL_ADD, clientfd, &event) == -1)
+		{
+			close(clientfd);
+			continue;
+		}
+		c_current++;
+		if (returning)
+			sendframe(clientfd, M_RETURN, 0, "", 0);
 
 		logmessage(log_file, "Successfully connected to lyrebird client %s.", 
 			inet_ntoa(cli_addr.sin_addr));
 	}
-	else if (val == -1)
-		return false; //Select failed
+}
+
+/*
+ * dropholder
+ *
+ * Removes a client from the holders of a line.
+ *
+ * c: Line to remove from
+ * i: index into clients array
+ *
+ * returns: False if the client did not hold the line
+*/
+bool dropholder(config_line* c, int i)
+{
+	if (c->holders[0] == i)
+		c->holders[0] = c->holders[1];
+	else if (c->holders[1] != i)
+		return false;
 
+	c->holders[1] = -1;
+	c->copies--;
 	return true;
 }
 
 /*
- * readmessage
+ * requeueline
  *
- * Reads and parses a message from a client.
+ * Puts a line no client holds any more back in line to be sent out again.
  *
- * i - index into clients array
+ * id: Id of the line
  *
- * returns:
- *          status code if no errors occur
- *          0 - Socket is closed
- *         -1 - Socket has crashed
+ * returns: False if there was no room, and the line is lost for good
 */
-int readmessage(int i)
+bool requeueline(unsigned int id)
 {
-	char status = 0;
+	if (retry_count == retry_capacity)
+	{
+		int capacity = retry_capacity == 0 ? 16 : 2 * retry_capacity;
+		unsigned int* grown = (unsigned int*)realloc(retry, capacity * sizeof(unsigned int));
+		if (grown == NULL)
+			return false;
+		retry = grown;
+		retry_capacity = capacity;
+	}
+	retry[retry_count++] = id;
+	outstanding--;
+	return true;
+}
 
-	//Read in status code
-	int nbytes = read(clients[i].sockfd, &status, 1);
-	if (nbytes < 0)
-		return -1; //Client crashed before finishing
-	else if (nbytes == 0)
-		return 0; //Socked closed
+/*
+ * handlemessage
+ *
+ * Acts on a message from a client.
+ *
+ * i:      index into clients array
+ * status: Status code of message
+ * id:     Task the message is about
+ * text:   Null-terminated text of message
+ *
+ * returns: False if the client sent something invalid and should be dropped
+*/
+bool handlemessage(int i, char status, unsigned int id, char* text)
+{
+	config_line* c = (id > 0 && id <= (unsigned int)config_count) ? config_lines + id - 1 : NULL;
 
-	nbytes = readnullstring(clients[i].sockfd, buffer, MAX_MESSAGE_LENGTH - 1);
-	if (nbytes < 0)
-		return -1; //Client crashed before finishing
-	else if (nbytes == 0)
-		return 0; //Socket closed
+	if (status == M_HEARTBEAT)
+		return true;
+
+	if ((status == M_SUCCESS || status == M_SKIPPED || status == M_ERROR || status == M_CANCEL) && c != NULL)
+	{
+		dropholder(c, i);
+		//The first success wins. A failure waits on any other copy, which
+		//may yet succeed, and anything after the winner is discarded.
+		if (c->done || status == M_CANCEL || (status == M_ERROR && c->copies > 0))
+		{
+			status = M_CANCEL;
+			//The copy that was waited on was dropped too, so the line 
+			//starts over
+			if (!c->done && c->copies == 0 && requeueline(id))
+				logmessage(log_file, "No copy of %s is left, it will be given to another client.", 
+					c->line);
+		}
+		else
+		{
+			c->done = true;
+			outstanding--;
+			last_result = getseconds();
+			c->latency = last_result - c->sent;
+			journal_record(status == M_ERROR ? J_ERROR : J_SUCCESS, id, c->line);
+			if (status == M_SUCCESS)
+			{
+				decrypted_count++;
+				decrypted_bytes += c->size;
+				clients[i].decrypted++;
+				clients[i].bytes += c->size;
+			}
+			else if (status == M_SKIPPED)
+				skipped_count++;
+			else
+			{
+				failed_count++;
+				clients[i].failed++;
+			}
+
+			//Outputs sent back were written here, so their manifests are too
+			char output_file[MAX_LOCATION_LENGTH];
+			sscanf(c->line, "%*s %s", output_file);
+			if (status == M_SUCCESS && returning && incremental && !manifest_save(output_file, &c->manifest))
+				logmessage(log_file, "Unable to write the manifest for %s.", output_file);
+
+			//Anyone else with a copy can drop it if they have not started.
+			//Nothing can be sent in the middle of a file, and any still
+			//waiting to be sent are skipped.
+			for (int j = 0; j < c->copies; j++)
+				if (!clients[c->holders[j]].terminated && clients[c->holders[j]].ship_fd == -1)
+					sendframe(clients[c->holders[j]].sockfd, M_CANCEL, id, "", 0);
+		}
+	}
 
-	
 	if (status == M_SUCCESS)
 		logmessage(log_file, "The lyrebird client %s has successfully decrypted %s.",
-			clients[i].ip, buffer);
+			clients[i].ip, text);
+	else if (status == M_SKIPPED)
+		logmessage(log_file, "The lyrebird client %s found the output of %s already up to date.",
+			clients[i].ip, text);
 	else if (status == M_ERROR)
 		logmessage(log_file, "The lyrebird client %s has encountered an error: %s",
-			clients[i].ip, buffer);
+			clients[i].ip, text);
+
+	if (status == M_TIMING)
+	{
+		//Only the first copy to finish counts
+		if (c != NULL && c->service < 0)
+		{
+			c->service = atof(text);
+			service_total += c->service;
+			service_bytes += c->size;
+			service_count++;
+		}
+		return true;
+	}
+
 	//Also: M_READY, simply for informing server of how many clients are available.
-	clients[i].ready++;
+	int credit = 1;
+	//Client will queue this many files before any results come back
+	if (status == M_CREDIT && sscanf(text, "%i %i", &credit, &clients[i].workers) < 2)
+		clients[i].workers = credit;
+	if (status == M_CREDIT && (credit < 1 || credit > MAX_CREDIT - clients[i].ready ||
+		credit > MAX_CREDIT - clients[i].ship_capacity ||
+		clients[i].workers < 1 || clients[i].workers > MAX_CREDIT))
+	{
+		//Anything else would overflow the count of ready clients or the
+		//room for lines waiting to be shipped
+		logmessage(log_file, "The lyrebird client %s asked for an invalid credit of %.32s.",
+			clients[i].ip, text);
+		clients[i].workers = 0;
+		return false;
+	}
+	if (status == M_CREDIT && ship)
+	{
+		//Room for every line the client can be given to wait its turn
+		int capacity = clients[i].ship_capacity + credit;
+		unsigned int* grown = (unsigned int*)realloc(clients[i].ships, capacity * sizeof(unsigned int));
+		if (grown == NULL)
+		{
+			logmessage(log_file, "Memory allocation failed, the lyrebird client %s will be given no more files.",
+				clients[i].ip);
+			return true;
+		}
+		clients[i].ships = grown;
+		clients[i].ship_capacity = capacity;
+	}
+	clients[i].ready += credit;
+	ready_total += credit;
+	clients[i].status = status;
+	return true;
+}
 
-	return status;
+/*
+ * finishresult
+ *
+ * Closes the output file once a client has sent back the whole output.
+ *
+ * i: index into clients array
+*/
+void finishresult(int i)
+{
+	if (clients[i].result_fd != -1)
+	{
+		close(clients[i].result_fd);
+		config_lines[clients[i].result_id - 1].writer = -1;
+	}
+	clients[i].result_fd = -1;
 }
 
 /*
- * updateclients
+ * resultfailed
  *
- * Read any incoming messages from clients, updating the number of available 
- * children in each, outputting any messages received.
+ * Gives up on writing an output file, so the line is reported as failed 
+ * when its result arrives. The rest of the output is discarded.
  *
- * returns: false if an error has occurred
+ * i: index into clients array
 */
-bool updateclients()
+void resultfailed(int i)
 {
-	fd_set set;
-	struct timeval tv;
-	int val;
-	//Loop until every awaiting message has been received.
-	bool update = true;
-	while (update)
-	{
-		update = false;
-		FD_ZERO(&set);
-
-		int maxfd = 0;
-		//Select all current clients
-		for (int i = 0; i < c_current; i++)
+	char output_file[MAX_LOCATION_LENGTH];
+	sscanf(config_lines[clients[i].result_id - 1].line, "%*s %s", output_file);
+	logmessage(log_file, "Unable to write %s returned by the lyrebird client %s.", 
+		output_file, clients[i].ip);
+	finishresult(i);
+	clients[i].result_failed = true;
+}
+
+/*
+ * startresult
+ *
+ * Opens the output file for an output a client is about to send back. The
+ * output is discarded if another copy of its line has already finished or
+ * is still being written.
+ *
+ * i: index into clients array
+ * f: The M_RESULT message that precedes the output
+ *
+ * returns: False if the message is malformed
+*/
+bool startresult(int i, frame* f)
+{
+	client* c = clients + i;
+	if (f->id == 0 || f->id > (unsigned int)config_count ||
+		sscanf(f->payload, "%lld", &c->result_remaining) != 1 || c->result_remaining < 0)
+		return false;
+
+	config_line* line = config_lines + f->id - 1;
+	c->result_id = f->id;
+	c->result_failed = false;
+	c->result_discarded = false;
+	c->result_fd = -1;
+	//A speculative copy arriving while the other is still being written 
+	//would truncate it, so only one is kept
+	if (!line->done && line->writer == -1)
+	{
+		char output_file[MAX_LOCATION_LENGTH];
+		sscanf(line->line, "%*s %s", output_file);
+		c->result_fd = open(output_file, O_WRONLY | O_CREAT | O_TRUNC, 0666);
+		if (c->result_fd == -1)
+			resultfailed(i);
+		else
+			line->writer = i;
+	}
+	else
+		c->result_discarded = true;
+
+	if (c->result_remaining == 0)
+		finishresult(i);
+	return true;
+}
+
+/*
+ * resultbytes
+ *
+ * Writes bytes of the output being sent back to its output file.
+ *
+ * i:      index into clients array
+ * data:   Bytes to write
+ * length: Number of bytes
+*/
+void resultbytes(int i, char* data, long long length)
+{
+	client* c = clients + i;
+	if (c->result_fd != -1 && !writeall(c->result_fd, data, length))
+		resultfailed(i);
+	c->result_remaining -= length;
+	if (c->result_remaining == 0)
+		finishresult(i);
+}
+
+/*
+ * receiveresult
+ *
+ * Moves as much of the output being sent back as has arrived from the 
+ * socket into its output file, without copying it through user space. Bytes
+ * are never held here, only taken off the socket once there is somewhere to 
+ * write them, so a client sending faster than the disk keeps up is held 
+ * back by its socket filling.
+ *
+ * i: index into clients array
+ *
+ * returns: 
+ *         Number of bytes received if no error occurs
+ *          0 - the socket has closed
+ *         -1 - receiving failed or would block, see errno
+*/
+int receiveresult(int i)
+{
+	client* c = clients + i;
+	long long max = c->result_remaining < RESULT_CHUNK ? c->result_remaining : RESULT_CHUNK;
+	ssize_t nbytes = -1;
+
+	if (c->result_fd != -1)
+	{
+		do
+			nbytes = splice(c->sockfd, NULL, result_pipe[1], NULL, max, 
+				SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+		while (nbytes < 0 && errno == EINTR);
+		if (nbytes < 0 && (errno == EAGAIN || errno == EWOULDBLOCK))
+			return -1;
+	}
+
+	if (nbytes < 0)
+	{
+		//Nowhere to put it or splice is unsupported, copy it instead
+		char buffer[RESULT_CHUNK];
+		do
+			nbytes = read(c->sockfd, buffer, max);
+		while (nbytes < 0 && errno == EINTR);
+		if (nbytes > 0)
+			resultbytes(i, buffer, nbytes);
+		return nbytes;
+	}
+	if (nbytes == 0)
+		return 0;
+
+	//The pipe holds RESULT_CHUNK bytes, so this never waits on the socket
+	ssize_t moved = 0;
+	while (moved < nbytes)
+	{
+		ssize_t n = splice(result_pipe[0], NULL, c->result_fd, NULL, nbytes - moved, SPLICE_F_MOVE);
+		if (n < 0 && errno == EINTR)
+			continue;
+		if (n <= 0)
 		{
-			FD_SET(clients[i].sockfd, &set);
-			maxfd = clients[i].sockfd > maxfd ? clients[i].sockfd : maxfd;
+			//Drain what is left so the pipe is empty for the next output
+			char discard[RESULT_CHUNK];
+			read(result_pipe[0], discard, nbytes - moved);
+			resultfailed(i);
+			break;
 		}
-		tv.tv_sec = 0;
-		tv.tv_usec = 1000;
-		val = select(maxfd + 1, &set, NULL, NULL, &tv);
+		moved += n;
+	}
+	c->result_remaining -= nbytes;
+	if (c->result_remaining == 0)
+		finishresult(i);
+	return nbytes;
+}
 
-		if (val == -1)
-			return false;
-		else if (val == 0)
-			return true; //No awaiting messages
+/*
+ * readmessages
+ *
+ * Reads everything a client has sent, handling each whole message. Any
+ * partial message is kept until the rest arrives. A client sending more 
+ * than READ_BUDGET bytes is left unread for the rest, so one sending back a
+ * large output cannot hold up the others until they miss their heartbeats.
+ *
+ * i - index into clients array
+ *
+ * returns:
+ *          1 - No errors occurred
+ *          0 - Socket is closed
+ *         -1 - Socket has crashed or sent a malformed message
+*/
+int readmessages(int i)
+{
+	client* c = clients + i;
+	frame f;
+	long long taken = 0;
+	c->heard = getseconds();
+	if (c->unread)
+	{
+		c->unread = false;
+		unread_count--;
+	}
+	while (true)
+	{
+		if (taken >= READ_BUDGET)
+		{
+			//Picked up again once every other client has had a turn
+			c->unread = true;
+			unread_count++;
+			return 1;
+		}
 
-		for (int i = 0; i < c_current; i++)
+		//An output being sent back is read straight off the socket once 
+		//nothing before it is left in the buffer
+		int nbytes = (c->result_remaining > 0 && c->in.length == 0) ? 
+			receiveresult(i) : readframes(c->sockfd, &c->in);
+		if (nbytes < 0)
+			return (errno == EAGAIN || errno == EWOULDBLOCK) ? 1 : -1;
+		else if (nbytes == 0)
+			return 0; //Socket closed
+		taken += nbytes;
+
+		int result;
+		while (true)
+		{
+			if (c->result_remaining > 0)
+			{
+				//Start of the output arrived along with the message before it
+				long long length = c->in.length < c->result_remaining ? 
+					c->in.length : c->result_remaining;
+				resultbytes(i, c->in.data + c->in.start, length);
+				c->in.start += length;
+				c->in.length -= length;
+				if (c->result_remaining > 0)
+				{
+					result = 0;
+					break;
+				}
+			}
+
+			if ((result = nextframe(&c->in, &f)) <= 0)
+				break;
+			if (f.type == M_RESULT)
+			{
+				if (!startresult(i, &f))
+				{
+					result = -1;
+					break;
+				}
+			}
+			else if (f.type == M_SUCCESS && c->result_failed && f.id == c->result_id)
+			{
+				//Decrypted, but the output never made it to disk
+				char error[MAX_MESSAGE_LENGTH];
+				snprintf(error, sizeof(error), "Unable to write the output of %.2048s", f.payload);
+				c->result_failed = false;
+				handlemessage(i, M_ERROR, f.id, error);
+			}
+			else if (f.type == M_SUCCESS && c->result_discarded && f.id == c->result_id)
+			{
+				//This copy was discarded, so only the copy that was kept, if
+				//it is still around, can decide
+				c->result_discarded = false;
+				handlemessage(i, M_CANCEL, f.id, f.payload);
+			}
+			else if (!handlemessage(i, f.type, f.id, f.payload))
+			{
+				result = -1;
+				break;
+			}
+		}
+		if (result < 0)
+			return -1;
+	}
+}
+
+/*
+ * dropclient
+ *
+ * Disconnects a client. Outside of closing, any lines it had that no other
+ * client is working on are queued to be sent again.
+ *
+ * i:        index into clients array
+ * expected: True if the client exited properly
+*/
+void dropclient(int i, bool expected)
+{
+	//Closing the socket removes it from epoll as well
+	close(clients[i].sockfd);
+	clients[i].terminated = true;
+	if (clients[i].unread)
+		unread_count--;
+	clients[i].unread = false;
+	ready_total -= clients[i].ready;
+	clients[i].ready = 0;
+	if (clients[i].ship_fd != -1)
+		close(clients[i].ship_fd);
+	clients[i].ship_fd = -1;
+	clients[i].ship_count = 0;
+	finishresult(i);
+	clients[i].result_remaining = 0;
+
+	if (expected)
+	{
+		logmessage(log_file, "The lyrebird client %s has disconnected expectedly.",
+			clients[i].ip);
+		return;
+	}
+
+	int lost = 0;
+	for (int j = 0; j < config_count; j++)
+	{
+		config_line* c = config_lines + j;
+		if (!dropholder(c, i) || c->done || c->copies > 0)
+			continue;
+
+		//One lost for good does not stop the rest from finishing
+		if (requeueline(j + 1))
+			lost++;
+	}
+
+	logmessage(log_file, "The lyrebird client %s has disconnected unexpectedly. %i of its files will be given to other clients.",
+		clients[i].ip, lost);
+}
+
+/*
+ * checkheartbeats
+ *
+ * Drops clients that have not been heard from in HEARTBEAT_TIMEOUT seconds.
+ * Clients send a heartbeat every HEARTBEAT_INTERVAL seconds, even when busy.
+*/
+void checkheartbeats()
+{
+	double now = getseconds();
+	for (int i = 0; i < c_current; i++)
+	{
+		if (clients[i].terminated || now - clients[i].heard < HEARTBEAT_TIMEOUT)
+			continue;
+
+		logmessage(log_file, "The lyrebird client %s has not been heard from in %.0f seconds.",
+			clients[i].ip, now - clients[i].heard);
+		dropclient(i, false);
+	}
+}
+
+/*
+ * shipfiles
+ *
+ * Sends a client the lines waiting for it along with the contents of their
+ * input files, until done or the socket is full. Each file follows an 
+ * M_DATA message giving its length and line, and is sent straight from the
+ * page cache.
+ *
+ * i: index into clients array
+*/
+void shipfiles(int i)
+{
+	client* c = clients + i;
+	while (!c->terminated)
+	{
+		while (c->ship_fd != -1 && c->ship_offset < c->ship_length)
 		{
-			if (!FD_ISSET(clients[i].sockfd, &set))
+			ssize_t nbytes = sendfile(c->sockfd, c->ship_fd, &c->ship_offset, 
+				c->ship_length - c->ship_offset);
+			if (nbytes == 0)
+			{
+				//The file shrank after its length was sent. Pad it out, so the
+				//client finds invalid characters rather than losing its place.
+				static const char padding[4096];
+				off_t left = c->ship_length - c->ship_offset;
+				nbytes = write(c->sockfd, padding, left < 4096 ? left : 4096);
+				if (nbytes > 0)
+					c->ship_offset += nbytes;
+			}
+			if (nbytes < 0 && errno == EINTR)
 				continue;
+			if (nbytes < 0 && (errno == EAGAIN || errno == EWOULDBLOCK))
+				return; //Picked up again when the socket has room
+			if (nbytes < 0)
+			{
+				dropclient(i, false);
+				return;
+			}
+		}
+		if (c->ship_fd != -1)
+			close(c->ship_fd);
+		c->ship_fd = -1;
+
+		if (c->ship_count == 0)
+			return;
+		unsigned int id = c->ships[0];
+		memmove(c->ships, c->ships + 1, --c->ship_count * sizeof(unsigned int));
+
+		config_line* line = config_lines + id - 1;
+		if (line->done)
+		{
+			//Another client finished it while it waited, hand back the credit
+			dropholder(line, i);
+			c->ready++;
+			ready_total++;
+			continue;
+		}
+
+		char input_file[MAX_LOCATION_LENGTH];
+		sscanf(line->line, "%s", input_file);
+		struct stat st;
+		int fd = open(input_file, O_RDONLY);
+		if (fd == -1 || fstat(fd, &st) == -1)
+		{
+			//The client may still be able to open it itself, or will report it
+			if (fd != -1)
+				close(fd);
+			sendframe(c->sockfd, M_LINE, id, line->line, strlen(line->line));
+			continue;
+		}
+
+		char payload[MAX_CONFIG_FILE_LINE + 32];
+		int length = snprintf(payload, sizeof(payload), "%lld %s", (long long)st.st_size, line->line);
+		posix_fadvise(fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+		c->ship_fd = fd;
+		c->ship_offset = 0;
+		c->ship_length = st.st_size;
+		sendframe(c->sockfd, M_DATA, id, payload, length);
+	}
+}
+
+/*
+ * shipping
+ *
+ * returns: True if any client is still being sent input files
+*/
+bool shipping()
+{
+	for (int i = 0; i < c_current; i++)
+		if (!clients[i].terminated && (clients[i].ship_fd != -1 || clients[i].ship_count > 0))
+			return true;
+	return false;
+}
+
+/*
+ * serverstats
+ *
+ * Describes the lines and each client's share of them for the stats 
+ * endpoint.
+ *
+ * text: Text to append the metrics to
+*/
+void serverstats(stats_text* text)
+{
+	//Lines read that no client has, whether new or taken back
+	int queued = 0;
+	for (int j = 0; j < config_count; j++)
+		if (!config_lines[j].done && config_lines[j].copies == 0)
+			queued++;
+
+	stats_metric(text, "lyrebird_server_tasks_queued", "gauge", "Lines read and waiting to be sent to a client.");
+	stats_printf(text, "lyrebird_server_tasks_queued %i\n", queued);
+	stats_metric(text, "lyrebird_server_tasks_in_flight", "gauge", "Lines sent to clients and not yet done.");
+	stats_printf(text, "lyrebird_server_tasks_in_flight %i\n", outstanding);
+	stats_metric(text, "lyrebird_server_tasks_completed_total", "counter", "Lines decrypted.");
+	stats_printf(text, "lyrebird_server_tasks_completed_total %i\n", decrypted_count);
+	stats_metric(text, "lyrebird_server_tasks_skipped_total", "counter", "Lines whose output was already up to date.");
+	stats_printf(text, "lyrebird_server_tasks_skipped_total %i\n", skipped_count);
+	stats_metric(text, "lyrebird_server_tasks_failed_total", "counter", "Lines that failed.");
+	stats_printf(text, "lyrebird_server_tasks_failed_total %i\n", failed_count);
+	stats_metric(text, "lyrebird_server_bytes_decrypted_total", "counter", "Input bytes of the lines decrypted.");
+	stats_printf(text, "lyrebird_server_bytes_decrypted_total %lld\n", decrypted_bytes);
+	stats_metric(text, "lyrebird_server_clients", "gauge", "Clients connected.");
+	int connected = 0;
+	for (int i = 0; i < c_current; i++)
+		if (!clients[i].terminated)
+			connected++;
+	stats_printf(text, "lyrebird_server_clients %i\n", connected);
+
+	//Clients that have left are kept, their totals still count
+	double now = getseconds();
+	stats_metric(text, "lyrebird_server_client_tasks_completed_total", "counter", "Lines decrypted by each client.");
+	for (int i = 0; i < c_current; i++)
+		stats_printf(text, "lyrebird_server_client_tasks_completed_total{client=\"%i\",ip=\"%s\"} %i\n", 
+			i, clients[i].ip, clients[i].decrypted);
+	stats_metric(text, "lyrebird_server_client_tasks_failed_total", "counter", "Lines failed by each client.");
+	for (int i = 0; i < c_current; i++)
+		stats_printf(text, "lyrebird_server_client_tasks_failed_total{client=\"%i\",ip=\"%s\"} %i\n", 
+			i, clients[i].ip, clients[i].failed);
+	stats_metric(text, "lyrebird_server_client_bytes_decrypted_total", "counter", 
+		"Input bytes of the lines decrypted by each client.");
+	for (int i = 0; i < c_current; i++)
+		stats_printf(text, "lyrebird_server_client_bytes_decrypted_total{client=\"%i\",ip=\"%s\"} %lld\n", 
+			i, clients[i].ip, clients[i].bytes);
+	stats_metric(text, "lyrebird_server_client_throughput_bytes_per_second", "gauge", 
+		"Input bytes decrypted by each client per second since it connected.");
+	for (int i = 0; i < c_current; i++)
+	{
+		double elapsed = now - clients[i].connected;
+		stats_printf(text, "lyrebird_server_client_throughput_bytes_per_second{client=\"%i\",ip=\"%s\"} %.1f\n", 
+			i, clients[i].ip, elapsed > 0 ? clients[i].bytes / elapsed : 0);
+	}
+}
 
-			// Read message from the client
-			int status = readmessage(i);
-			update = true;
-			if (status <= 0)
+/*
+ * readclient
+ *
+ * Reads messages from a client, dropping it if its socket has closed or 
+ * failed.
+ *
+ * i:       index into clients array
+ * closing: True if clients closing their sockets is expected
+*/
+void readclient(int i, bool closing)
+{
+	int result = readmessages(i);
+	if (clients[i].terminated || result > 0)
+		return;
+
+	//Last message should be M_EXIT if client exited properly
+	dropclient(i, closing && result == 0 && clients[i].status == M_EXIT);
+}
+
+/*
+ * waitevents
+ *
+ * Waits until a client connects or sends something, then deals with it.
+ * Clients left with more to read are read from without waiting.
+ *
+ * closing: True if clients closing their sockets is expected
+ * timeout: Milliseconds to wait, -1 to wait indefinitely
+ *
+ * returns: false if an error has occurred
+*/
+bool waitevents(bool closing, int timeout)
+{
+	struct epoll_event events[MAX_EVENTS];
+	//Logs are written before sleeping, so they are never held for long
+	log_flush();
+	if (unread_count > 0)
+		timeout = 0;
+	int count = epoll_wait(epollfd, events, MAX_EVENTS, timeout);
+	if (count == -1)
+		return errno == EINTR;
+
+	for (int e = 0; e < count; e++)
+	{
+		int i = events[e].data.u32;
+		if (i == STATS_EVENT)
+		{
+			stats_serve(stats_fd, serverstats);
+			continue;
+		}
+		if (i == LISTEN_EVENT)
+		{
+			if (!acceptclients())
 			{
-				logmessage(log_file, "The lyrebird client %s has disconnected unexpectedly.", clients[i].ip);
-				clients[i].terminated = true;
+				logmessage(NULL, "Failed to accept client. Process ID#%i Exiting.", getpid());
 				return false;
 			}
+			continue;
 		}
+
+		if (clients[i].terminated)
+			continue;
+
+		if (events[e].events & EPOLLOUT)
+			shipfiles(i);
+
+		readclient(i, closing);
 	}
+
+	//Those with more to read take their next turn, after the clients above
+	for (int i = 0; i < c_current && unread_count > 0; i++)
+		if (clients[i].unread && !clients[i].terminated)
+			readclient(i, closing);
 	return true;
 }
 
@@ -334,7 +1138,7 @@ bool updateclients()
 */
 void closeclients()
 {
-	//Ensure clients disconnect properly
+	int remaining = 0;
 	for (int i = 0; i < c_current; i++)
 	{
 		if (clients[i].terminated)
@@ -342,47 +1146,472 @@ void closeclients()
 
 		//Send exit message to client
 		sendmessage(clients[i].sockfd, M_EXIT, "");
+		remaining++;
+	}
 
-		int status = 0; //Status code of last message received
-		while (true)
+	//Clients finish up at the same time, so wait on all of them at once
+	while (remaining > 0)
+	{
+		if (!waitevents(true, -1))
+			break;
+
+		remaining = 0;
+		for (int i = 0; i < c_current; i++)
+			if (!clients[i].terminated)
+				remaining++;
+	}
+
+	for (int i = 0; i < c_current; i++)
+	{
+		if (clients[i].terminated)
+			continue;
+		logmessage(log_file, "The lyrebird client %s has disconnected unexpectedly.",
+			clients[i].ip);
+		close(clients[i].sockfd);
+	}
+}
+
+/*
+ * comparesizes
+ *
+ * qsort comparison putting the largest input files first, in configuration
+ * file order when equal.
+*/
+int comparesizes(const void* a, const void* b)
+{
+	int i = *(const int*)a;
+	int j = *(const int*)b;
+	if (config_lines[i].size != config_lines[j].size)
+		return config_lines[i].size < config_lines[j].size ? 1 : -1;
+	return i - j;
+}
+
+/*
+ * readline
+ *
+ * Reads the next valid line of the configuration file, skipping and logging
+ * invalid ones.
+ *
+ * line:        Location to store line
+ * input_file:  Location to store the input file named by the line
+ * id:          Location to store the id of the line
+ * config_name: Name of the configuration file, for log messages
+ *
+ * returns: False once the end of the file is reached
+*/
+bool readline(char* line, char* input_file, unsigned int* id, char* config_name)
+{
+	char output_file[MAX_LOCATION_LENGTH];
+
+	while (fgets(line, MAX_CONFIG_FILE_LINE, config_file) != NULL)
+	{
+		if (sscanf(line, "%s %s", input_file, output_file) != 2)
 		{
-			//Keep track of the last status sent
-			//Last message should be M_EXIT if client exited properly
-			int new_status = readmessage(i);
-			if (new_status < 0)
+			if (line[0] != '\n')
 			{
-				//Socket crashed, thus an unexpected disconnect
-				status = -1;
-				break;
+				//Invalid line, skip.
+				logmessage(log_file, "Failed to read line %i in %s, skipping. Process ID #%i.", 
+					current_line, config_name, getpid());
 			}
-			else if (new_status == 0)
-				break; //Socket closed
-
-			status = new_status;
 		}
+		else
+		{
+			*id = current_line++;
+			return true;
+		}
+	}
+	return false;
+}
 
-		if (status == M_EXIT)
-			logmessage(log_file, "The lyrebird client %s has disconnected expectedly.",
-				clients[i].ip);
+/*
+ * addline
+ *
+ * Keeps a line of the configuration file, along with the size of its input
+ * file, until every client has exited.
+ *
+ * line:       Line to keep
+ * input_file: Input file named by the line
+ *
+ * returns: False if memory ran out
+*/
+bool addline(char* line, char* input_file)
+{
+	if (config_count == config_capacity)
+	{
+		int capacity = config_capacity == 0 ? 64 : 2 * config_capacity;
+		config_line* grown = (config_line*)realloc(config_lines, capacity * sizeof(config_line));
+		if (grown == NULL)
+			return false;
+		config_lines = grown;
+		config_capacity = capacity;
+	}
+
+	config_line* c = config_lines + config_count;
+	c->line = strdup(line);
+	if (c->line == NULL)
+		return false;
+	config_count++;
+
+	//Unreadable files still go out, so the client can report the error
+	struct stat st;
+	c->size = stat(input_file, &st) == 0 ? st.st_size : 0;
+	c->service = -1;
+	c->copies = 0;
+	c->holders[0] = c->holders[1] = -1;
+	c->speculated = false;
+	c->writer = -1;
+	c->latency = -1;
+	c->done = false;
+	return true;
+}
+
+/*
+ * nextline
+ *
+ * Retrieves the next valid line to send to a client.
+ *
+ * line:        Location to store line
+ * input_file:  Location to store the input file named by the line
+ * id:          Location to store the id of the line
+ * config_name: Name of the configuration file, for log messages
+ *
+ * returns: False once every line has been sent
+*/
+bool nextline(char* line, char* input_file, unsigned int* id, char* config_name)
+{
+	//Lines from failed clients go first, they have already waited
+	if (retry_count > 0)
+	{
+		*id = retry[--retry_count];
+		strcpy(line, config_lines[*id - 1].line);
+		sscanf(line, "%s", input_file);
+		return true;
+	}
+
+	while (true)
+	{
+		if (!lpt)
+		{
+			if (!readline(line, input_file, id, config_name))
+				return false;
+			if (!addline(line, input_file))
+			{
+				logmessage(log_file, "Memory allocation failed, no more files will be sent. Process ID #%i.", 
+					getpid());
+				return false;
+			}
+		}
 		else
-			logmessage(log_file, "The lyrebird client %s has disconnected unexpectedly.",
-				clients[i].ip);
+		{
+			if (config_next == config_count)
+				return false;
+			*id = config_order[config_next++] + 1;
+			strcpy(line, config_lines[*id - 1].line);
+			sscanf(line, "%s", input_file);
+		}
 
-		close(clients[i].sockfd);
+		config_line* c = config_lines + *id - 1;
+		if (journal_completed(*id, line))
+		{
+			//Decrypted before the server was restarted
+			c->done = true;
+			logmessage(log_file, "%s was decrypted before the server restarted, skipping.", input_file);
+			continue;
+		}
+
+		char output_file[MAX_LOCATION_LENGTH];
+		sscanf(line, "%*s %s", output_file);
+		if (!incremental || !manifest_check(input_file, output_file, &c->manifest, returning))
+			return true;
+
+		c->done = true;
+		skipped_count++;
+		logmessage(log_file, "The output of %s is already up to date, skipping.", input_file);
+	}
+}
+
+/*
+ * readconfig
+ *
+ * Reads every line of the configuration file and finds the size of each 
+ * input file, so they can be sent largest first.
+ *
+ * config_name: Name of the configuration file, for log messages
+ *
+ * returns: False if memory ran out
+*/
+bool readconfig(char* config_name)
+{
+	char line[MAX_CONFIG_FILE_LINE];
+	char input_file[MAX_LOCATION_LENGTH];
+	unsigned int id;
+	long long total = 0;
+
+	while (readline(line, input_file, &id, config_name))
+	{
+		if (!addline(line, input_file))
+			return false;
+		total += config_lines[config_count - 1].size;
+	}
+
+	config_order = (int*)malloc((config_count + 1) * sizeof(int));
+	if (config_order == NULL)
+		return false;
+	for (int i = 0; i < config_count; i++)
+		config_order[i] = i;
+	qsort(config_order, config_count, sizeof(int), comparesizes);
+
+	logmessage(log_file, "Scheduling %i files totalling %lld bytes, largest first (%lld bytes).", 
+		config_count, total, config_count > 0 ? config_lines[config_order[0]].size : 0);
+	return true;
+}
+
+/*
+ * sendline
+ *
+ * Gives a line of the configuration file to a client that is ready for it.
+ *
+ * i:  index into clients array
+ * id: Id of the line
+*/
+void sendline(int i, unsigned int id)
+{
+	config_line* c = config_lines + id - 1;
+	char input_file[MAX_LOCATION_LENGTH];
+	sscanf(c->line, "%s", input_file);
+
+	clients[i].ready--;
+	ready_total--;
+	if (c->copies == 0)
+	{
+		c->sent = getseconds();
+		outstanding++;
+	}
+	c->holders[c->copies++] = i;
+	if (first_dispatch == 0)
+		first_dispatch = c->sent;
+	journal_record(J_SENT, id, c->line);
+
+	logmessage(log_file, "The lyrebird client %s has been given the task of decrypting %s.",
+		clients[i].ip, input_file);
+	if (!ship)
+	{
+		sendframe(clients[i].sockfd, M_LINE, id, c->line, strlen(c->line));
+		return;
+	}
+
+	//Waits its turn behind any file already being sent
+	clients[i].ships[clients[i].ship_count++] = id;
+	shipfiles(i);
+}
+
+/*
+ * speculatelines
+ *
+ * Gives lines that are taking much longer than expected to a second, ready
+ * client, slowest first. Expected times come from the average time per byte,
+ * or per file when sizes are unknown, of the lines finished so far.
+*/
+void speculatelines()
+{
+	if (service_count == 0)
+		return; //Nothing to go on yet
+
+	double now = getseconds();
+	while (ready_total > 0)
+	{
+		//Find the line furthest past its expected time
+		int slowest = -1;
+		double worst = SPECULATE_FACTOR;
+		for (int j = 0; j < config_count; j++)
+		{
+			config_line* c = config_lines + j;
+			if (c->done || c->copies != 1 || c->speculated)
+				continue;
+
+			double expected = service_total / service_count;
+			if (c->size > 0 && service_bytes > 0)
+				expected = c->size * (service_total / service_bytes);
+			double elapsed = now - c->sent;
+			if (elapsed < SPECULATE_MIN)
+				continue;
+			if (elapsed > worst * expected)
+			{
+				worst = elapsed / expected;
+				slowest = j;
+			}
+		}
+		if (slowest < 0)
+			return;
+
+		//Any ready client other than the one already on it
+		int i = 0;
+		while (i < c_current && (clients[i].ready <= 0 || clients[i].terminated || 
+			i == config_lines[slowest].holders[0]))
+			i++;
+		if (i == c_current)
+			return;
+
+		logmessage(log_file, "Line %i has taken %.1f times longer than expected, sending it to a second client.", 
+			slowest + 1, worst);
+		config_lines[slowest].speculated = true;
+		sendline(i, slowest + 1);
+	}
+}
+
+/*
+ * reportmakespan
+ *
+ * Logs how long decrypting every file took, and how long it should have 
+ * taken with the files given out largest first to every child at once. The
+ * prediction charges each file the average time per byte the clients 
+ * reported.
+*/
+void reportmakespan()
+{
+	int workers = 0;
+	for (int i = 0; i < c_current; i++)
+		workers += clients[i].workers;
+
+	double service = 0;
+	long long bytes = 0;
+	for (int i = 0; i < config_count; i++)
+	{
+		if (config_lines[i].service < 0)
+			continue;
+		service += config_lines[i].service;
+		bytes += config_lines[i].size;
+	}
+
+	double* finish = (double*)calloc(workers, sizeof(double));
+	if (workers == 0 || bytes == 0 || finish == NULL)
+	{
+		free(finish);
+		return;
+	}
+
+	//Each file goes to whichever child would be free first
+	double predicted = 0;
+	for (int i = 0; i < config_count; i++)
+	{
+		int earliest = 0;
+		for (int j = 1; j < workers; j++)
+			if (finish[j] < finish[earliest])
+				earliest = j;
+
+		finish[earliest] += config_lines[config_order[i]].size * (service / bytes);
+		if (finish[earliest] > predicted)
+			predicted = finish[earliest];
+	}
+	free(finish);
+
+	logmessage(log_file, "Makespan: predicted %.3f seconds on %i children, actual %.3f seconds.", 
+		predicted, workers, last_result - first_dispatch);
+}
+
+/*
+ * comparelatencies
+ *
+ * qsort comparison putting the shortest latencies first.
+*/
+int comparelatencies(const void* a, const void* b)
+{
+	double x = *(const double*)a;
+	double y = *(const double*)b;
+	return (x > y) - (x < y);
+}
+
+/*
+ * reportlatency
+ *
+ * Logs the throughput of the whole run and the median and 99th percentile
+ * time from a file being sent to its result arriving.
+*/
+void reportlatency()
+{
+	double* latencies = (double*)malloc(config_count * sizeof(double));
+	if (latencies == NULL)
+		return;
+
+	//Nearest rank percentiles
+	int count = 0;
+	for (int i = 0; i < config_count; i++)
+		if (config_lines[i].latency >= 0)
+			latencies[count++] = config_lines[i].latency;
+
+	if (count > 0)
+	{
+		qsort(latencies, count, sizeof(double), comparelatencies);
+		double elapsed = last_result - first_dispatch;
+		logmessage(log_file, "%i files in %.3f seconds (%.1f files/s), latency p50 %.3f seconds, p99 %.3f seconds.", 
+			count, elapsed, elapsed > 0 ? count / elapsed : 0, 
+			latencies[(50 * count + 99) / 100 - 1], latencies[(99 * count + 99) / 100 - 1]);
 	}
+	free(latencies);
 }
 
 int main(int argc, char* argv[])
 {
 	//Stores the current line read
 	char line[MAX_CONFIG_FILE_LINE];
-	//For ensuring the line is valid
+	//For logging which file the line is for
 	char input_file[MAX_LOCATION_LENGTH];
-	char output_file[MAX_LOCATION_LENGTH];
-	//Current line of the configuration file we are on
-	int current_line = 1;
 	//Keeps track if we're currently awaiting a client to decrypt a file
 	bool line_waiting = false;
+	//Identifies the waiting line in the client's result
+	unsigned int line_id = 0;
+	//When clients were last checked for heartbeats
+	double last_check = getseconds();
+	//True to skip the lines the journal shows were already decrypted
+	bool resume = false;
+	//Port of the stats endpoint, -1 for none
+	long stats_port = -1;
+	char* endptr;
+
+	//Parse the optional flags, which come before the configuration file
+	int opt;
+	struct option long_options[] = {
+		{"resume", no_argument, NULL, 'R'},
+		{NULL, 0, NULL, 0}
+	};
+	while ((opt = getopt_long(argc, argv, "dilm:rx", long_options, NULL)) != -1)
+	{
+		switch (opt)
+		{
+			case 'm': //Port of the stats endpoint
+				stats_port = strtol(optarg, &endptr, 10);
+				if (*endptr != '\0' || stats_port < 0 || stats_port > 65535)
+				{
+					logmessage(NULL, "'%s' is not a valid stats port. Process ID #%i Exiting.", 
+						optarg, getpid());
+					return EXIT_FAILURE;
+				}
+				break;
+			case 'R': //Carry on from the journal of an earlier run
+				resume = true;
+				break;
+			case 'd': //Send file contents to clients
+				ship = true;
+				break;
+			case 'i': //Skip files whose output is up to date
+				incremental = true;
+				break;
+			case 'r': //Clients send outputs back to be written here
+				returning = true;
+				break;
+			case 'x': //Speculative re-execution of slow files
+				speculate = true;
+				break;
+			case 'l': //Longest processing time first
+				lpt = true;
+				break;
+			default:
+				return EXIT_FAILURE;
+		}
+	}
+	//Leave the configuration and log files at argv[1] and argv[2]
+	argc -= optind - 1;
+	argv += optind - 1;
 
 	if (argc < 3)
 	{
@@ -394,46 +1623,87 @@ int main(int argc, char* argv[])
 	if (!initialize(argv))
 		return EXIT_FAILURE;
 
-	while (true)
+	//A client can fail between being chosen and being written to, which 
+	//must not take the server down with it
+	signal(SIGPIPE, SIG_IGN);
+
+	if (stats_port >= 0)
 	{
-		if (!acceptclient())
-		{
-			logmessage(NULL, "Failed to accept client. Process ID#%i Exiting.", getpid());
-			break; //Select or accept has failed.
-		}
+		//Accepting is drained as with clients connecting
+		struct epoll_event event;
+		event.events = EPOLLIN | EPOLLET;
+		event.data.u32 = STATS_EVENT;
+		stats_fd = stats_listen(stats_port);
+		if (stats_fd == -1 || epoll_ctl(epollfd, EPOLL_CTL_ADD, stats_fd, &event) == -1)
+			logmessage(log_file, "Unable to open the stats endpoint. Process ID #%i will continue without it.", 
+				getpid());
+	}
 
-		if (!line_waiting) //Only update if we aren't waiting for an available client
-		{
-			//Read in the next line
-			while (fgets(line, MAX_CONFIG_FILE_LINE, config_file) != NULL)
-			{
-				if (sscanf(line, "%s %s", input_file, output_file) != 2)
-				{
-					if (line[0] != '\n')
-					{
-						//Invalid line, skip.
-						logmessage(log_file, "Failed to read line %i in %s, skipping. Process ID #%i.", 
-							current_line, argv[1], getpid());
-					}
-				}
-				else
-				{
-					//Line has been successfully read, now wait for line to be sent to a client
-					line_waiting = true;
-					current_line++;
-					break;
-				}
-			}
-		}
+	if (returning && pipe(result_pipe) == -1)
+	{
+		logmessage(NULL, "Unable to create pipe. Process ID #%i Exiting.", getpid());
+		return EXIT_FAILURE;
+	}
+	if (returning)
+		fcntl(result_pipe[0], F_SETPIPE_SZ, RESULT_CHUNK);
+
+	//Kept next to the configuration file, so the same command resumes it
+	char journal_name[MAX_LOCATION_LENGTH];
+	int done, unfinished;
+	snprintf(journal_name, sizeof(journal_name), "%s.journal", argv[1]);
+	if (!journal_open(journal_name, resume, &done, &unfinished))
+		logmessage(log_file, "Unable to open journal %s, progress will not be kept. Process ID #%i.", 
+			journal_name, getpid());
+	else if (resume)
+		logmessage(log_file, "Resuming from %s: %i files were already decrypted, %i that were in progress will be sent again.", 
+			journal_name, done, unfinished);
+
+	if (lpt && !readconfig(argv[1]))
+	{
+		logmessage(NULL, "Memory allocation failed reading %s. Process ID #%i Exiting.", 
+			argv[1], getpid());
+		return EXIT_FAILURE;
+	}
 
-		//No line read, EOF reached
+	while (true)
+	{
+		//Only update if we aren't waiting for an available client. Once a
+		//line has been read, wait for it to be sent to a client
 		if (!line_waiting)
+			line_waiting = nextline(line, input_file, &line_id, argv[1]);
+
+		//No line read, EOF reached. Lines still out may come back if their
+		//client fails, and slow ones can be sent to idle clients, so wait
+		//until every line is done.
+		if (!line_waiting && outstanding == 0 && (!ship || !shipping()))
 			break;
 
-		//Update child readiness
-		if (!updateclients())
+		//Take in any messages, sleeping until a client is ready if none are
+		int timeout = HEARTBEAT_INTERVAL * 1000;
+		if (line_waiting && ready_total > 0)
+			timeout = 0;
+		else if (!line_waiting && speculate)
+			timeout = SPECULATE_INTERVAL;
+		if (!waitevents(false, timeout))
 			break;
 
+		if (getseconds() - last_check >= HEARTBEAT_INTERVAL)
+		{
+			//Bounds how much is redone after a crash when results are slow
+			journal_sync();
+			checkheartbeats();
+			last_check = getseconds();
+		}
+
+		if (!line_waiting)
+		{
+			if (speculate)
+				speculatelines();
+			continue;
+		}
+		if (ready_total == 0)
+			continue;
+
 		//Attempt to send a client a file to decrypt
 		for (int i = 0; i < c_current; i++)
 		{
@@ -442,15 +1712,7 @@ int main(int argc, char* argv[])
 				continue;
 
 			line_waiting = false;
-			clients[i].ready--;
-			
-			//Ensure the line has a null-terminating character
-			line[strlen(line) + 1] = 0;
-
-			sendmessage(clients[i].sockfd, M_LINE, line);
-			logmessage(log_file, "The lyrebird client %s has been given the task of decrypting %s.",
-				clients[i].ip, input_file);
-
+			sendline(i, line_id);
 			break;
 		}
 	}
@@ -458,8 +1720,32 @@ int main(int argc, char* argv[])
 	//Tell clients to terminate and read any remaining messages
 	closeclients();
 
+	journal_close();
+	if (incremental || skipped_count > 0)
+		logmessage(log_file, "%i files were decrypted and %i skipped as already up to date.", 
+			decrypted_count, skipped_count);
+	if (lpt)
+		reportmakespan();
+	reportlatency();
+	for (int i = 0; i < config_count; i++)
+		free(config_lines[i].line);
+	free(config_lines);
+	free(config_order);
+	free(retry);
+	for (int i = 0; i < c_current; i++)
+		free(clients[i].ships);
+
+	if (returning)
+	{
+		close(result_pipe[0]);
+		close(result_pipe[1]);
+	}
+	close(epollfd);
 	close(sockfd);
+	if (stats_fd != -1)
+		close(stats_fd);
 	fclose(config_file);
+	log_flush();
 	fclose(log_file);
 
 	logmessage(NULL, "lyrebird server: PID %i completed its tasks and is exiting successfully.", getpid());
@@ -0,0 +1,284 @@
+/*
+ * stats.c
+ *
+ * Counters describing a running job, and the local endpoint they are read
+ * from in the Prometheus text format. Each child or thread counts into its
+ * own slot of a shared mapping, and the slots are only summed when the
+ * endpoint is read.
+ *
+ * James Shephard
+ * CMPT 300 - D100 Burnaby
+ * Instructor Brian Booth
+ * TA Scott Kristjanson
+ */
+
+#include <arpa/inet.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <netinet/in.h>
+#include <poll.h>
+#include <stdarg.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <unistd.h>
+#include "common.h"
+#include "stats.h"
+#include "memwatch.h"
+
+//Milliseconds a connection is given to send its request
+#define STATS_REQUEST_WAIT 100
+//Bytes a response starts with room for
+#define STATS_TEXT_CAPACITY 4096
+
+__thread stats_slot* stats_own = NULL;
+
+static stats_slot* slots = NULL;
+static int slot_count = 0;
+
+/*
+ * sendall
+ *
+ * Sends a whole buffer on a connection. A scraper that hangs up early must
+ * not raise SIGPIPE, which would end the process.
+ *
+ * returns: False if an error occurs
+*/
+static bool sendall(int fd, const char* buffer, size_t length)
+{
+	while (length > 0)
+	{
+		ssize_t sent = send(fd, buffer, length, MSG_NOSIGNAL);
+		if (sent < 0)
+		{
+			if (errno == EINTR)
+				continue;
+			return false;
+		}
+		buffer += sent;
+		length -= sent;
+	}
+	return true;
+}
+
+/*
+ * stats_create
+ *
+ * Creates the slots. They are shared with any children forked afterwards.
+ *
+ * count: Number of slots
+ *
+ * returns: False if they could not be created
+*/
+bool stats_create(int count)
+{
+	//Anonymous mappings start zeroed
+	void* memory = mmap(NULL, count * sizeof(stats_slot), PROT_READ | PROT_WRITE,
+		MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+	if (memory == MAP_FAILED)
+		return false;
+
+	slots = (stats_slot*)memory;
+	slot_count = count;
+	return true;
+}
+
+/*
+ * stats_use
+ *
+ * Makes a slot the calling thread's own, for STATS_ADD. Does nothing if the
+ * slots were not created.
+ *
+ * index: Index of the slot
+*/
+void stats_use(int index)
+{
+	if (slots != NULL && index >= 0 && index < slot_count)
+		stats_own = slots + index;
+}
+
+/*
+ * stats_read
+ *
+ * Copies a slot, or sums every slot.
+ *
+ * index: Index of the slot, -1 for the total of all of them
+ * slot:  Location to store the counters
+ *
+ * returns: False if the slots were not created
+*/
+bool stats_read(int index, stats_slot* slot)
+{
+	memset(slot, 0, sizeof(stats_slot));
+	if (slots == NULL)
+		return false;
+
+	int first = index < 0 ? 0 : index;
+	int last = index < 0 ? slot_count : index + 1;
+	for (int i = first; i < last; i++)
+	{
+		stats_slot* s = slots + i;
+		slot->received += __atomic_load_n(&s->received, __ATOMIC_RELAXED);
+		slot->cancelled += __atomic_load_n(&s->cancelled, __ATOMIC_RELAXED);
+		slot->started += __atomic_load_n(&s->started, __ATOMIC_RELAXED);
+		slot->completed += __atomic_load_n(&s->completed, __ATOMIC_RELAXED);
+		slot->skipped += __atomic_load_n(&s->skipped, __ATOMIC_RELAXED);
+		slot->failed += __atomic_load_n(&s->failed, __ATOMIC_RELAXED);
+		slot->bytes += __atomic_load_n(&s->bytes, __ATOMIC_RELAXED);
+		slot->tweets += __atomic_load_n(&s->tweets, __ATOMIC_RELAXED);
+		slot->blocks += __atomic_load_n(&s->blocks, __ATOMIC_RELAXED);
+		slot->waited += __atomic_load_n(&s->waited, __ATOMIC_RELAXED);
+		slot->wait_us += __atomic_load_n(&s->wait_us, __ATOMIC_RELAXED);
+	}
+	return true;
+}
+
+/*
+ * stats_listen
+ *
+ * Opens the endpoint on the loopback address.
+ *
+ * port: Port to listen on, 0 for any free port
+ *
+ * returns: Non-blocking listening socket, or -1 if an error occurs. The
+ *          port chosen is logged.
+*/
+int stats_listen(int port)
+{
+	int fd = socket(AF_INET, SOCK_STREAM, 0);
+	if (fd == -1)
+		return -1;
+
+	int reuse = 1;
+	setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &reuse, sizeof(reuse));
+
+	struct sockaddr_in addr;
+	socklen_t length = sizeof(addr);
+	memset(&addr, 0, sizeof(addr));
+	addr.sin_family = AF_INET;
+	addr.sin_port = htons(port);
+	addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+	if (bind(fd, (struct sockaddr*)&addr, sizeof(addr)) == -1 || listen(fd, 5) == -1 ||
+		getsockname(fd, (struct sockaddr*)&addr, &length) == -1)
+	{
+		close(fd);
+		return -1;
+	}
+
+	fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK);
+	logmessage(NULL, "Process ID #%i serving stats on %s, port %i",
+		getpid(), inet_ntoa(addr.sin_addr), ntohs(addr.sin_port));
+	return fd;
+}
+
+/*
+ * stats_printf
+ *
+ * Appends to the text of a response.
+ *
+ * text:        Text to append to
+ * format, ...: See printf
+*/
+void stats_printf(stats_text* text, const char* format, ...)
+{
+	while (!text->failed)
+	{
+		va_list vl;
+		va_start(vl, format);
+		int length = vsnprintf(text->data + text->length, text->capacity - text->length, format, vl);
+		va_end(vl);
+		if (length < 0)
+			return;
+		if (text->length + length < text->capacity)
+		{
+			text->length += length;
+			return;
+		}
+
+		//Did not fit, grow and format it again
+		size_t capacity = 2 * text->capacity + length;
+		char* data = (char*)realloc(text->data, capacity);
+		if (data == NULL)
+			text->failed = true;
+		else
+		{
+			text->data = data;
+			text->capacity = capacity;
+		}
+	}
+}
+
+/*
+ * stats_metric
+ *
+ * Appends the help and type lines that come before a metric's samples.
+ *
+ * text: Text to append to
+ * name: Name of the metric
+ * type: counter or gauge
+ * help: Description of the metric
+*/
+void stats_metric(stats_text* text, const char* name, const char* type, const char* help)
+{
+	stats_printf(text, "# HELP %s %s\n# TYPE %s %s\n", name, help, name, type);
+}
+
+/*
+ * stats_serve
+ *
+ * Answers every connection waiting on the endpoint with the current
+ * metrics. Whatever request was sent is ignored, each gets the same reply.
+ *
+ * fd:       Listening socket from stats_listen
+ * describe: Appends the metrics to the text of the reply
+*/
+void stats_serve(int fd, void (*describe)(stats_text*))
+{
+	while (true)
+	{
+		int connection = accept(fd, NULL, NULL);
+		if (connection == -1)
+		{
+			if (errno == EINTR || errno == ECONNABORTED)
+				continue;
+			return; //Nothing left waiting
+		}
+
+		//Read the request first, closing with it unread would reset the
+		//connection before the reply arrives
+		char request[2048];
+		struct pollfd waiting = {connection, POLLIN, 0};
+		if (poll(&waiting, 1, STATS_REQUEST_WAIT) > 0)
+			read(connection, request, sizeof(request));
+
+		stats_text text;
+		text.length = 0;
+		text.capacity = STATS_TEXT_CAPACITY;
+		text.failed = false;
+		text.data = (char*)malloc(text.capacity);
+		if (text.data == NULL)
+		{
+			close(connection);
+			continue;
+		}
+		text.data[0] = '\0';
+		describe(&text);
+
+		char header[256];
+		int length;
+		if (text.failed)
+			length = snprintf(header, sizeof(header), "HTTP/1.0 500 Internal Server Error\r\n"
+				"Content-Length: 0\r\nConnection: close\r\n\r\n");
+		else
+			length = snprintf(header, sizeof(header), "HTTP/1.0 200 OK\r\n"
+				"Content-Type: text/plain; version=0.0.4\r\nContent-Length: %zu\r\n"
+				"Connection: close\r\n\r\n", text.length);
+		if (sendall(connection, header, length) && !text.failed)
+			sendall(connection, text.data, text.length);
+
+		free(text.data);
+		close(connection);
+	}
+}
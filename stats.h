@@ -0,0 +1,132 @@
+/*
+ * stats.h
+ *
+ * Counters describing a running job, and the local endpoint they are read
+ * from in the Prometheus text format.
+ *
+ * James Shephard
+ * CMPT 300 - D100 Burnaby
+ * Instructor Brian Booth
+ * TA Scott Kristjanson
+ */
+
+#ifndef _STATS_H_
+#define _STATS_H_
+
+#include <stdbool.h>
+#include <stddef.h>
+
+//Counters kept by one child, worker thread or the client's network thread.
+//Only ever written by their owner and only summed when the endpoint is read,
+//so nothing is shared while decrypting. Each starts on its own cache line.
+typedef struct {
+	unsigned long long received;  //Tasks queued, network thread only
+	unsigned long long cancelled; //Tasks dropped from the queue, network thread only
+	unsigned long long started;
+	unsigned long long completed;
+	unsigned long long skipped;   //Output was already up to date
+	unsigned long long failed;
+	unsigned long long bytes;     //Encrypted bytes decrypted
+	unsigned long long tweets;
+	unsigned long long blocks;
+	unsigned long long waited;    //Tasks taken off a queue
+	unsigned long long wait_us;   //Microseconds those tasks spent queued
+} __attribute__((aligned(64))) stats_slot;
+
+//Slot of the calling thread, NULL when counters are not kept
+extern __thread stats_slot* stats_own;
+
+//Adds to a counter of the calling thread's slot. Its owner is the only
+//writer, so a relaxed store is enough for readers to see whole values.
+#define STATS_ADD(field, n) do { \
+		if (stats_own != NULL) \
+			__atomic_store_n(&stats_own->field, stats_own->field + (n), __ATOMIC_RELAXED); \
+	} while (0)
+
+//Text of a response from the endpoint, grown as it is written
+typedef struct {
+	char* data;
+	size_t length;
+	size_t capacity;
+	bool failed; //Memory ran out, the text is incomplete
+} stats_text;
+
+/*
+ * stats_create
+ *
+ * Creates the slots. They are shared with any children forked afterwards.
+ *
+ * count: Number of slots
+ *
+ * returns: False if they could not be created
+*/
+bool stats_create(int count);
+
+/*
+ * stats_use
+ *
+ * Makes a slot the calling thread's own, for STATS_ADD. Does nothing if the
+ * slots were not created.
+ *
+ * index: Index of the slot
+*/
+void stats_use(int index);
+
+/*
+ * stats_read
+ *
+ * Copies a slot, or sums every slot.
+ *
+ * index: Index of the slot, -1 for the total of all of them
+ * slot:  Location to store the counters
+ *
+ * returns: False if the slots were not created
+*/
+bool stats_read(int index, stats_slot* slot);
+
+/*
+ * stats_listen
+ *
+ * Opens the endpoint on the loopback address.
+ *
+ * port: Port to listen on, 0 for any free port
+ *
+ * returns: Non-blocking listening socket, or -1 if an error occurs. The
+ *          port chosen is logged.
+*/
+int stats_listen(int port);
+
+/*
+ * stats_printf
+ *
+ * Appends to the text of a response.
+ *
+ * text:        Text to append to
+ * format, ...: See printf
+*/
+void stats_printf(stats_text* text, const char* format, ...);
+
+/*
+ * stats_metric
+ *
+ * Appends the help and type lines that come before a metric's samples.
+ *
+ * text: Text to append to
+ * name: Name of the metric
+ * type: counter or gauge
+ * help: Description of the metric
+*/
+void stats_metric(stats_text* text, const char* name, const char* type, const char* help);
+
+/*
+ * stats_serve
+ *
+ * Answers every connection waiting on the endpoint with the current
+ * metrics. Whatever request was sent is ignored, each gets the same reply.
+ *
+ * fd:       Listening socket from stats_listen
+ * describe: Appends the metrics to the text of the reply
+*/
+void stats_serve(int fd, void (*describe)(stats_text*));
+
+#endif
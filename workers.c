@@ -0,0 +1,436 @@
+/*
+ * workers.c
+ *
+ * Pool of decryption threads inside the client process, used instead of
+ * forked children. Each thread has its own deque of tasks and steals from
+ * the others when it runs dry.
+ *
+ * James Shephard
+ * CMPT 300 - D100 Burnaby
+ * Instructor Brian Booth
+ * TA Scott Kristjanson
+ */
+
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <semaphore.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include "decrypt.h"
+#include "stats.h"
+#include "workers.h"
+#include "memwatch.h"
+
+//Tasks a deque holds before it has to grow
+#define DEQUE_CAPACITY 16
+
+//Circular buffer of tasks. The owner takes from the front, thieves from the
+//back, so a thief gets the work its owner would reach last.
+typedef struct {
+	task* tasks;
+	int capacity;
+	int head;
+	int count;
+	pthread_mutex_t lock;
+} task_deque;
+
+//A thread and its deque
+typedef struct {
+	pthread_t thread;
+	int index;
+	task_deque deque;
+} worker;
+
+static worker* workers;
+static int worker_count = 0;
+//Deque the next task is queued on, only used by the network thread
+static int next_worker = 0;
+//Tasks submitted whose results have not been taken, network thread only
+static int outstanding = 0;
+//Posted once per queued task, and once per worker when stopping
+static sem_t pending;
+static volatile bool stopping = false;
+
+//Finished tasks waiting for the network thread
+static task_result* completed;
+static int completed_count = 0;
+static int completed_capacity = 0;
+static pthread_mutex_t completed_lock = PTHREAD_MUTEX_INITIALIZER;
+//Written to when completed goes from empty to not, so the network thread
+//can wait on it alongside its sockets
+static int notify[2];
+
+/*
+ * deque_push
+ *
+ * Adds a task to the back of a deque, growing it if full.
+ *
+ * returns: False if the deque could not grow
+*/
+static bool deque_push(task_deque* deque, task* t)
+{
+	bool result = true;
+	pthread_mutex_lock(&deque->lock);
+	if (deque->count == deque->capacity)
+	{
+		task* tasks = (task*)malloc(2 * deque->capacity * sizeof(task));
+		if (tasks == NULL)
+			result = false;
+		else
+		{
+			for (int i = 0; i < deque->count; i++)
+				tasks[i] = deque->tasks[(deque->head + i) % deque->capacity];
+			free(deque->tasks);
+			deque->tasks = tasks;
+			deque->head = 0;
+			deque->capacity *= 2;
+		}
+	}
+	if (result)
+		deque->tasks[(deque->head + deque->count++) % deque->capacity] = *t;
+	pthread_mutex_unlock(&deque->lock);
+	return result;
+}
+
+/*
+ * deque_take
+ *
+ * Removes a task from a deque.
+ *
+ * deque: Deque to take from
+ * t:     Location to store task
+ * front: True for the owner, false for a thief
+ *
+ * returns: False if the deque was empty
+*/
+static bool deque_take(task_deque* deque, task* t, bool front)
+{
+	bool result = false;
+	pthread_mutex_lock(&deque->lock);
+	if (deque->count > 0)
+	{
+		if (front)
+		{
+			*t = deque->tasks[deque->head];
+			deque->head = (deque->head + 1) % deque->capacity;
+		}
+		else
+			*t = deque->tasks[(deque->head + deque->count - 1) % deque->capacity];
+		deque->count--;
+		result = true;
+	}
+	pthread_mutex_unlock(&deque->lock);
+	return result;
+}
+
+/*
+ * find_task
+ *
+ * Takes a task from the worker's own deque, or steals one from another
+ * worker. Only called after a successful wait on pending, so a task is there
+ * to be found unless the pool is stopping or the task was cancelled.
+ *
+ * self: Worker looking for a task
+ * t:    Location to store task
+ *
+ * returns: False if every deque is empty
+*/
+static bool find_task(worker* self, task* t)
+{
+	if (deque_take(&self->deque, t, true))
+		return true;
+
+	for (int i = 1; i < worker_count; i++)
+		if (deque_take(&workers[(self->index + i) % worker_count].deque, t, false))
+			return true;
+
+	return false;
+}
+
+/*
+ * add_result
+ *
+ * Hands a finished task's result to the network thread.
+ *
+ * returns: False if there was no memory to store it
+*/
+static bool add_result(task_result* result)
+{
+	bool added = true;
+	pthread_mutex_lock(&completed_lock);
+	if (completed_count == completed_capacity)
+	{
+		int capacity = completed_capacity == 0 ? DEQUE_CAPACITY : 2 * completed_capacity;
+		task_result* grown = (task_result*)realloc(completed, capacity * sizeof(task_result));
+		if (grown == NULL)
+			added = false;
+		else
+		{
+			completed = grown;
+			completed_capacity = capacity;
+		}
+	}
+	if (added)
+	{
+		completed[completed_count++] = *result;
+		if (completed_count == 1)
+			write(notify[1], "", 1);
+	}
+	pthread_mutex_unlock(&completed_lock);
+	return added;
+}
+
+/*
+ * worker_main
+ *
+ * Body of each worker thread. Performs tasks until the pool stops.
+ *
+ * arg: The worker
+ *
+ * returns: NULL
+*/
+static void* worker_main(void* arg)
+{
+	worker* self = (worker*)arg;
+	task t;
+	task_result result;
+
+	if (!decrypt_cache_init(options.cache_entries))
+		logmessage(NULL, "Unable to allocate block cache for worker %i, continuing without it.", self->index);
+	stats_use(self->index);
+
+	while (true)
+	{
+		while (sem_wait(&pending) == -1 && errno == EINTR);
+		if (!find_task(self, &t))
+		{
+			if (stopping)
+				break;
+			continue;
+		}
+		STATS_ADD(waited, 1);
+		STATS_ADD(wait_us, (getseconds() - t.queued) * 1000000);
+
+		result.split = t.split;
+		result.id = t.id;
+		result.elapsed = getseconds();
+		result.status = task_status(perform_task(&t, result.message));
+		result.elapsed = getseconds() - result.elapsed;
+		if (!add_result(&result))
+			logmessage(NULL, "Unable to report result of %s from worker %i.", t.input_file, self->index);
+	}
+
+	if (options.cache_entries > 0)
+	{
+		unsigned long long hits, misses;
+		decrypt_cache_stats(&hits, &misses);
+		logmessage(NULL, "Worker %i block cache: %llu hits, %llu misses.", self->index, hits, misses);
+		decrypt_cache_free();
+	}
+
+	return NULL;
+}
+
+/*
+ * workers_start
+ *
+ * Starts the worker threads.
+ *
+ * count: Number of threads
+ *
+ * returns: False if the threads could not be created
+*/
+bool workers_start(int count)
+{
+	workers = (worker*)calloc(count, sizeof(worker));
+	if (workers == NULL)
+		return false;
+
+	if (pipe(notify) == -1)
+	{
+		free(workers);
+		return false;
+	}
+	fcntl(notify[0], F_SETFL, O_NONBLOCK);
+	fcntl(notify[1], F_SETFL, O_NONBLOCK);
+	sem_init(&pending, 0, 0);
+	stopping = false;
+
+	for (int i = 0; i < count; i++)
+	{
+		workers[i].index = i;
+		workers[i].deque.capacity = DEQUE_CAPACITY;
+		workers[i].deque.tasks = (task*)malloc(DEQUE_CAPACITY * sizeof(task));
+		pthread_mutex_init(&workers[i].deque.lock, NULL);
+		if (workers[i].deque.tasks == NULL ||
+			pthread_create(&workers[i].thread, NULL, worker_main, workers + i) != 0)
+		{
+			free(workers[i].deque.tasks);
+			workers_stop();
+			return false;
+		}
+		worker_count++;
+	}
+
+	return true;
+}
+
+/*
+ * workers_submit
+ *
+ * Queues a task on one of the workers' deques. Never blocks.
+ *
+ * t: Task to queue, copied
+*/
+void workers_submit(task* t)
+{
+	//Round robin, stealing evens out any imbalance
+	for (int i = 0; i < worker_count; i++)
+	{
+		worker* w = workers + (next_worker + i) % worker_count;
+		if (deque_push(&w->deque, t))
+		{
+			next_worker = (w->index + 1) % worker_count;
+			outstanding++;
+			sem_post(&pending);
+			return;
+		}
+	}
+
+	//Every deque is full and out of memory, report it like a failed task
+	task_result result;
+	result.split = t->split;
+	result.id = t->id;
+	result.status = M_ERROR;
+	result.elapsed = 0;
+	snprintf(result.message, MAX_MESSAGE_LENGTH, "Malloc failed queueing %s in process %i",
+		t->input_file, getpid());
+	outstanding++;
+	add_result(&result);
+}
+
+/*
+ * workers_cancel
+ *
+ * Removes a task that is not part of a split file from whichever deque it 
+ * is waiting on.
+ *
+ * id: Id of the task
+ *
+ * returns: False if it was not found, as it has started or finished
+*/
+bool workers_cancel(unsigned int id)
+{
+	bool cancelled = false;
+	for (int w = 0; w < worker_count && !cancelled; w++)
+	{
+		task_deque* deque = &workers[w].deque;
+		pthread_mutex_lock(&deque->lock);
+		int kept = 0;
+		for (int i = 0; i < deque->count; i++)
+		{
+			task* t = deque->tasks + (deque->head + i) % deque->capacity;
+			if (t->id == id && t->split < 0)
+			{
+				cancelled = true;
+				if (t->source[0] != '\0')
+					unlink(t->input_file);
+			}
+			else
+				deque->tasks[(deque->head + kept++) % deque->capacity] = *t;
+		}
+		deque->count = kept;
+		pthread_mutex_unlock(&deque->lock);
+	}
+
+	if (cancelled)
+	{
+		//Keep pending matched with the tasks left to find. If a worker has
+		//already been woken for it, that worker finds nothing and waits again.
+		while (sem_trywait(&pending) == -1 && errno == EINTR);
+		outstanding--;
+	}
+	return cancelled;
+}
+
+/*
+ * workers_notify_fd
+ *
+ * returns: File descriptor that becomes readable when results are waiting
+*/
+int workers_notify_fd()
+{
+	return notify[0];
+}
+
+/*
+ * workers_results
+ *
+ * Takes the results of finished tasks, without waiting.
+ *
+ * results: Location to store results
+ * max:     Most results to take
+ *
+ * returns: Number of results taken
+*/
+int workers_results(task_result* results, int max)
+{
+	char drain[64];
+	while (read(notify[0], drain, sizeof(drain)) > 0);
+
+	pthread_mutex_lock(&completed_lock);
+	int count = completed_count < max ? completed_count : max;
+	memcpy(results, completed, count * sizeof(task_result));
+	memmove(completed, completed + count, (completed_count - count) * sizeof(task_result));
+	completed_count -= count;
+	//Anything left over needs another wake up
+	if (completed_count > 0)
+		write(notify[1], "", 1);
+	pthread_mutex_unlock(&completed_lock);
+
+	outstanding -= count;
+	return count;
+}
+
+/*
+ * workers_outstanding
+ *
+ * returns: Number of tasks submitted whose results have not been taken
+*/
+int workers_outstanding()
+{
+	return outstanding;
+}
+
+/*
+ * workers_stop
+ *
+ * Lets the workers finish every queued task, then stops them and frees the
+ * pool. Results not yet taken are lost.
+*/
+void workers_stop()
+{
+	stopping = true;
+	for (int i = 0; i < worker_count; i++)
+		sem_post(&pending);
+
+	for (int i = 0; i < worker_count; i++)
+	{
+		pthread_join(workers[i].thread, NULL);
+		pthread_mutex_destroy(&workers[i].deque.lock);
+		free(workers[i].deque.tasks);
+	}
+
+	sem_destroy(&pending);
+	close(notify[0]);
+	close(notify[1]);
+	free(workers);
+	free(completed);
+	completed = NULL;
+	completed_count = completed_capacity = 0;
+	worker_count = 0;
+}
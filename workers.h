@@ -0,0 +1,95 @@
+/*
+ * workers.h
+ *
+ * Pool of decryption threads inside the client process, used instead of
+ * forked children. Each thread has its own deque of tasks and steals from
+ * the others when it runs dry.
+ *
+ * James Shephard
+ * CMPT 300 - D100 Burnaby
+ * Instructor Brian Booth
+ * TA Scott Kristjanson
+ */
+
+#ifndef _WORKERS_H_
+#define _WORKERS_H_
+
+#include "child.h"
+#include "common.h"
+
+//Outcome of a task, passed back to the network thread
+typedef struct {
+	int split;       //Split task the task was part of, -1 if none
+	unsigned int id; //Id of the task
+	char status;     //M_SUCCESS, M_SKIPPED or M_ERROR
+	double elapsed;  //Seconds spent decrypting
+	char message[MAX_MESSAGE_LENGTH];
+} task_result;
+
+/*
+ * workers_start
+ *
+ * Starts the worker threads.
+ *
+ * count: Number of threads
+ *
+ * returns: False if the threads could not be created
+*/
+bool workers_start(int count);
+
+/*
+ * workers_submit
+ *
+ * Queues a task on one of the workers' deques. Never blocks.
+ *
+ * t: Task to queue, copied
+*/
+void workers_submit(task* t);
+
+/*
+ * workers_cancel
+ *
+ * Removes a task that is not part of a split file from whichever deque it 
+ * is waiting on.
+ *
+ * id: Id of the task
+ *
+ * returns: False if it was not found, as it has started or finished
+*/
+bool workers_cancel(unsigned int id);
+
+/*
+ * workers_notify_fd
+ *
+ * returns: File descriptor that becomes readable when results are waiting
+*/
+int workers_notify_fd();
+
+/*
+ * workers_results
+ *
+ * Takes the results of finished tasks, without waiting.
+ *
+ * results: Location to store results
+ * max:     Most results to take
+ *
+ * returns: Number of results taken
+*/
+int workers_results(task_result* results, int max);
+
+/*
+ * workers_outstanding
+ *
+ * returns: Number of tasks submitted whose results have not been taken
+*/
+int workers_outstanding();
+
+/*
+ * workers_stop
+ *
+ * Lets the workers finish every queued task, then stops them and frees the
+ * pool. Results not yet taken are lost.
+*/
+void workers_stop();
+
+#endif